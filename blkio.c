@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * blkio.c
+ *
+ * Block device I/O functions shared by the tools.
+ *
+ * Copyright (c) 2024, Matthew Madison
+ */
+
+#define _GNU_SOURCE 1
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "blkio.h"
+
+/*
+ * Direct I/O buffers are aligned to this, which covers
+ * the logical block size of any device we use, and
+ * unaligned transfers go through a bounce buffer of
+ * (at most) BOUNCE_SIZE bytes.
+ */
+#define BLKIO_ALIGN 4096
+#define BOUNCE_SIZE (64 * 1024)
+
+static __thread unsigned long syscall_count;
+static __thread unsigned long long read_bytes, written_bytes;
+
+/*
+ * blkio_open
+ *
+ * Opens a file or device, with O_DIRECT if direct is true
+ * and the file system supports it.
+ *
+ * Returns: file descriptor, or -1 on error (errno set)
+ */
+int
+blkio_open (const char *pathname, int flags, bool direct)
+{
+	int fd;
+
+	if (!direct)
+		return open(pathname, flags|O_CLOEXEC);
+	fd = open(pathname, flags|O_CLOEXEC|O_DIRECT);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(pathname, flags|O_CLOEXEC);
+	return fd;
+
+} /* blkio_open */
+
+/*
+ * needs_bounce
+ *
+ * Direct I/O requires an aligned buffer.
+ */
+static bool
+needs_bounce (int fd, const void *buf)
+{
+	int flags;
+
+	if (((uintptr_t) buf % BLKIO_ALIGN) == 0)
+		return false;
+	flags = fcntl(fd, F_GETFL);
+	return flags >= 0 && (flags & O_DIRECT) != 0;
+
+} /* needs_bounce */
+
+/*
+ * read_all
+ */
+static int
+read_all (int fd, void *buf, size_t len, off_t offset)
+{
+	size_t total;
+	ssize_t n;
+
+	for (total = 0; total < len; total += n) {
+		syscall_count += 1;
+		n = pread(fd, (uint8_t *) buf + total, len - total, offset + (off_t) total);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		read_bytes += (unsigned long long) n;
+	}
+	return 0;
+
+} /* read_all */
+
+/*
+ * write_all
+ */
+static int
+write_all (int fd, const void *buf, size_t len, off_t offset)
+{
+	size_t total;
+	ssize_t n;
+
+	for (total = 0; total < len; total += n) {
+		syscall_count += 1;
+		n = pwrite(fd, (const uint8_t *) buf + total, len - total, offset + (off_t) total);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		written_bytes += (unsigned long long) n;
+	}
+	return 0;
+
+} /* write_all */
+
+/*
+ * blkio_read
+ *
+ * Reads len bytes at offset, retrying short reads.
+ * Reaching end of file before len bytes is an error.
+ *
+ * Returns: len on success, -1 on error (errno set)
+ */
+ssize_t
+blkio_read (int fd, void *buf, size_t len, off_t offset)
+{
+	void *bounce;
+	size_t pos, n;
+
+	if (!needs_bounce(fd, buf))
+		return (read_all(fd, buf, len, offset) < 0 ? -1 : (ssize_t) len);
+	if (posix_memalign(&bounce, BLKIO_ALIGN, (len < BOUNCE_SIZE ? len : BOUNCE_SIZE)) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (pos = 0; pos < len; pos += n) {
+		n = (len - pos < BOUNCE_SIZE ? len - pos : BOUNCE_SIZE);
+		if (read_all(fd, bounce, n, offset + (off_t) pos) < 0) {
+			free(bounce);
+			return -1;
+		}
+		memcpy((uint8_t *) buf + pos, bounce, n);
+	}
+	free(bounce);
+	return (ssize_t) len;
+
+} /* blkio_read */
+
+/*
+ * blkio_write
+ *
+ * Writes len bytes at offset, retrying short writes.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+blkio_write (int fd, const void *buf, size_t len, off_t offset)
+{
+	void *bounce;
+	size_t pos, n;
+
+	if (!needs_bounce(fd, buf))
+		return write_all(fd, buf, len, offset);
+	if (posix_memalign(&bounce, BLKIO_ALIGN, (len < BOUNCE_SIZE ? len : BOUNCE_SIZE)) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (pos = 0; pos < len; pos += n) {
+		n = (len - pos < BOUNCE_SIZE ? len - pos : BOUNCE_SIZE);
+		memcpy(bounce, (const uint8_t *) buf + pos, n);
+		if (write_all(fd, bounce, n, offset + (off_t) pos) < 0) {
+			free(bounce);
+			return -1;
+		}
+	}
+	free(bounce);
+	return 0;
+
+} /* blkio_write */
+
+/*
+ * blkio_syscalls
+ */
+unsigned long
+blkio_syscalls (void)
+{
+	return syscall_count;
+
+} /* blkio_syscalls */
+
+/*
+ * blkio_bytes_read/blkio_bytes_written
+ */
+unsigned long long
+blkio_bytes_read (void)
+{
+	return read_bytes;
+
+} /* blkio_bytes_read */
+
+unsigned long long
+blkio_bytes_written (void)
+{
+	return written_bytes;
+
+} /* blkio_bytes_written */
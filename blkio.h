@@ -0,0 +1,32 @@
+#ifndef blkio_h_included
+#define blkio_h_included
+/* Copyright (c) 2024, Matthew Madison */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Positional block device I/O.  When a device is opened
+ * for direct I/O, transfer offsets and lengths must be
+ * multiples of BLKIO_SECTOR_SIZE; buffers need not be
+ * aligned.
+ */
+#define BLKIO_SECTOR_SIZE 512
+
+int blkio_open(const char *pathname, int flags, bool direct);
+ssize_t blkio_read(int fd, void *buf, size_t len, off_t offset);
+int blkio_write(int fd, const void *buf, size_t len, off_t offset);
+/*
+ * Number of read and write system calls issued
+ * by blkio_read/blkio_write in the calling thread.
+ */
+unsigned long blkio_syscalls(void);
+/*
+ * Number of bytes transferred by blkio_read/blkio_write
+ * in the calling thread.
+ */
+unsigned long long blkio_bytes_read(void);
+unsigned long long blkio_bytes_written(void);
+
+#endif /* blkio_h_included */
@@ -0,0 +1,492 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * bootinfo-bench.c
+ *
+ * Benchmark for librkbootinfo, run against a storage image
+ * (a file, ideally on tmpfs, or a loop device) rather than
+ * the real boot device, so that changes to the storage format
+ * or engine can be measured off-target.
+ *
+ * For each combination of variable count and value size, the
+ * latency of open, get, set, update and the boot-state marks is
+ * measured, along with the number of write calls and bytes
+ * written, taken from /proc/self/io.  Since writes to tmpfs cost
+ * next to nothing, a modelled time is also reported, which adds
+ * a fixed cost per synchronous (O_DSYNC) write call plus the
+ * transfer time at a given write rate, to approximate an eMMC.
+ *
+ * Copyright (c) 2024, Matthew Madison
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "bootinfo.h"
+
+#define DEFAULT_ITERATIONS 50
+#define DEFAULT_SYNC_LATENCY_US 500.0
+#define DEFAULT_WRITE_RATE_MBPS 20.0
+
+static const unsigned int varcounts[] = { 8, 64, 256 };
+static const size_t valuesizes[] = { 16, 256, 1024 };
+
+static struct option options[] = {
+	{ "image",		required_argument,	0, 'f' },
+	{ "lock-dir",		required_argument,	0, 'd' },
+	{ "offset",		required_argument,	0, 'o' },
+	{ "iterations",		required_argument,	0, 'n' },
+	{ "sync-latency",	required_argument,	0, 'l' },
+	{ "write-rate",		required_argument,	0, 'r' },
+	{ "help",		no_argument,		0, 'h' },
+	{ 0,			0,			0, 0   }
+};
+static const char *shortopts = ":f:d:o:n:l:r:h";
+
+static char *optarghelp[] = {
+	"--image=PATH         ",
+	"--lock-dir=PATH      ",
+	"--offset=BYTES       ",
+	"--iterations=COUNT   ",
+	"--sync-latency=USEC  ",
+	"--write-rate=MBPS    ",
+	"--help               ",
+};
+
+static char *opthelp[] = {
+	"storage image or device to use, contents are destroyed (default: temporary file)",
+	"lock directory (default: temporary directory)",
+	"offset of the first copy of the store (default: 0)",
+	"timed iterations per operation (default: 50)",
+	"modelled cost of each synchronous write call, in microseconds (default: 500)",
+	"modelled device write rate, in MB/s (default: 20)",
+	"display this help text",
+};
+
+static double sync_latency_us = DEFAULT_SYNC_LATENCY_US;
+static double write_rate_mbps = DEFAULT_WRITE_RATE_MBPS;
+
+/*
+ * Results for one operation: per-call latencies, and
+ * the write calls and bytes attributed to the operation.
+ */
+struct op_stats {
+	const char *name;
+	double *samples;
+	unsigned int count;
+	unsigned long long writes;
+	unsigned long long bytes;
+};
+
+struct io_counters {
+	unsigned long long wchar;
+	unsigned long long syscw;
+};
+
+static void
+print_usage (void)
+{
+	int i;
+	printf("\nUsage:\n");
+	printf("\tbootinfo-bench <option>...\n\n");
+	printf("Options:\n");
+	for (i = 0; i < sizeof(options)/sizeof(options[0]) && options[i].name != 0; i++) {
+		printf(" %s\t%c%c\t%s\n",
+		       optarghelp[i],
+		       (options[i].val == 0 ? ' ' : '-'),
+		       (options[i].val == 0 ? ' ' : options[i].val),
+		       opthelp[i]);
+	}
+
+} /* print_usage */
+
+/*
+ * get_io_counters
+ *
+ * Writes through a mapping (the snapshot) are not
+ * included, only write calls, which is what the storage
+ * device sees.
+ */
+static void
+get_io_counters (struct io_counters *io)
+{
+	char line[128];
+	FILE *fp;
+
+	memset(io, 0, sizeof(*io));
+	fp = fopen("/proc/self/io", "r");
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "wchar:", 6) == 0)
+			io->wchar = strtoull(line + 6, NULL, 10);
+		else if (strncmp(line, "syscw:", 6) == 0)
+			io->syscw = strtoull(line + 6, NULL, 10);
+	}
+	fclose(fp);
+
+} /* get_io_counters */
+
+static double
+elapsed_us (const struct timespec *start, const struct timespec *end)
+{
+	return (double) (end->tv_sec - start->tv_sec) * 1e6 +
+		(double) (end->tv_nsec - start->tv_nsec) / 1e3;
+
+} /* elapsed_us */
+
+/*
+ * Timing brackets around one call of an operation.
+ */
+struct sample {
+	struct io_counters io;
+	struct timespec start;
+};
+
+static void
+sample_begin (struct sample *s)
+{
+	get_io_counters(&s->io);
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+
+} /* sample_begin */
+
+static void
+sample_end (struct sample *s, struct op_stats *st)
+{
+	struct timespec end;
+	struct io_counters io;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	get_io_counters(&io);
+	st->samples[st->count++] = elapsed_us(&s->start, &end);
+	st->writes += io.syscw - s->io.syscw;
+	st->bytes += io.wchar - s->io.wchar;
+
+} /* sample_end */
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static void
+print_stats (unsigned int varcount, size_t valuesize, struct op_stats *st)
+{
+	double total = 0.0, writes, bytes, model;
+	unsigned int i;
+
+	if (st->count == 0)
+		return;
+	qsort(st->samples, st->count, sizeof(st->samples[0]), compare_doubles);
+	for (i = 0; i < st->count; i++)
+		total += st->samples[i];
+	writes = (double) st->writes / st->count;
+	bytes = (double) st->bytes / st->count;
+	model = total / st->count + writes * sync_latency_us + bytes / write_rate_mbps;
+	printf("%5u %6zu  %-17s %10.1f %10.1f %10.1f %8.1f %10.0f %10.1f\n",
+	       varcount, valuesize, st->name, total / st->count,
+	       st->samples[st->count / 2], st->samples[st->count - 1],
+	       writes, bytes, model);
+
+} /* print_stats */
+
+static void
+make_value (char *buf, size_t size, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = 'a' + (char) ((seed + i) % 26);
+	buf[size] = '\0';
+
+} /* make_value */
+
+/*
+ * run_case
+ *
+ * Initializes the store with varcount variables of the given
+ * value size, then times each operation.
+ *
+ * Returns 0 on success, 1 if the variables do not fit,
+ * -1 on error.
+ */
+static int
+run_case (const struct bootinfo_config *config, unsigned int varcount,
+	  size_t valuesize, unsigned int iterations)
+{
+	struct op_stats stats[] = {
+		{ "open" },
+		{ "open (snapshot)" },
+		{ "get" },
+		{ "set" },
+		{ "update" },
+		{ "mark_in_progress" },
+		{ "mark_successful" },
+	};
+	enum { OPEN, OPEN_SNAP, GET, SET, UPDATE, MARK_IN_PROGRESS, MARK_SUCCESSFUL };
+	bootinfo_ctx_t *ctx = NULL;
+	char name[32], *value, *valuebuf;
+	struct sample s;
+	unsigned int i, j, failed;
+	int ret = -1;
+
+	valuebuf = malloc(valuesize + 1);
+	if (valuebuf == NULL)
+		return -1;
+	for (i = 0; i < sizeof(stats)/sizeof(stats[0]); i++) {
+		stats[i].samples = calloc(iterations, sizeof(double));
+		if (stats[i].samples == NULL)
+			goto depart;
+	}
+
+	if (bootinfo_open_config(&ctx, BOOTINFO_O_FORCE_INIT|BOOTINFO_O_NO_DAEMON, config) < 0) {
+		perror("initializing store");
+		goto depart;
+	}
+	if (bootinfo_batch_begin(ctx) < 0)
+		goto error;
+	for (i = 0; i < varcount; i++) {
+		sprintf(name, "var%04u", i);
+		make_value(valuebuf, valuesize, i);
+		if (bootinfo_batch_set(ctx, name, valuebuf) < 0)
+			goto nofit;
+	}
+	if (bootinfo_batch_commit(ctx) < 0)
+		goto nofit;
+	bootinfo_close(ctx);
+	ctx = NULL;
+
+	for (i = 0; i < iterations; i++) {
+		sample_begin(&s);
+		if (bootinfo_open_config(&ctx, BOOTINFO_O_RDONLY|BOOTINFO_O_NO_DAEMON, config) < 0)
+			goto error;
+		bootinfo_close(ctx);
+		sample_end(&s, &stats[OPEN]);
+		sample_begin(&s);
+		if (bootinfo_open_config(&ctx, BOOTINFO_O_RDONLY, config) < 0)
+			goto error;
+		bootinfo_close(ctx);
+		sample_end(&s, &stats[OPEN_SNAP]);
+	}
+	ctx = NULL;
+
+	if (bootinfo_open_config(&ctx, BOOTINFO_O_NO_DAEMON, config) < 0)
+		goto error;
+	for (i = 0; i < iterations; i++) {
+		sprintf(name, "var%04u", (i * 7919) % varcount);
+		sample_begin(&s);
+		if (bootinfo_bootvar_get(ctx, name, &value) < 0)
+			goto error;
+		sample_end(&s, &stats[GET]);
+	}
+	for (i = 0; i < iterations; i++) {
+		sprintf(name, "var%04u", (i * 7919) % varcount);
+		make_value(valuebuf, valuesize, i + varcount);
+		sample_begin(&s);
+		if (bootinfo_bootvar_set(ctx, name, valuebuf) < 0)
+			goto error;
+		sample_end(&s, &stats[SET]);
+		sample_begin(&s);
+		if (bootinfo_update(ctx) < 0)
+			goto error;
+		sample_end(&s, &stats[UPDATE]);
+	}
+	for (i = 0; i < iterations; i++) {
+		sample_begin(&s);
+		if (bootinfo_mark_in_progress(ctx, &failed) < 0)
+			goto error;
+		sample_end(&s, &stats[MARK_IN_PROGRESS]);
+		sample_begin(&s);
+		if (bootinfo_mark_successful(ctx, &failed) < 0)
+			goto error;
+		sample_end(&s, &stats[MARK_SUCCESSFUL]);
+	}
+	for (j = 0; j < sizeof(stats)/sizeof(stats[0]); j++)
+		print_stats(varcount, valuesize, &stats[j]);
+	ret = 0;
+	goto depart;
+
+  nofit:
+	if (errno == EMSGSIZE) {
+		ret = 1;
+		goto depart;
+	}
+  error:
+	fprintf(stderr, "%u variables of %zu bytes: %s\n", varcount, valuesize, strerror(errno));
+  depart:
+	if (ctx != NULL)
+		bootinfo_close(ctx);
+	for (i = 0; i < sizeof(stats)/sizeof(stats[0]); i++)
+		free(stats[i].samples);
+	free(valuebuf);
+	return ret;
+
+} /* run_case */
+
+/*
+ * remove_lockdir
+ *
+ * Cleans up a temporary lock directory.
+ */
+static void
+remove_lockdir (const char *dir)
+{
+	static const char *files[] = { "snapshot", "lockfile" };
+	char path[PATH_MAX];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(files)/sizeof(files[0]); i++) {
+		if (snprintf(path, sizeof(path), "%s/%s", dir, files[i]) < sizeof(path))
+			unlink(path);
+	}
+	rmdir(dir);
+
+} /* remove_lockdir */
+
+/*
+ * main program
+ */
+int
+main (int argc, char * const argv[])
+{
+	struct bootinfo_config config, defaults;
+	char tmpdir[PATH_MAX], imagepath[PATH_MAX];
+	const char *image = NULL, *lockdir = NULL, *base;
+	unsigned int iterations = DEFAULT_ITERATIONS;
+	unsigned int i, j;
+	off_t offset = 0, span;
+	struct stat st;
+	bool made_tmpdir = false, made_image = false;
+	int c, fd, ret = 0;
+
+	for (;;) {
+		c = getopt_long(argc, argv, shortopts, options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'f':
+			image = optarg;
+			break;
+		case 'd':
+			lockdir = optarg;
+			break;
+		case 'o':
+			offset = strtoll(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			sync_latency_us = strtod(optarg, NULL);
+			break;
+		case 'r':
+			write_rate_mbps = strtod(optarg, NULL);
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			fprintf(stderr, "Error: unrecognized option\n");
+			print_usage();
+			return 1;
+		}
+	}
+	if (iterations == 0 || write_rate_mbps <= 0.0) {
+		fprintf(stderr, "Error: iterations and write rate must be positive\n");
+		return 1;
+	}
+	if (offset < 0 || offset % 512 != 0) {
+		fprintf(stderr, "Error: offset must be a multiple of 512\n");
+		return 1;
+	}
+
+	/*
+	 * The copies are placed back to back, the same
+	 * distance apart as in the default layout.
+	 */
+	bootinfo_config_init(&defaults);
+	span = defaults.storage_offset_b - defaults.storage_offset_a;
+	if (span < 0)
+		span = -span;
+
+	if (image == NULL || lockdir == NULL) {
+		base = getenv("TMPDIR");
+		if (base == NULL)
+			base = (access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp");
+		if (snprintf(tmpdir, sizeof(tmpdir), "%s/bootinfo-bench.XXXXXX", base) >= sizeof(tmpdir) ||
+		    mkdtemp(tmpdir) == NULL) {
+			perror(tmpdir);
+			return 1;
+		}
+		made_tmpdir = true;
+	}
+	if (image == NULL) {
+		if (snprintf(imagepath, sizeof(imagepath), "%s/store.img", tmpdir) >= sizeof(imagepath)) {
+			fprintf(stderr, "Error: temporary directory name too long\n");
+			ret = 1;
+			goto depart;
+		}
+		image = imagepath;
+		made_image = true;
+	}
+	if (lockdir == NULL)
+		lockdir = tmpdir;
+
+	/*
+	 * A regular file is extended to hold both copies.
+	 */
+	fd = open(image, O_RDWR|O_CREAT, 0600);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(image);
+		ret = 1;
+		goto depart;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size < offset + 2 * span &&
+	    ftruncate(fd, offset + 2 * span) < 0) {
+		perror(image);
+		close(fd);
+		ret = 1;
+		goto depart;
+	}
+	close(fd);
+
+	bootinfo_config_init(&config);
+	config.storage_device = image;
+	config.storage_offset_a = offset;
+	config.storage_offset_b = offset + span;
+	config.lock_dir = lockdir;
+	config.flags = BOOTINFO_CFG_NO_FORCE_RO;
+
+	printf("image: %s, lock directory: %s, %u iterations\n", image, lockdir, iterations);
+	printf("model: %.0f us per write call, %.1f MB/s\n\n", sync_latency_us, write_rate_mbps);
+	printf("%5s %6s  %-17s %10s %10s %10s %8s %10s %10s\n", "vars", "size", "operation",
+	       "mean us", "p50 us", "max us", "writes", "bytes", "model us");
+	for (i = 0; i < sizeof(varcounts)/sizeof(varcounts[0]); i++) {
+		for (j = 0; j < sizeof(valuesizes)/sizeof(valuesizes[0]); j++) {
+			c = run_case(&config, varcounts[i], valuesizes[j], iterations);
+			if (c < 0)
+				ret = 1;
+			else if (c > 0)
+				printf("%5u %6zu  (does not fit)\n", varcounts[i], valuesizes[j]);
+		}
+	}
+
+  depart:
+	if (made_image)
+		unlink(image);
+	if (made_tmpdir)
+		remove_lockdir(tmpdir);
+	return ret;
+
+} /* main */
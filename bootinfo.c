@@ -29,6 +29,7 @@
 #define _GNU_SOURCE 1
 #endif
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -37,16 +38,49 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
 #include <zlib.h>
 #include "bootinfo.h"
+#include "bootinfod.h"
 #include "util.h"
+#include "blkio.h"
+#include "checksum.h"
 
 static const char DEVICE_MAGIC[8] = {'B', 'O', 'O', 'T', 'I', 'N', 'F', 'O'};
 #define DEVICE_MAGIC_SIZE sizeof(DEVICE_MAGIC)
 
-static const uint16_t DEVINFO_VERSION_CURRENT = 4;
+static const char BOOTSTATE_MAGIC[8] = {'B', 'O', 'O', 'T', 'S', 'T', 'A', 'T'};
+#define BOOTSTATE_MAGIC_SIZE sizeof(BOOTSTATE_MAGIC)
+
+static const char JOURNAL_MAGIC[8] = {'B', 'O', 'O', 'T', 'J', 'R', 'N', 'L'};
+#define JOURNAL_MAGIC_SIZE sizeof(JOURNAL_MAGIC)
+
+static const uint16_t DEVINFO_VERSION_CURRENT = 7;
+/*
+ * Oldest layout version we can read.  Version 5 adds
+ * the boot-state journal sectors, version 6 the
+ * variable space length, and version 7 the per-chunk
+ * extension checksums, described below.  Version 8,
+ * the variable journal, is only used for stores set up
+ * for it (see bootinfo_config); otherwise updates write
+ * DEVINFO_VERSION_CURRENT.
+ */
+#define DEVINFO_VERSION_MIN		4
+#define DEVINFO_VERSION_BOOTSTATE	5
+#define DEVINFO_VERSION_VARLEN		6
+#define DEVINFO_VERSION_CHUNKCRC	7
+#define DEVINFO_VERSION_JOURNAL		8
+#define DEVINFO_VERSION_MAX		DEVINFO_VERSION_JOURNAL
 
 #ifndef EXTENSION_SECTOR_COUNT
 #define EXTENSION_SECTOR_COUNT 1023
@@ -54,7 +88,7 @@ static const uint16_t DEVINFO_VERSION_CURRENT = 4;
 
 #define MAX_EXTENSION_SECTORS 1023
 
-#if (EXTENSION_SECTOR_COUNT == 0) || (EXTENSION_SECTOR_COUNT > MAX_EXTENSION_SECTORS)
+#if (EXTENSION_SECTOR_COUNT < 2) || (EXTENSION_SECTOR_COUNT > MAX_EXTENSION_SECTORS)
 #error "EXTENSION_SECTOR_COUNT out of range"
 #endif
 
@@ -69,6 +103,9 @@ static const uint16_t DEVINFO_VERSION_CURRENT = 4;
  */
 #define DEVINFO_BLOCK_SIZE 512
 #define EXTENSION_SIZE (EXTENSION_SECTOR_COUNT*512)
+#define SECTOR_SIZE 512
+#define INFOBLOCK_SECTORS (1+EXTENSION_SECTOR_COUNT)
+#define INFOBLOCK_SIZE (INFOBLOCK_SECTORS*SECTOR_SIZE)
 
 struct device_info {
 	unsigned char magic[DEVICE_MAGIC_SIZE];
@@ -79,16 +116,171 @@ struct device_info {
 	uint8_t	 sernum;
 	uint8_t	 unused__;
 	uint16_t ext_sectors;
+	/* version 5 and later */
+	uint32_t bootstate_seq;
+	/* version 6 and later */
+	uint32_t var_len;
+	uint32_t ext_crcsum;
 } __attribute__((packed));
 #define FLAG_BOOT_IN_PROGRESS	(1<<0)
 #define DEVINFO_HDR_SIZE sizeof(struct device_info)
-#define VARSPACE_SIZE (DEVINFO_BLOCK_SIZE+EXTENSION_SIZE-(DEVINFO_HDR_SIZE+sizeof(uint32_t)))
+
+/*
+ * Starting with version 5, the last extension sector of each
+ * copy is excluded from the variable space and holds a boot-state
+ * journal record instead.  Marking a boot in progress or successful
+ * writes the next record into the journal sector not holding the
+ * latest record, so a single sector is written and a torn write
+ * leaves the previous state intact.  The record with the highest
+ * sequence number, among the journal records and the current
+ * header, holds the boot state.
+ */
+struct bootstate_record {
+	unsigned char magic[BOOTSTATE_MAGIC_SIZE];
+	uint32_t seq;
+	uint8_t	 flags;
+	uint8_t	 failed_boots;
+	uint16_t unused__;
+	uint32_t crcsum;
+} __attribute__((packed));
+#define BOOTSTATE_SECTOR (INFOBLOCK_SECTORS-1)
+#define BOOTSTATE_OFFSET (BOOTSTATE_SECTOR*SECTOR_SIZE)
+
+/*
+ * Starting with version 6, the header records the number of bytes
+ * of variable space in use (var_len, including the null byte ending
+ * the list), and carries the checksum for the extension sectors that
+ * those bytes spill into, rather than having a checksum at the end
+ * of the extension.  Only the extension sectors in use are read,
+ * checksummed, and written.
+ */
+#define VARSPACE_SIZE (BOOTSTATE_OFFSET-DEVINFO_HDR_SIZE)
+/*
+ * Starting with version 7, the extension bytes in use are
+ * checksummed in CRC_CHUNK_SIZE chunks instead of as a whole,
+ * with a table of the chunk checksums following the header
+ * (and so covered by the header checksum), ahead of the
+ * variable space.  The checksum for a chunk covers only its
+ * bytes in use; ext_crcsum is not used.  An update recomputes
+ * the checksums only for chunks that changed.
+ *
+ * VARSPACE_SIZE above is the largest variable space of any
+ * layout, for sizing buffers.
+ */
+#define CRC_CHUNK_SIZE 8192
+#define CRC_CHUNK_SECTORS (CRC_CHUNK_SIZE/SECTOR_SIZE)
+#define CRC_CHUNK_COUNT ((BOOTSTATE_OFFSET-DEVINFO_BLOCK_SIZE+CRC_CHUNK_SIZE-1)/CRC_CHUNK_SIZE)
+#define CHUNK_TABLE_SIZE (CRC_CHUNK_COUNT*sizeof(uint32_t))
 /*
  * Maximum size for a variable value is all of the variable space minus two bytes
  * for null terminators (for name and value) and one byte for a name, plus one
  * byte for the null character terminating the variable list.
  */
-#define MAX_VALUE_SIZE (VARSPACE_SIZE-4)
+#define MAX_VALUE_SIZE (VARSPACE_SIZE-CHUNK_TABLE_SIZE-4)
+
+/*
+ * Version 8 has the same layout as version 7, with the
+ * extension sectors between the end of the variable space in
+ * use and the boot-state journal sector holding a journal of
+ * the variable sets made since the copy was written.  Each
+ * update appends one record, starting on a sector boundary, to
+ * the journal of the current copy, packed as in the variable
+ * space, with an empty value for a deleted variable.  Only the
+ * record's sectors are written, and the header is left alone.
+ *
+ * Records follow each other with no gaps, with seq counting up
+ * from 1, and base_seq holding the bootstate_seq of the header
+ * they extend, so that records left over from an earlier use
+ * of the copy are not taken for new ones.  Reading the journal
+ * stops at the first record that is not valid, so a torn write
+ * of a record loses only that update.  When a record does not
+ * fit in the space left, or the other copy is not valid, the
+ * update writes all of the variables to the other copy instead,
+ * as with version 7, which starts a new, empty journal.
+ */
+struct journal_record {
+	unsigned char magic[JOURNAL_MAGIC_SIZE];
+	uint32_t base_seq;
+	uint32_t seq;
+	uint32_t len;
+	/* over the record, with crcsum zero, and the variable data */
+	uint32_t crcsum;
+} __attribute__((packed));
+#define JOURNAL_READ_SECTORS 32
+#ifndef BOOTINFO_DEFAULT_LAYOUT
+#define BOOTINFO_DEFAULT_LAYOUT BOOTINFO_LAYOUT_COPIES
+#endif
+#if (BOOTINFO_DEFAULT_LAYOUT != BOOTINFO_LAYOUT_COPIES) && (BOOTINFO_DEFAULT_LAYOUT != BOOTINFO_LAYOUT_JOURNAL)
+#error "BOOTINFO_DEFAULT_LAYOUT must be BOOTINFO_LAYOUT_COPIES or BOOTINFO_LAYOUT_JOURNAL"
+#endif
+
+/*
+ * Encoded values.  Values set through the API may only contain
+ * printable characters, so a stored value beginning with
+ * VALUE_ENCODED is not a plain string.  The one encoding is
+ * VALUE_DEFLATE: the two marker bytes, the length of the original
+ * value in decimal, a colon, and then the zlib stream for the
+ * value, with each NUL or VALUE_ESCAPE byte in the stream stored
+ * as VALUE_ESCAPE followed by that byte plus one, so it can be
+ * kept as a string.  Values of at least BOOTINFO_COMPRESS_MIN
+ * bytes are stored this way when that makes them smaller; see
+ * pack_vars() and decode_value().
+ */
+#define VALUE_ENCODED '\001'
+#define VALUE_DEFLATE 'z'
+#define VALUE_ESCAPE '\001'
+#ifndef BOOTINFO_COMPRESS_MIN
+#define BOOTINFO_COMPRESS_MIN 256
+#endif
+/*
+ * Limit on the total size of the variable values once decoded,
+ * so that a daemon reply carrying all of them always fits.
+ */
+#define MAX_DECODED_SIZE (BOOTINFOD_MAX_MESSAGE/2)
+
+/*
+ * Snapshot of the variable store in /run, published by writers
+ * (contexts holding the exclusive lock) after every change to storage,
+ * so that read-only opens can get a consistent view without taking the
+ * lock or doing device I/O.  The snapshot header is followed by the
+ * packed variables.
+ *
+ * seq is a sequence lock: the writer makes it odd while changing the
+ * snapshot and even again when done, and readers retry if it is odd
+ * or changed while they copied.  pending is set while a writer is
+ * updating storage; the snapshot then still matches what is committed,
+ * unless the writer died before publishing, which readers detect by
+ * the lock no longer being held.  valid is cleared when the snapshot
+ * cannot be kept in step with storage.
+ */
+#define SNAPSHOT_NAME "snapshot"
+static const char SNAPSHOT_MAGIC[8] = {'B', 'I', 'S', 'N', 'A', 'P', '0', '2'};
+struct bootinfo_snapshot {
+	unsigned char magic[8];
+	uint32_t seq;
+	uint32_t valid;
+	uint32_t pending;
+	uint16_t devinfo_version;
+	uint8_t	 flags;
+	uint8_t	 failed_boots;
+	uint16_t ext_sectors;
+	uint8_t	 sernum;
+	uint8_t	 unused__;
+	uint32_t bootstate_seq;
+	uint32_t var_len;
+	/* seq of the last variable journal record, for version 8 */
+	uint32_t journal_seq;
+};
+#define SNAPSHOT_SIZE (sizeof(struct bootinfo_snapshot) + VARSPACE_SIZE)
+#define SNAPSHOT_READ_TRIES 100
+
+/*
+ * Longest time an update requested with bootinfo_update_async()
+ * may be held back, so that later requests can share its write.
+ */
+#ifndef BOOTINFO_ASYNC_DELAY_MS
+#define BOOTINFO_ASYNC_DELAY_MS 1000
+#endif
 
 #ifndef BOOTINFO_STORAGE_OFFSET_A
 #define BOOTINFO_STORAGE_OFFSET_A  0
@@ -102,12 +294,50 @@ struct device_info {
 #ifndef BOOTINFO_STORAGE_OFFSET_B
 #define BOOTINFO_STORAGE_OFFSET_B (BOOTINFO_STORAGE_OFFSET_A + DEVINFO_BLOCK_SIZE + EXTENSION_SIZE)
 #endif
+#define OFFSET_COUNT 2
+#define LOCKFILE_NAME "lockfile"
+
+/*
+ * Where the store is, from the bootinfo_config passed to
+ * bootinfo_open_config(), or the built-in defaults.  An
+ * empty device name means the default device is to be
+ * looked up with find_storage_dev().
+ */
+struct storage_backend {
+	char device[PATH_MAX];
+	off_t devinfo_offset[OFFSET_COUNT];
+	char lockdir[PATH_MAX];
+	bool set_force_ro;
+	/* layout version for updates, 0 to keep the store's */
+	uint16_t layout_version;
+};
+#define EXTENSION_OFFSET(b_, i_) ((b_)->devinfo_offset[i_] + DEVINFO_BLOCK_SIZE)
 
+/*
+ * Variables are kept in an array, in storage order, that is
+ * allocated in one piece together with the name index; see
+ * alloc_vars().
+ */
 struct info_var {
-	struct info_var *next;
 	char *name;
 	char *value;
+	/* decoded copy of an encoded value, see decode_value() */
+	char *plain;
+	/* set since the last update, for the variable journal */
+	bool modified;
+};
+
+/*
+ * Chunk of string storage for batched sets, so the
+ * caller need not keep its strings around; see copy_string().
+ */
+struct str_chunk {
+	struct str_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
 };
+#define STR_CHUNK_SIZE 4096
 
 
 struct devinfo_context {
@@ -118,374 +348,2937 @@ struct devinfo_context {
 	int current;
 	struct device_info curinfo;
 	struct info_var *vars;
+	unsigned int varcount;
+	unsigned int maxvars;
 	size_t varsize;
-	uint8_t infobuf[2][DEVINFO_BLOCK_SIZE+EXTENSION_SIZE];
-	char devinfo_dev[PATH_MAX];
-	/* storage for setting variables */
-	char namebuf[DEVINFO_BLOCK_SIZE];
-	char valuebuf[MAX_VALUE_SIZE];
+	/* name index for the variable array, see index_var() */
+	uint32_t *varindex;
+	size_t varindex_size;
+	/*
+	 * The variable array entries in name order, for prefix
+	 * queries; built when first needed, see sort_vars().
+	 */
+	uint32_t *sorted;
+	unsigned int sorted_size;
+	bool sorted_valid;
+	/*
+	 * Packed variables not held in infobuf (preserved across
+	 * re-initialization, or received from rk-bootinfod).
+	 */
+	char *varstore;
+	/*
+	 * Connection to rk-bootinfod, or -1 if the context accesses
+	 * storage directly; sets made through the daemon are packed
+	 * into pending[] until they are committed.
+	 */
+	int daemonfd;
+	/* writer's mapping of the snapshot, see snapshot_map() */
+	struct bootinfo_snapshot *snapshot;
+	char *pending;
+	size_t pending_len;
+	size_t pending_size;
+	/*
+	 * State for a batch of sets (see bootinfo_batch_begin()):
+	 * the variable array as it was when the batch started,
+	 * for rolling back, and copies of the strings set.
+	 */
+	bool in_batch;
+	struct info_var *batch_vars;
+	unsigned int batch_varcount;
+	size_t batch_varsize;
+	size_t batch_pending_len;
+	struct str_chunk *strings;
+	/*
+	 * cached[i] is the number of leading sectors of infobuf[i]
+	 * known to match what is in storage for copy i; only those
+	 * sectors of the variable space that are marked in dirty[]
+	 * need to be written on update.
+	 */
+	unsigned int cached[2];
+	uint8_t dirty[(INFOBLOCK_SECTORS+7)/8];
+	/*
+	 * Sequence number of the latest boot state, and the journal
+	 * slot holding it (-1 if it is in the current header).
+	 */
+	uint32_t bootstate_seq;
+	int bootstate_slot;
+	/*
+	 * ext_checked[i] is true once the extension block for copy i
+	 * has been read and verified; with BOOTINFO_O_HEADER_ONLY, that
+	 * is deferred until the variables are needed.
+	 */
+	bool ext_checked[2];
+	/* the boot-state journal sector was read when probing the copy */
+	bool bootstate_read[2];
+	/*
+	 * For version 8 copies whose extension has been checked,
+	 * the sector following the last valid journal record, and
+	 * the seq of that record (0 if the journal is empty).
+	 */
+	unsigned int journal_end[2];
+	uint32_t journal_seq[2];
+	bool vars_loaded;
+	/*
+	 * Buffers for the two copies, see map_infobufs(); NULL
+	 * for contexts that do not access storage directly.
+	 */
+	uint8_t *infobuf[2];
+	struct storage_backend backend;
+	struct bootinfo_stats stats;
+	/*
+	 * Background writer for bootinfo_update_async().  Once it
+	 * has been started, async_lock serializes the public API
+	 * calls with the updates it does.
+	 */
+	bool async_started;
+	bool async_pending;
+	bool async_flush;
+	bool async_stop;
+	int async_error;
+	struct timespec async_deadline;
+	pthread_t async_thread;
+	pthread_mutex_t async_lock;
+	pthread_cond_t async_cond;
+};
+
+static void
+lock_ctx (struct devinfo_context *ctx)
+{
+	if (ctx->async_started)
+		pthread_mutex_lock(&ctx->async_lock);
+}
+
+static void
+unlock_ctx (struct devinfo_context *ctx)
+{
+	if (ctx->async_started)
+		pthread_mutex_unlock(&ctx->async_lock);
+}
+
+static const char *devinfo_devices[] = {
+	[0] = BOOTINFO_STORAGE_DEVICE,
+};
+
+/*
+ * find_storage_dev
+ *
+ * Identifies the devinfo storage device
+ * by iterating through devinfo_devices[]. First
+ * successful access(F_OK) wins.
+ *
+ * returns 0 on success, non-0 on failure.
+ */
+static int
+find_storage_dev (char *buf, size_t bufsize)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(devinfo_devices)/sizeof(devinfo_devices[0]); i++) {
+		if (access(devinfo_devices[i], F_OK) == 0) {
+		        strncpy(buf, devinfo_devices[i], bufsize-1);
+			buf[bufsize-1] = '\0';
+			return 0;
+		}
+	}
+	errno = ENODEV;
+	return -1;
+
+} /* find_storage_dev */
+
+/*
+ * Tracing of storage accesses, enabled by setting BOOTINFO_TRACE
+ * in the environment to "stderr" (or "1"), or to "syslog" (or
+ * "journal") for the system log.
+ */
+enum {
+	TRACE_OFF,
+	TRACE_STDERR,
+	TRACE_SYSLOG,
 };
+static int trace_mode;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static void
+trace_init (void)
+{
+	const char *s = secure_getenv("BOOTINFO_TRACE");
+
+	if (s == NULL || *s == '\0' || strcmp(s, "0") == 0)
+		trace_mode = TRACE_OFF;
+	else if (strcmp(s, "syslog") == 0 || strcmp(s, "journal") == 0)
+		trace_mode = TRACE_SYSLOG;
+	else
+		trace_mode = TRACE_STDERR;
+
+} /* trace_init */
+
+static bool
+tracing (void)
+{
+	pthread_once(&trace_once, trace_init);
+	return trace_mode != TRACE_OFF;
+
+} /* tracing */
+
+/*
+ * trace
+ *
+ * Emits a trace message, if tracing is enabled.
+ * Preserves errno.
+ */
+static void __attribute__((format(printf, 1, 2)))
+trace (const char *fmt, ...)
+{
+	va_list ap;
+	int save_errno = errno;
+
+	if (!tracing())
+		return;
+	va_start(ap, fmt);
+	if (trace_mode == TRACE_SYSLOG)
+		vsyslog(LOG_DEBUG, fmt, ap);
+	else {
+		flockfile(stderr);
+		fprintf(stderr, "bootinfo[%d]: ", (int) getpid());
+		vfprintf(stderr, fmt, ap);
+		fputc('\n', stderr);
+		funlockfile(stderr);
+	}
+	va_end(ap);
+	errno = save_errno;
+
+} /* trace */
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+
+} /* now_ns */
+
+/*
+ * dev_read/dev_write
+ *
+ * blkio_read/blkio_write on the storage device,
+ * accounted for in the context statistics.
+ */
+static int
+dev_read (struct bootinfo_stats *st, int fd, void *buf, size_t len, off_t offset)
+{
+	unsigned long calls = blkio_syscalls();
+	uint64_t start = now_ns(), t;
+	ssize_t n;
+
+	n = blkio_read(fd, buf, len, offset);
+	t = now_ns() - start;
+	st->read_calls += blkio_syscalls() - calls;
+	st->read_ns += t;
+	if (n >= 0)
+		st->read_bytes += len;
+	trace("read %zu bytes at 0x%llx: %s, %llu us", len, (unsigned long long) offset,
+	      (n < 0 ? strerror(errno) : "ok"), (unsigned long long) t / 1000);
+	return (n < 0 ? -1 : 0);
+
+} /* dev_read */
+
+static int
+dev_write (struct bootinfo_stats *st, int fd, const void *buf, size_t len, off_t offset)
+{
+	unsigned long calls = blkio_syscalls();
+	uint64_t start = now_ns(), t;
+	int ret;
+
+	ret = blkio_write(fd, buf, len, offset);
+	t = now_ns() - start;
+	st->write_calls += blkio_syscalls() - calls;
+	st->write_ns += t;
+	if (ret == 0)
+		st->write_bytes += len;
+	trace("write %zu bytes at 0x%llx: %s, %llu us", len, (unsigned long long) offset,
+	      (ret < 0 ? strerror(errno) : "ok"), (unsigned long long) t / 1000);
+	return ret;
+
+} /* dev_write */
+
+/*
+ * While a copy's extension is verified in a thread of its
+ * own (see probe_copies()), the storage statistics for it go to
+ * the probe's counters, which are added to the context's
+ * once the thread is done.
+ */
+static __thread struct bootinfo_stats *thread_stats;
+
+/*
+ * ctx_stats
+ *
+ * Returns the statistics that the storage accesses made
+ * for a context by the calling thread are to be counted in.
+ */
+static struct bootinfo_stats *
+ctx_stats (struct devinfo_context *ctx)
+{
+	return (thread_stats != NULL ? thread_stats : &ctx->stats);
+
+} /* ctx_stats */
+
+/*
+ * add_stats
+ */
+static void
+add_stats (struct bootinfo_stats *st, const struct bootinfo_stats *more)
+{
+	st->read_calls += more->read_calls;
+	st->read_bytes += more->read_bytes;
+	st->read_ns += more->read_ns;
+	st->write_calls += more->write_calls;
+	st->write_bytes += more->write_bytes;
+	st->write_ns += more->write_ns;
+	st->lock_ns += more->lock_ns;
+	st->force_ro_ns += more->force_ro_ns;
+	st->crc_bytes += more->crc_bytes;
+	st->crc_ns += more->crc_ns;
+
+} /* add_stats */
+
+/*
+ * ctx_crc32
+ *
+ * checksum_crc32, accounted for in the context statistics.
+ */
+static uint32_t
+ctx_crc32 (struct devinfo_context *ctx, uint32_t crc, const void *buf, size_t len)
+{
+	uint64_t start = now_ns();
+
+	crc = checksum_crc32(crc, buf, len);
+	ctx_stats(ctx)->crc_ns += now_ns() - start;
+	ctx_stats(ctx)->crc_bytes += len;
+	return crc;
+
+} /* ctx_crc32 */
+
+/*
+ * lock_file
+ *
+ * flock, with the time spent waiting accounted for.
+ */
+static int
+lock_file (struct bootinfo_stats *st, int fd, int operation)
+{
+	uint64_t start = now_ns(), t;
+	int ret;
+
+	ret = flock(fd, operation);
+	t = now_ns() - start;
+	st->lock_ns += t;
+	trace("%s lock: %s, %llu us", ((operation & LOCK_EX) != 0 ? "exclusive" : "shared"),
+	      (ret < 0 ? strerror(errno) : "ok"), (unsigned long long) t / 1000);
+	return ret;
+
+} /* lock_file */
+
+/*
+ * set_writeable
+ *
+ * set_bootdev_writeable_status() for the storage
+ * device, unless the configuration says not to.
+ */
+static bool
+set_writeable (const struct storage_backend *backend, struct bootinfo_stats *st, bool make_writeable)
+{
+	uint64_t start, t;
+	bool changed;
+
+	if (!backend->set_force_ro)
+		return false;
+	start = now_ns();
+	changed = set_bootdev_writeable_status(backend->device, make_writeable);
+	t = now_ns() - start;
+	st->force_ro_ns += t;
+	if (changed)
+		trace("%s force_ro for %s, %llu us", (make_writeable ? "cleared" : "set"),
+		      backend->device, (unsigned long long) t / 1000);
+	return changed;
+
+} /* set_writeable */
+
+/*
+ * lockdir_path
+ *
+ * Forms the pathname of a file in the lock directory.
+ *
+ * Returns 0 on success, -1 if it does not fit (errno set).
+ */
+static int
+lockdir_path (char *buf, size_t bufsize, const struct storage_backend *backend, const char *name)
+{
+	if (snprintf(buf, bufsize, "%s/%s", backend->lockdir, name) >= (int) bufsize) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+
+} /* lockdir_path */
+
+/*
+ * bootinfo_config_init
+ *
+ * Fills in a configuration with the built-in defaults.
+ */
+void
+bootinfo_config_init (struct bootinfo_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->storage_offset_a = BOOTINFO_STORAGE_OFFSET_A;
+	config->storage_offset_b = BOOTINFO_STORAGE_OFFSET_B;
+
+} /* bootinfo_config_init */
+
+/*
+ * setup_backend
+ *
+ * Validates a configuration (NULL for the defaults) and
+ * fills in the backend description from it.  The copies
+ * must be sector-aligned and must not overlap, and a
+ * non-default store must have a non-default lock directory,
+ * so that it does not share the snapshot and daemon of
+ * the default one.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+setup_backend (struct storage_backend *backend, const struct bootinfo_config *config)
+{
+	struct bootinfo_config defaults;
+	off_t span = DEVINFO_BLOCK_SIZE + EXTENSION_SIZE;
+	off_t a, b;
+
+	bootinfo_config_init(&defaults);
+	if (config == NULL)
+		config = &defaults;
+	a = config->storage_offset_a;
+	b = config->storage_offset_b;
+	if (a < 0 || b < 0 || a % SECTOR_SIZE != 0 || b % SECTOR_SIZE != 0 ||
+	    (a < b ? b - a : a - b) < span) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (config->layout_version != 0 &&
+	    config->layout_version != BOOTINFO_LAYOUT_COPIES &&
+	    config->layout_version != BOOTINFO_LAYOUT_JOURNAL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (config->lock_dir == NULL &&
+	    (config->storage_device != NULL || a != defaults.storage_offset_a ||
+	     b != defaults.storage_offset_b)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(backend, 0, sizeof(*backend));
+	if (config->storage_device != NULL) {
+		if (strlen(config->storage_device) >= sizeof(backend->device)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(backend->device, config->storage_device);
+	}
+	if (config->lock_dir == NULL)
+		strcpy(backend->lockdir, BOOTINFO_LOCK_DIR);
+	else if (strlen(config->lock_dir) >= sizeof(backend->lockdir) - 32) {
+		/* leave room for the file names */
+		errno = ENAMETOOLONG;
+		return -1;
+	} else
+		strcpy(backend->lockdir, config->lock_dir);
+	backend->devinfo_offset[0] = a;
+	backend->devinfo_offset[1] = b;
+	backend->set_force_ro = (config->flags & BOOTINFO_CFG_NO_FORCE_RO) == 0;
+	backend->layout_version = config->layout_version;
+	return 0;
+
+} /* setup_backend */
+
+/*
+ * varspace_start
+ *
+ * Returns the offset of the start of the variable space
+ * in an info block with the given layout version.
+ */
+static size_t
+varspace_start (uint16_t version)
+{
+	if (version < DEVINFO_VERSION_BOOTSTATE)
+		return offsetof(struct device_info, bootstate_seq);
+	if (version < DEVINFO_VERSION_VARLEN)
+		return offsetof(struct device_info, var_len);
+	if (version < DEVINFO_VERSION_CHUNKCRC)
+		return DEVINFO_HDR_SIZE;
+	return DEVINFO_HDR_SIZE + CHUNK_TABLE_SIZE;
+
+} /* varspace_start */
+
+/*
+ * varspace_end
+ *
+ * Returns the offset of the end of the variable space
+ * in an info block with the given layout version.  Before
+ * version 6, the extension checksum immediately follows it.
+ */
+static size_t
+varspace_end (uint16_t version)
+{
+	if (version < DEVINFO_VERSION_BOOTSTATE)
+		return DEVINFO_BLOCK_SIZE + EXTENSION_SIZE - sizeof(uint32_t);
+	if (version < DEVINFO_VERSION_VARLEN)
+		return BOOTSTATE_OFFSET - sizeof(uint32_t);
+	return BOOTSTATE_OFFSET;
+
+} /* varspace_end */
+
+/*
+ * ext_bytes_used
+ *
+ * Returns the number of extension bytes covered by the
+ * extension checksum for the given header.
+ */
+static size_t
+ext_bytes_used (const struct device_info *dp)
+{
+	size_t end;
+
+	if (dp->devinfo_version < DEVINFO_VERSION_VARLEN)
+		return varspace_end(dp->devinfo_version) - DEVINFO_BLOCK_SIZE;
+	end = varspace_start(dp->devinfo_version) + dp->var_len;
+	return (end > DEVINFO_BLOCK_SIZE ? end - DEVINFO_BLOCK_SIZE : 0);
+
+} /* ext_bytes_used */
+
+/*
+ * ext_sectors_to_read
+ *
+ * Returns the number of extension sectors that must be read
+ * to verify the copy with the given header.  For layouts before
+ * version 6, that is the whole extension.
+ */
+static unsigned int
+ext_sectors_to_read (const struct device_info *dp)
+{
+	if (dp->devinfo_version < DEVINFO_VERSION_VARLEN)
+		return EXTENSION_SECTOR_COUNT;
+	return (ext_bytes_used(dp) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+} /* ext_sectors_to_read */
+
+/*
+ * journal_start
+ *
+ * Returns the first sector of the variable journal for a
+ * version 8 copy with the given header: the one following
+ * the variable space in use.
+ */
+static unsigned int
+journal_start (const struct device_info *dp)
+{
+	return 1 + ext_sectors_to_read(dp);
+
+} /* journal_start */
+
+/*
+ * journal_sectors
+ *
+ * Returns the number of sectors taken by a journal
+ * record with len bytes of variable data.
+ */
+static unsigned int
+journal_sectors (size_t len)
+{
+	return (sizeof(struct journal_record) + len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+} /* journal_sectors */
+
+/*
+ * chunk_len
+ *
+ * Returns the number of bytes in use in extension
+ * checksum chunk n, given the extension bytes in use.
+ */
+static size_t
+chunk_len (size_t ext_used, unsigned int n)
+{
+	size_t start = (size_t) n * CRC_CHUNK_SIZE;
+
+	if (ext_used <= start)
+		return 0;
+	return (ext_used - start < CRC_CHUNK_SIZE ? ext_used - start : CRC_CHUNK_SIZE);
+
+} /* chunk_len */
+
+/*
+ * get_chunk_crc
+ */
+static uint32_t
+get_chunk_crc (const uint8_t *block, unsigned int n)
+{
+	uint32_t crcsum;
+
+	memcpy(&crcsum, block + DEVINFO_HDR_SIZE + n * sizeof(crcsum), sizeof(crcsum));
+	return crcsum;
+
+} /* get_chunk_crc */
+
+/*
+ * set_chunk_crc
+ */
+static void
+set_chunk_crc (uint8_t *block, unsigned int n, uint32_t crcsum)
+{
+	memcpy(block + DEVINFO_HDR_SIZE + n * sizeof(crcsum), &crcsum, sizeof(crcsum));
+
+} /* set_chunk_crc */
+
+/*
+ * header_crc
+ *
+ * Computes the checksum for a header block, which
+ * is calculated with the crcsum field set to zero.
+ */
+static uint32_t
+header_crc (struct devinfo_context *ctx, const uint8_t *block)
+{
+	struct device_info hdr;
+	uint32_t crcsum;
+
+	memcpy(&hdr, block, sizeof(hdr));
+	hdr.crcsum = 0;
+	crcsum = ctx_crc32(ctx, 0, &hdr, sizeof(hdr));
+	return ctx_crc32(ctx, crcsum, block + sizeof(hdr), DEVINFO_BLOCK_SIZE - sizeof(hdr));
+
+} /* header_crc */
+
+/*
+ * Variable name index.
+ *
+ * An open-addressed hash table (linear probing, power-of-two
+ * size, kept at most half full) mapping names to entries in the
+ * variable array, so lookups do not have to scan the array.  Table
+ * slots hold the array index plus one, with zero for an empty slot.
+ * The array still determines the order in which variables are
+ * iterated and stored.
+ *
+ * Deleting a variable just sets its value to NULL, leaving the entry
+ * in the array (skipped everywhere) and in the index until the context
+ * is closed; setting it again appends a new entry, which replaces the
+ * old one in the index.  So entries are never removed from the table.
+ */
+#define MIN_VARS 32
+
+static uint32_t
+name_hash (const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name != '\0') {
+		h ^= (uint8_t) *name++;
+		h *= 16777619U;
+	}
+	return h;
+
+} /* name_hash */
+
+/*
+ * index_slot
+ *
+ * Returns the table slot for the name, either the one
+ * holding its entry or the empty slot where it would go.
+ */
+static uint32_t *
+index_slot (struct devinfo_context *ctx, const char *name)
+{
+	size_t i, mask = ctx->varindex_size - 1;
+	uint32_t *table = ctx->varindex;
+
+	for (i = name_hash(name) & mask; table[i] != 0; i = (i + 1) & mask)
+		if (strcmp(ctx->vars[table[i]-1].name, name) == 0)
+			break;
+	return &table[i];
+
+} /* index_slot */
+
+/*
+ * index_var
+ *
+ * Adds entry n of the variable array to the index.  An existing
+ * entry with the same name is replaced only if it has been deleted,
+ * so if the storage somehow holds duplicates, the first one wins.
+ */
+static void
+index_var (struct devinfo_context *ctx, unsigned int n)
+{
+	uint32_t *slot = index_slot(ctx, ctx->vars[n].name);
+
+	if (*slot == 0 || ctx->vars[*slot-1].value == NULL)
+		*slot = n + 1;
+	ctx->sorted_valid = false;
+
+} /* index_var */
+
+/*
+ * alloc_vars
+ *
+ * (Re)allocates the variable array to hold at least maxvars
+ * entries, with the name index in the same allocation, copying
+ * over any existing entries and rebuilding the index.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+alloc_vars (struct devinfo_context *ctx, unsigned int maxvars)
+{
+	struct info_var *newvars;
+	size_t tablesize;
+	unsigned int n;
+
+	if (maxvars < MIN_VARS)
+		maxvars = MIN_VARS;
+	for (tablesize = 2 * MIN_VARS; tablesize < 2 * (size_t) maxvars; tablesize *= 2);
+	newvars = calloc(1, maxvars * sizeof(struct info_var) + tablesize * sizeof(uint32_t));
+	if (newvars == NULL)
+		return -1;
+	if (ctx->varcount > 0)
+		memcpy(newvars, ctx->vars, ctx->varcount * sizeof(struct info_var));
+	free(ctx->vars);
+	ctx->vars = newvars;
+	ctx->maxvars = maxvars;
+	ctx->varindex = (uint32_t *)(newvars + maxvars);
+	ctx->varindex_size = tablesize;
+	for (n = 0; n < ctx->varcount; n++)
+		index_var(ctx, n);
+	return 0;
+
+} /* alloc_vars */
+
+/*
+ * find_var
+ *
+ * Looks up a variable by name.  The entry returned may be
+ * that of a deleted variable (with a NULL value), or NULL
+ * if the name has never been in the array.
+ */
+static struct info_var *
+find_var (struct devinfo_context *ctx, const char *name)
+{
+	uint32_t *slot;
+
+	if (ctx->varcount == 0)
+		return NULL;
+	slot = index_slot(ctx, name);
+	return (*slot == 0 ? NULL : &ctx->vars[*slot-1]);
+
+} /* find_var */
+
+/*
+ * compare_var_names
+ *
+ * qsort_r comparison for sort_vars(), ordering entries by
+ * name, then by position in the array.
+ */
+static int
+compare_var_names (const void *a, const void *b, void *arg)
+{
+	const struct info_var *vars = arg;
+	uint32_t i = *(const uint32_t *) a, j = *(const uint32_t *) b;
+	int ret = strcmp(vars[i].name, vars[j].name);
+
+	if (ret != 0)
+		return ret;
+	return (i < j ? -1 : (i > j ? 1 : 0));
+
+} /* compare_var_names */
+
+/*
+ * sort_vars
+ *
+ * Makes sure the sorted list of variable array entries is
+ * up to date.  Adding an entry to the array (see index_var())
+ * makes it stale; changing or deleting a value does not.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+sort_vars (struct devinfo_context *ctx)
+{
+	uint32_t *sorted;
+	unsigned int n;
+
+	if (ctx->sorted_valid)
+		return 0;
+	if (ctx->sorted_size < ctx->varcount) {
+		sorted = realloc(ctx->sorted, ctx->maxvars * sizeof(uint32_t));
+		if (sorted == NULL)
+			return -1;
+		ctx->sorted = sorted;
+		ctx->sorted_size = ctx->maxvars;
+	}
+	for (n = 0; n < ctx->varcount; n++)
+		ctx->sorted[n] = n;
+	qsort_r(ctx->sorted, ctx->varcount, sizeof(uint32_t), compare_var_names, ctx->vars);
+	ctx->sorted_valid = true;
+	return 0;
+
+} /* sort_vars */
+
+/*
+ * first_with_prefix
+ *
+ * Returns the position in the sorted list of the first
+ * entry whose name is not less than prefix, which is the
+ * first one beginning with it, if any does.
+ */
+static uint32_t *
+first_with_prefix (struct devinfo_context *ctx, const char *prefix)
+{
+	uint32_t *lo = ctx->sorted, *hi = ctx->sorted + ctx->varcount, *mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(ctx->vars[*mid].name, prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+
+} /* first_with_prefix */
+
+/*
+ * unpack_vars
+ *
+ * Sets up the variable array from a buffer of len
+ * bytes holding packed variables, which the context
+ * takes over on success.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+unpack_vars (struct devinfo_context *ctx, char *buf, size_t len)
+{
+	char *cp, *endp = buf + len;
+	unsigned int count = 0;
+	size_t nlen, vlen;
+
+	for (cp = buf; cp < endp; cp += nlen + vlen + 2, count++) {
+		nlen = strnlen(cp, endp - cp);
+		vlen = (cp + nlen < endp ? strnlen(cp + nlen + 1, endp - cp - nlen - 1) : 0);
+		if (nlen == 0 || vlen == 0 || cp + nlen + vlen + 2 > endp) {
+			errno = EPROTO;
+			return -1;
+		}
+	}
+	ctx->varcount = 0;
+	if (alloc_vars(ctx, count + count / 2) < 0)
+		return -1;
+	for (cp = buf; ctx->varcount < count; ctx->varcount++) {
+		ctx->vars[ctx->varcount].name = cp;
+		cp += strlen(cp) + 1;
+		ctx->vars[ctx->varcount].value = cp;
+		ctx->vars[ctx->varcount].plain = NULL;
+		ctx->vars[ctx->varcount].modified = false;
+		cp += strlen(cp) + 1;
+		index_var(ctx, ctx->varcount);
+	}
+	free(ctx->varstore);
+	ctx->varstore = buf;
+	ctx->varsize = len;
+	return 0;
+
+} /* unpack_vars */
+
+/*
+ * free_strings
+ *
+ * Frees the string storage used for batched sets.
+ */
+static void
+free_strings (struct devinfo_context *ctx)
+{
+	struct str_chunk *next;
+
+	while (ctx->strings != NULL) {
+		next = ctx->strings->next;
+		free(ctx->strings);
+		ctx->strings = next;
+	}
+
+} /* free_strings */
+
+/*
+ * alloc_string
+ *
+ * Allocates len bytes from the context's string storage,
+ * which is freed on the next update or when the context
+ * is closed.
+ */
+static char *
+alloc_string (struct devinfo_context *ctx, size_t len)
+{
+	struct str_chunk *chunk = ctx->strings;
+
+	if (chunk == NULL || chunk->size - chunk->used < len) {
+		size_t size = (len > STR_CHUNK_SIZE ? len : STR_CHUNK_SIZE);
+		chunk = malloc(sizeof(struct str_chunk) + size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = ctx->strings;
+		ctx->strings = chunk;
+	}
+	chunk->used += len;
+	return chunk->data + chunk->used - len;
+
+} /* alloc_string */
+
+/*
+ * replay_journal
+ *
+ * Applies the records in the variable journal of the
+ * current copy, which scan_journal() has checked, to the
+ * variables parsed from its variable space.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+replay_journal (struct devinfo_context *ctx)
+{
+	const uint8_t *block = ctx->infobuf[ctx->current];
+	struct journal_record rec;
+	struct info_var *var;
+	char *cp, *endp, *valp;
+	unsigned int sector;
+
+	for (sector = journal_start((const struct device_info *) block);
+	     sector < ctx->journal_end[ctx->current];
+	     sector += journal_sectors(rec.len)) {
+		memcpy(&rec, block + (size_t) sector * SECTOR_SIZE, sizeof(rec));
+		cp = (char *) block + (size_t) sector * SECTOR_SIZE + sizeof(rec);
+		for (endp = cp + rec.len; cp < endp; cp = valp + strnlen(valp, endp - valp) + 1) {
+			valp = cp + strnlen(cp, endp - cp) + 1;
+			if (valp >= endp)
+				break;
+			var = find_var(ctx, cp);
+			if (*valp == '\0') {
+				if (var != NULL)
+					var->value = NULL;
+				continue;
+			}
+			if (var != NULL && var->value != NULL) {
+				var->value = valp;
+				var->plain = NULL;
+				continue;
+			}
+			if (ctx->varcount >= ctx->maxvars &&
+			    alloc_vars(ctx, 2 * ctx->maxvars) < 0)
+				return -1;
+			var = &ctx->vars[ctx->varcount];
+			var->name = cp;
+			var->value = valp;
+			var->plain = NULL;
+			var->modified = false;
+			index_var(ctx, ctx->varcount);
+			ctx->varcount += 1;
+		}
+	}
+	for (var = ctx->vars, ctx->varsize = 0; var < ctx->vars + ctx->varcount; var++)
+		if (var->value != NULL)
+			ctx->varsize += strlen(var->name) + strlen(var->value) + 2;
+	return 0;
+
+} /* replay_journal */
+
+/*
+ * parse_vars
+ *
+ * A variable consists of a null-terminated name followed
+ * by a null-terminated value.	Names and values are simply
+ * concatenated into the space after the header, up to the
+ * block size. A null byte at the beginning of a variable
+ * name indicates the end of the list.
+ *
+ * It's possible to have a null value, but in this implementation
+ * null-valued variables are not written to the info block;
+ * setting a value to the null string deletes the variable.
+ *
+ * For version 8, the variable journal is then replayed.
+ */
+static int
+parse_vars (struct devinfo_context *ctx)
+{
+	struct info_var *var;
+	char *cp, *endp, *valp, *varstart;
+	ssize_t remain, varbytes, varspace;
+	unsigned int count, pass;
+	size_t start;
+
+	ctx->varcount = 0;
+	if (ctx->current < 0) {
+		fprintf(stderr, "error: parse_vars called with no valid info block\n");
+		return -1;
+	}
+	start = varspace_start(ctx->curinfo.devinfo_version);
+	varstart = (char *)(ctx->infobuf[ctx->current] + start);
+	varspace = (ctx->curinfo.devinfo_version < DEVINFO_VERSION_VARLEN
+		    ? varspace_end(ctx->curinfo.devinfo_version) - start
+		    : ctx->curinfo.var_len);
+	/*
+	 * First pass counts the variables, so the array
+	 * can be allocated in one go; second pass fills it in.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (cp = varstart, remain = varspace, count = 0, ctx->varsize = 0;
+		     remain > 0 && *cp != '\0';
+		     cp += varbytes, remain -= varbytes) {
+			for (endp = cp + 1, varbytes = 1;
+			     varbytes < remain && *endp != '\0';
+			     endp++, varbytes++);
+			if (varbytes >= remain)
+				break;
+			for (valp = endp + 1, varbytes += 1;
+			     varbytes < remain && *valp != '\0';
+			     valp++, varbytes++);
+			if (varbytes >= remain)
+				break;
+			if (pass > 0) {
+				var = &ctx->vars[count];
+				var->name = cp;
+				var->value = endp + 1;
+				var->plain = NULL;
+				var->modified = false;
+				index_var(ctx, count);
+			}
+			count += 1;
+			varbytes += 1; /* for trailing null at end of value */
+			ctx->varsize += varbytes;
+		}
+		if (pass == 0 && alloc_vars(ctx, count + count / 2) < 0) {
+			perror("variable storage");
+			return -1;
+		}
+		ctx->varcount = count;
+	}
+	if (ctx->curinfo.devinfo_version >= DEVINFO_VERSION_JOURNAL &&
+	    replay_journal(ctx) < 0) {
+		perror("variable storage");
+		return -1;
+	}
+
+	return 0;
+
+} /* parse_vars */
+
+/*
+ * mark_dirty
+ */
+static void
+mark_dirty (struct devinfo_context *ctx, unsigned int sector)
+{
+	ctx->dirty[sector / 8] |= 1U << (sector % 8);
+
+} /* mark_dirty */
+
+/*
+ * put_bytes
+ *
+ * Copies data into an info block buffer at the given offset,
+ * marking the sectors whose contents actually change as dirty.
+ */
+static void
+put_bytes (struct devinfo_context *ctx, int idx, size_t offset, const void *data, size_t len)
+{
+	const uint8_t *src = data;
+	size_t n;
+
+	while (len > 0) {
+		n = SECTOR_SIZE - (offset % SECTOR_SIZE);
+		if (n > len)
+			n = len;
+		if (memcmp(&ctx->infobuf[idx][offset], src, n) != 0) {
+			memcpy(&ctx->infobuf[idx][offset], src, n);
+			mark_dirty(ctx, offset / SECTOR_SIZE);
+		}
+		offset += n;
+		src += n;
+		len -= n;
+	}
+
+} /* put_bytes */
+
+/*
+ * sector_is_dirty
+ */
+static bool
+sector_is_dirty (struct devinfo_context *ctx, unsigned int sector)
+{
+	return (ctx->dirty[sector / 8] & (1U << (sector % 8))) != 0;
+
+} /* sector_is_dirty */
+
+/*
+ * update_chunk_crcs
+ *
+ * Fills in the chunk checksum table for an info block whose
+ * variables have just been packed.  If the block previously
+ * held a verified version 7 copy, whose chunk table and extension
+ * bytes in use are passed in old_crcs and old_used, the checksums
+ * for chunks with no dirty sectors and the same length are kept.
+ */
+static void
+update_chunk_crcs (struct devinfo_context *ctx, int idx, const uint32_t *old_crcs, size_t old_used)
+{
+	struct device_info *info = (struct device_info *) ctx->infobuf[idx];
+	const uint8_t *ext = &ctx->infobuf[idx][DEVINFO_BLOCK_SIZE];
+	size_t used = ext_bytes_used(info), n;
+	unsigned int chunk, sector;
+	bool changed;
+
+	for (chunk = 0; chunk < CRC_CHUNK_COUNT; chunk++) {
+		n = chunk_len(used, chunk);
+		if (n == 0) {
+			set_chunk_crc(ctx->infobuf[idx], chunk, 0);
+			continue;
+		}
+		changed = (old_crcs == NULL || chunk_len(old_used, chunk) != n);
+		for (sector = 1 + chunk * CRC_CHUNK_SECTORS;
+		     !changed && sector < 1 + (chunk + 1) * CRC_CHUNK_SECTORS && sector < BOOTSTATE_SECTOR;
+		     sector++)
+			changed = sector_is_dirty(ctx, sector);
+		set_chunk_crc(ctx->infobuf[idx], chunk,
+			      (changed ? ctx_crc32(ctx, 0, ext + (size_t) chunk * CRC_CHUNK_SIZE, n)
+			       : old_crcs[chunk]));
+	}
+
+} /* update_chunk_crcs */
+
+/*
+ * write_sectors
+ *
+ * Writes a run of sectors from an info block buffer out
+ * to storage.
+ */
+static int
+write_sectors (struct devinfo_context *ctx, int idx, unsigned int first, unsigned int count)
+{
+	size_t len = (size_t) count * SECTOR_SIZE;
+	uint8_t *buf = &ctx->infobuf[idx][first * SECTOR_SIZE];
+
+	return dev_write(&ctx->stats, ctx->fd, buf, len, ctx->backend.devinfo_offset[idx] + (off_t) first * SECTOR_SIZE);
+
+} /* write_sectors */
+
+/*
+ * decoded_length
+ *
+ * Returns the length of the original value for an
+ * encoded value, or -1 if it is not validly encoded.
+ */
+static ssize_t
+decoded_length (const char *value)
+{
+	unsigned long len;
+	char *endp;
+
+	if (value[0] != VALUE_ENCODED || value[1] != VALUE_DEFLATE || !isdigit(value[2]))
+		return -1;
+	len = strtoul(value + 2, &endp, 10);
+	if (*endp != ':' || len == 0 || len >= MAX_VALUE_SIZE)
+		return -1;
+	return (ssize_t) len;
+
+} /* decoded_length */
+
+/*
+ * encode_value
+ *
+ * Deflates a value of vlen bytes into out, which must have room
+ * for vlen + 2 bytes, using zbuf (of zsize bytes) for the zlib
+ * stream.
+ *
+ * Returns the length of the encoded value, or 0 if encoding
+ * it would not make it smaller.
+ */
+static size_t
+encode_value (const char *value, size_t vlen, uint8_t *zbuf, size_t zsize, char *out)
+{
+	uLongf zlen = zsize;
+	size_t i, n;
+
+	if (compress2(zbuf, &zlen, (const Bytef *) value, vlen, Z_BEST_COMPRESSION) != Z_OK)
+		return 0;
+	n = (size_t) sprintf(out, "%c%c%zu:", VALUE_ENCODED, VALUE_DEFLATE, vlen);
+	for (i = 0; i < zlen && n < vlen; i++) {
+		if (zbuf[i] == '\0' || zbuf[i] == VALUE_ESCAPE) {
+			out[n++] = VALUE_ESCAPE;
+			out[n++] = (char) (zbuf[i] + 1);
+		} else
+			out[n++] = (char) zbuf[i];
+	}
+	if (i < zlen || n >= vlen)
+		return 0;
+	out[n] = '\0';
+	return n;
+
+} /* encode_value */
+
+/*
+ * decode_value
+ *
+ * Returns the plain value of a variable, inflating an
+ * encoded value into the context's string storage the
+ * first time it is needed.
+ *
+ * Returns NULL on error (errno set).
+ */
+static char *
+decode_value (struct devinfo_context *ctx, struct info_var *var)
+{
+	const uint8_t *cp;
+	uint8_t *zbuf;
+	size_t zlen;
+	ssize_t plen;
+	uLongf outlen;
+	char *plain;
+	int ret;
+
+	if (*var->value != VALUE_ENCODED)
+		return var->value;
+	if (var->plain != NULL)
+		return var->plain;
+	plen = decoded_length(var->value);
+	if (plen < 0) {
+		errno = EBADMSG;
+		return NULL;
+	}
+	cp = (const uint8_t *) strchr(var->value, ':') + 1;
+	zbuf = malloc(strlen((const char *) cp) + 1);
+	if (zbuf == NULL)
+		return NULL;
+	for (zlen = 0; *cp != '\0'; cp++) {
+		if (*cp == VALUE_ESCAPE) {
+			if (*++cp == '\0')
+				break;
+			zbuf[zlen++] = *cp - 1;
+		} else
+			zbuf[zlen++] = *cp;
+	}
+	plain = (*cp == '\0' ? alloc_string(ctx, plen + 1) : NULL);
+	outlen = plen;
+	ret = (plain == NULL ? Z_DATA_ERROR : uncompress((Bytef *) plain, &outlen, zbuf, zlen));
+	free(zbuf);
+	if (ret != Z_OK || outlen != (uLongf) plen) {
+		errno = (ret == Z_MEM_ERROR ? ENOMEM : EBADMSG);
+		return NULL;
+	}
+	plain[plen] = '\0';
+	if (strlen(plain) != (size_t) plen) {
+		errno = EBADMSG;
+		return NULL;
+	}
+	var->plain = plain;
+	return plain;
+
+} /* decode_value */
+
+/*
+ * values_size
+ *
+ * Returns the total length of the variable
+ * values, as they are once decoded.
+ */
+static size_t
+values_size (struct devinfo_context *ctx)
+{
+	struct info_var *var;
+	size_t total = 0;
+	ssize_t plen;
+
+	for (var = ctx->vars; var < ctx->vars + ctx->varcount; var++) {
+		if (var->value == NULL)
+			continue;
+		plen = (*var->value == VALUE_ENCODED ? decoded_length(var->value) : -1);
+		total += (plen < 0 ? strlen(var->value) : (size_t) plen);
+	}
+	return total;
+
+} /* values_size */
+
+/*
+ * store_value
+ *
+ * Returns a variable's value as it is to be stored, passing
+ * back its length including the terminating null.  Plain values
+ * of BOOTINFO_COMPRESS_MIN bytes or more are deflated where that
+ * saves space, using *zbufp, which is allocated on first use
+ * and must be freed by the caller; values still in their
+ * encoded form are stored as they are.
+ */
+static const char *
+store_value (const struct info_var *var, uint8_t **zbufp, size_t *vlenp)
+{
+	size_t zsize = compressBound(MAX_VALUE_SIZE);
+	size_t vlen = strlen(var->value), elen = 0;
+
+	if (*var->value != VALUE_ENCODED && vlen >= BOOTINFO_COMPRESS_MIN) {
+		if (*zbufp == NULL)
+			*zbufp = malloc(zsize + MAX_VALUE_SIZE + 2);
+		if (*zbufp != NULL)
+			elen = encode_value(var->value, vlen, *zbufp, zsize, (char *) *zbufp + zsize);
+	}
+	if (elen == 0) {
+		*vlenp = vlen + 1;
+		return var->value;
+	}
+	trace("deflated %s: %zu -> %zu bytes", var->name, vlen, elen);
+	*vlenp = elen + 1;
+	return (char *) *zbufp + zsize;
+
+} /* store_value */
+
+/*
+ * pack_vars
+ *
+ * Pack the list of variables into the current devinfo block,
+ * passing back the number of bytes of variable space used.
+ * Values are stored as store_value() returns them.
+ */
+static int
+pack_vars (struct devinfo_context *ctx, int idx, size_t *lenp)
+{
+	struct info_var *var;
+	size_t offset, remain, nlen, vlen;
+	unsigned int n;
+	uint8_t *zbuf = NULL;
+	const char *value;
+	static const char nul = '\0';
+
+	if (idx != 0 && idx != 1)
+		return -1;
+	if (values_size(ctx) > MAX_DECODED_SIZE) {
+		fprintf(stderr, "error: variables list too large\n");
+		errno = EMSGSIZE;
+		return -1;
+	}
+	for (n = 0, offset = varspace_start(DEVINFO_VERSION_CURRENT),
+		     remain = varspace_end(DEVINFO_VERSION_CURRENT) - (offset+1);
+	     n < ctx->varcount && remain > 0;
+	     n++) {
+		var = &ctx->vars[n];
+		if (var->value == NULL)
+			continue;
+		nlen = strlen(var->name) + 1;
+		value = store_value(var, &zbuf, &vlen);
+		if (nlen + vlen > remain) {
+			fprintf(stderr, "error: variables list too large\n");
+			free(zbuf);
+			errno = EMSGSIZE;
+			return -1;
+		}
+		put_bytes(ctx, idx, offset, var->name, nlen);
+		offset += nlen; remain -= nlen;
+		put_bytes(ctx, idx, offset, value, vlen);
+		offset += vlen; remain -= vlen;
+	}
+	free(zbuf);
+	if (n < ctx->varcount || remain == 0) {
+		fprintf(stderr, "error: variables list too large\n");
+		errno = EMSGSIZE;
+		return -1;
+	}
+	put_bytes(ctx, idx, offset, &nul, 1);
+	*lenp = offset + 1 - varspace_start(DEVINFO_VERSION_CURRENT);
+
+	return 0;
+
+} /* pack_vars */
+
+/*
+ * map_infobufs
+ *
+ * Sets up the info block buffers for a context that accesses
+ * storage directly.  They are anonymous mappings, so memory is
+ * committed only for the pages that are actually read into or
+ * written: an open reads the headers, plus the extension sectors
+ * in use for the current copy, and the other copy's extension is
+ * read only when an update is about to rely on it or write to it.
+ * Pages not yet touched read as zeros, from the kernel's shared
+ * zero page.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+map_infobufs (struct devinfo_context *ctx)
+{
+	void *map;
+	int i;
+
+	for (i = 0; i < OFFSET_COUNT; i++) {
+		map = mmap(NULL, INFOBLOCK_SIZE, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return -1;
+		ctx->infobuf[i] = map;
+	}
+	return 0;
+
+} /* map_infobufs */
+
+/*
+ * unmap_infobufs
+ */
+static void
+unmap_infobufs (struct devinfo_context *ctx)
+{
+	int i;
+
+	for (i = 0; i < OFFSET_COUNT; i++) {
+		if (ctx->infobuf[i] != NULL)
+			munmap(ctx->infobuf[i], INFOBLOCK_SIZE);
+		ctx->infobuf[i] = NULL;
+	}
+
+} /* unmap_infobufs */
+
+/*
+ * load_bootstate
+ *
+ * Checks the boot-state journal record for copy idx, reading
+ * the journal sector from storage if neither it nor the
+ * extension was already read, and updates the boot state in the context if
+ * the record is valid and newer than what we already have.
+ */
+static void
+load_bootstate (struct devinfo_context *ctx, int idx)
+{
+	struct bootstate_record rec;
+	uint32_t crcsum;
+
+	if (!ctx->bootstate_read[idx] && ctx->cached[idx] <= BOOTSTATE_SECTOR &&
+	    dev_read(&ctx->stats, ctx->fd, &ctx->infobuf[idx][BOOTSTATE_OFFSET], SECTOR_SIZE,
+		     ctx->backend.devinfo_offset[idx] + BOOTSTATE_OFFSET) < 0)
+		return;
+	memcpy(&rec, &ctx->infobuf[idx][BOOTSTATE_OFFSET], sizeof(rec));
+	if (memcmp(rec.magic, BOOTSTATE_MAGIC, BOOTSTATE_MAGIC_SIZE) != 0)
+		return;
+	crcsum = rec.crcsum;
+	rec.crcsum = 0;
+	if (ctx_crc32(ctx, 0, &rec, sizeof(rec)) != crcsum)
+		return;
+	if ((int32_t)(rec.seq - ctx->bootstate_seq) <= 0)
+		return;
+	ctx->bootstate_seq = rec.seq;
+	ctx->bootstate_slot = idx;
+	ctx->curinfo.flags = rec.flags;
+	ctx->curinfo.failed_boots = rec.failed_boots;
+
+} /* load_bootstate */
+
+/*
+ * read_extension
+ *
+ * Reads the first nsectors of the extension block for
+ * copy idx into its buffer.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_extension (struct devinfo_context *ctx, int idx, unsigned int nsectors)
+{
+	size_t len = (size_t) nsectors * SECTOR_SIZE;
+
+	if (dev_read(ctx_stats(ctx), ctx->fd, &ctx->infobuf[idx][DEVINFO_BLOCK_SIZE], len,
+		     EXTENSION_OFFSET(&ctx->backend, idx)) < 0)
+		return -1;
+	if (ctx->cached[idx] < 1 + nsectors)
+		ctx->cached[idx] = 1 + nsectors;
+	return 0;
+
+} /* read_extension */
+
+/*
+ * read_journal_sectors
+ *
+ * Makes sure the first nsectors of the info block for copy
+ * idx have been read, reading ahead JOURNAL_READ_SECTORS
+ * at a time so that a journal takes few reads.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int
+read_journal_sectors (struct devinfo_context *ctx, int idx, unsigned int nsectors)
+{
+	unsigned int first = (ctx->cached[idx] > 1 ? ctx->cached[idx] : 1), count;
+
+	if (first >= nsectors)
+		return 0;
+	count = (nsectors - first > JOURNAL_READ_SECTORS ? nsectors - first : JOURNAL_READ_SECTORS);
+	if (first + count > BOOTSTATE_SECTOR)
+		count = BOOTSTATE_SECTOR - first;
+	if (dev_read(ctx_stats(ctx), ctx->fd, &ctx->infobuf[idx][first * SECTOR_SIZE],
+		     (size_t) count * SECTOR_SIZE,
+		     ctx->backend.devinfo_offset[idx] + (off_t) first * SECTOR_SIZE) < 0)
+		return -1;
+	ctx->cached[idx] = first + count;
+	return 0;
+
+} /* read_journal_sectors */
+
+/*
+ * scan_journal
+ *
+ * Reads the variable journal for version 8 copy idx,
+ * recording where the valid records end.
+ */
+static void
+scan_journal (struct devinfo_context *ctx, int idx)
+{
+	const struct device_info *dp = (const struct device_info *)(ctx->infobuf[idx]);
+	struct journal_record rec;
+	const uint8_t *data;
+	unsigned int sector, nsectors = 0;
+	uint32_t crcsum;
+
+	ctx->journal_seq[idx] = 0;
+	for (sector = journal_start(dp); sector < BOOTSTATE_SECTOR; sector += nsectors) {
+		if (read_journal_sectors(ctx, idx, sector + 1) < 0)
+			break;
+		data = &ctx->infobuf[idx][(size_t) sector * SECTOR_SIZE];
+		memcpy(&rec, data, sizeof(rec));
+		if (memcmp(rec.magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0 ||
+		    rec.base_seq != dp->bootstate_seq || rec.seq != ctx->journal_seq[idx] + 1 ||
+		    rec.len == 0 || rec.len > VARSPACE_SIZE ||
+		    journal_sectors(rec.len) > BOOTSTATE_SECTOR - sector)
+			break;
+		nsectors = journal_sectors(rec.len);
+		if (read_journal_sectors(ctx, idx, sector + nsectors) < 0)
+			break;
+		crcsum = rec.crcsum;
+		rec.crcsum = 0;
+		if (ctx_crc32(ctx, ctx_crc32(ctx, 0, &rec, sizeof(rec)), data + sizeof(rec), rec.len) != crcsum)
+			break;
+		ctx->journal_seq[idx] = rec.seq;
+	}
+	ctx->journal_end[idx] = sector;
+
+} /* scan_journal */
+
+/*
+ * verify_extension
+ *
+ * Reads the extension block for a copy whose header
+ * is valid and checks its checksum, marking the copy
+ * invalid if it cannot be read or does not match.
+ */
+static void
+verify_extension (struct devinfo_context *ctx, int idx)
+{
+	struct device_info *dp = (struct device_info *)(ctx->infobuf[idx]);
+	const uint8_t *ext = &ctx->infobuf[idx][DEVINFO_BLOCK_SIZE];
+	size_t len, n;
+	uint32_t crcsum;
+	unsigned int chunk;
+
+	if (!ctx->valid[idx] || ctx->ext_checked[idx])
+		return;
+	ctx->ext_checked[idx] = true;
+	if (read_extension(ctx, idx, ext_sectors_to_read(dp)) < 0) {
+		ctx->valid[idx] = 0;
+		return;
+	}
+	len = ext_bytes_used(dp);
+	if (dp->devinfo_version >= DEVINFO_VERSION_CHUNKCRC) {
+		for (chunk = 0; (n = chunk_len(len, chunk)) > 0; chunk++)
+			if (ctx_crc32(ctx, 0, ext + (size_t) chunk * CRC_CHUNK_SIZE, n) !=
+			    get_chunk_crc(ctx->infobuf[idx], chunk)) {
+				ctx->valid[idx] = 0;
+				return;
+			}
+		if (dp->devinfo_version >= DEVINFO_VERSION_JOURNAL)
+			scan_journal(ctx, idx);
+		return;
+	}
+	if (dp->devinfo_version < DEVINFO_VERSION_VARLEN)
+		crcsum = *(uint32_t *)(&ext[len]);
+	else
+		crcsum = dp->ext_crcsum;
+	if (ctx_crc32(ctx, 0, ext, len) != crcsum)
+		ctx->valid[idx] = 0;
+
+} /* verify_extension */
+
+/*
+ * select_current
+ *
+ * Picks the current copy from those marked valid and loads
+ * its header information into the context.  If keep_bootstate
+ * is true, the boot state already in the context is retained
+ * (it does not depend on which copy holds the variables);
+ * otherwise, it is taken from the new current header and
+ * the boot-state journal.
+ *
+ * Returns 0 on success, -1 if no copy is valid.
+ */
+static int
+select_current (struct devinfo_context *ctx, bool keep_bootstate)
+{
+	struct device_info *dp, *dp1;
+	struct device_info saved = ctx->curinfo;
+	int i;
+
+	if (!(ctx->valid[0] || ctx->valid[1])) {
+		ctx->current = -1;
+		memset(&ctx->curinfo, 0, sizeof(ctx->curinfo));
+		return -1;
+	} else if (ctx->valid[0] && !ctx->valid[1])
+		ctx->current = 0;
+	else if (!ctx->valid[0] && ctx->valid[1])
+		ctx->current = 1;
+	else {
+		/* both valid */
+		dp1 = (struct device_info *)(ctx->infobuf[1]);
+		dp = (struct device_info *)(ctx->infobuf[0]);
+		if (dp->sernum == 255 && dp1->sernum == 0)
+			ctx->current = 1;
+		else if (dp1->sernum == 255 && dp->sernum == 0)
+			ctx->current = 0;
+		else if (dp1->sernum > dp->sernum)
+			ctx->current = 1;
+		else
+			ctx->current = 0;
+	}
+	memcpy(&ctx->curinfo, ctx->infobuf[ctx->current], sizeof(ctx->curinfo));
+	if (ctx->curinfo.devinfo_version < DEVINFO_VERSION_BOOTSTATE)
+		ctx->curinfo.bootstate_seq = 0;
+	if (keep_bootstate) {
+		ctx->curinfo.flags = saved.flags;
+		ctx->curinfo.failed_boots = saved.failed_boots;
+	} else {
+		ctx->bootstate_seq = ctx->curinfo.bootstate_seq;
+		ctx->bootstate_slot = -1;
+		if (ctx->curinfo.devinfo_version >= DEVINFO_VERSION_BOOTSTATE)
+			for (i = 0; i < OFFSET_COUNT; i++)
+				load_bootstate(ctx, i);
+	}
+	return 0;
+
+} /* select_current */
+
+/*
+ * Client side of the rk-bootinfod protocol (see bootinfod.h).
+ *
+ * When the daemon is running, it holds the storage open (and
+ * locked), so contexts opened while it runs are proxies: the
+ * header state and variables come from the daemon, gets and
+ * iteration work on the local copy as usual, and sets are
+ * recorded in pending[] and sent to the daemon on update.
+ */
+
+/*
+ * daemon_request
+ *
+ * Sends a request to the daemon and waits for the reply,
+ * whose payload is returned in *replyp (to be freed by
+ * the caller) if replyp is non-NULL.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+daemon_request (struct devinfo_context *ctx, uint32_t op, const void *buf, size_t len,
+		char **replyp, size_t *replylenp)
+{
+	uint32_t status;
+	void *reply;
+	size_t replylen;
+
+	if (send_message(ctx->daemonfd, op, buf, len) < 0 ||
+	    receive_message(ctx->daemonfd, &status, &reply, &replylen) < 0)
+		return -1;
+	if (status != 0) {
+		free(reply);
+		errno = (int) status;
+		return -1;
+	}
+	if (replyp == NULL)
+		free(reply);
+	else {
+		*replyp = reply;
+		*replylenp = replylen;
+	}
+	return 0;
+
+} /* daemon_request */
+
+/*
+ * daemon_state_request
+ *
+ * Sends a request whose reply carries the header state,
+ * and possibly the variables after it, and updates the
+ * context from the reply.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+daemon_state_request (struct devinfo_context *ctx, uint32_t op, const void *buf, size_t len,
+		      unsigned int *failed_boot_count)
+{
+	struct bootinfod_state state;
+	char *reply;
+	size_t replylen;
+
+	if (daemon_request(ctx, op, buf, len, &reply, &replylen) < 0)
+		return -1;
+	if (replylen < sizeof(state)) {
+		free(reply);
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(&state, reply, sizeof(state));
+	ctx->curinfo.devinfo_version = state.devinfo_version;
+	ctx->curinfo.flags = (state.in_progress ? FLAG_BOOT_IN_PROGRESS : 0);
+	ctx->curinfo.failed_boots = state.failed_boots;
+	ctx->curinfo.ext_sectors = state.ext_sectors;
+	if (failed_boot_count != NULL)
+		*failed_boot_count = state.failed_boot_count;
+	if (op != BOOTINFOD_OPEN && op != BOOTINFOD_INIT) {
+		free(reply);
+		return 0;
+	}
+	if (replylen == sizeof(state)) {
+		/* variables not requested */
+		free(reply);
+		return 0;
+	}
+	replylen -= sizeof(state);
+	memmove(reply, reply + sizeof(state), replylen);
+	if (unpack_vars(ctx, reply, replylen) < 0) {
+		free(reply);
+		return -1;
+	}
+	ctx->vars_loaded = true;
+	ctx->pending_len = 0;
+	return 0;
+
+} /* daemon_state_request */
+
+/*
+ * connect_daemon
+ *
+ * Connects to the rk-bootinfod socket for the store.
+ *
+ * Returns the connected socket, or -1 if the daemon
+ * cannot be reached (errno set).
+ */
+static int
+connect_daemon (const struct storage_backend *backend)
+{
+	struct sockaddr_un addr;
+	int sock, save_errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (lockdir_path(addr.sun_path, sizeof(addr.sun_path), backend, BOOTINFOD_SOCKET_NAME) < 0)
+		return -1;
+	sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		save_errno = errno;
+		close(sock);
+		errno = save_errno;
+		return -1;
+	}
+	return sock;
+
+} /* connect_daemon */
+
+/*
+ * daemon_holds_lock
+ *
+ * Checks, after failing to get the store lock without
+ * waiting, whether another process is running rk-bootinfod
+ * for the store.  The daemon keeps the exclusive lock for
+ * as long as it runs, so waiting for it would never end.
+ * A socket that exists but cannot be connected to for lack
+ * of permission (or a full backlog) counts as a running
+ * daemon; one that refuses the connection is left over
+ * from a daemon that has exited.
+ */
+static bool
+daemon_holds_lock (const struct storage_backend *backend)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	bool other;
+	int sock;
+
+	sock = connect_daemon(backend);
+	if (sock < 0)
+		return (errno == EACCES || errno == EPERM || errno == EAGAIN);
+	/* the daemon itself re-opens the store to re-initialize it */
+	other = (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+		 cred.pid != getpid());
+	close(sock);
+	return other;
+
+} /* daemon_holds_lock */
+
+/*
+ * lock_store
+ *
+ * Takes the store lock for a context, shared for a
+ * read-only context and exclusive otherwise, waiting
+ * for it unless rk-bootinfod is the one holding it.
+ *
+ * Returns 0 on success, -1 on error (errno set; EBUSY
+ * if the daemon is running).
+ */
+static int
+lock_store (struct devinfo_context *ctx)
+{
+	int operation = (ctx->readonly ? LOCK_SH : LOCK_EX);
+
+	if (lock_file(&ctx->stats, ctx->lockfd, operation|LOCK_NB) == 0)
+		return 0;
+	if (errno != EWOULDBLOCK)
+		return -1;
+	if (daemon_holds_lock(&ctx->backend)) {
+		errno = EBUSY;
+		return -1;
+	}
+	return lock_file(&ctx->stats, ctx->lockfd, operation);
+
+} /* lock_store */
+
+/*
+ * open_daemon
+ *
+ * Tries to set up a context as a proxy for the daemon.
+ *
+ * Returns 1 if the daemon is running and the context was
+ * set up, 0 if the daemon is not running, or -1 on error
+ * (errno set).
+ */
+static int
+open_daemon (struct devinfo_context **ctxp, unsigned int flags, const struct storage_backend *backend)
+{
+	struct devinfo_context *ctx;
+	uint32_t openflags;
+	int sock;
+
+	sock = connect_daemon(backend);
+	if (sock < 0)
+		return 0;
+	ctx = calloc(1, sizeof(struct devinfo_context));
+	if (ctx == NULL) {
+		close(sock);
+		return -1;
+	}
+	ctx->fd = ctx->lockfd = -1;
+	ctx->daemonfd = sock;
+	ctx->backend = *backend;
+	ctx->readonly = (flags & BOOTINFO_O_RDONLY) != 0;
+	openflags = flags & BOOTINFO_O_HEADER_ONLY;
+	if (daemon_state_request(ctx, ((flags & BOOTINFO_O_FORCE_INIT) != 0
+				       ? BOOTINFOD_INIT : BOOTINFOD_OPEN),
+				 &openflags, sizeof(openflags), NULL) < 0) {
+		close(sock);
+		free(ctx->vars);
+		free(ctx->varstore);
+		free(ctx);
+		return -1;
+	}
+	*ctxp = ctx;
+	return 1;
+
+} /* open_daemon */
+
+/*
+ * add_pending
+ *
+ * Records a set for the next commit to the daemon.
+ */
+static int
+add_pending (struct devinfo_context *ctx, const char *name, const char *value)
+{
+	size_t nlen = strlen(name) + 1, vlen = (value == NULL ? 0 : strlen(value)) + 1;
+	char *newbuf;
+	size_t newsize;
+
+	if (ctx->pending_len + nlen + vlen > ctx->pending_size) {
+		for (newsize = (ctx->pending_size == 0 ? 4096 : ctx->pending_size);
+		     newsize < ctx->pending_len + nlen + vlen; newsize *= 2);
+		newbuf = realloc(ctx->pending, newsize);
+		if (newbuf == NULL)
+			return -1;
+		ctx->pending = newbuf;
+		ctx->pending_size = newsize;
+	}
+	memcpy(ctx->pending + ctx->pending_len, name, nlen);
+	ctx->pending_len += nlen;
+	if (value == NULL)
+		ctx->pending[ctx->pending_len] = '\0';
+	else
+		memcpy(ctx->pending + ctx->pending_len, value, vlen);
+	ctx->pending_len += vlen;
+	return 0;
+
+} /* add_pending */
+
+/*
+ * load_vars
+ *
+ * Makes sure the variable list for the context has been
+ * loaded, verifying the extension block of the current copy
+ * first if that was deferred at open time.  If the current
+ * copy turns out to be invalid, switches to the other one.
+ *
+ * Returns 0 on success, -1 on error (errno set).
+ */
+static int
+load_vars (struct devinfo_context *ctx)
+{
+	char *reply;
+	size_t replylen;
+
+	if (ctx->vars_loaded)
+		return 0;
+	if (ctx->daemonfd >= 0) {
+		if (daemon_request(ctx, BOOTINFOD_GET_VARS, NULL, 0, &reply, &replylen) < 0)
+			return -1;
+		if (unpack_vars(ctx, reply, replylen) < 0) {
+			free(reply);
+			return -1;
+		}
+		ctx->vars_loaded = true;
+		return 0;
+	}
+	while (ctx->current >= 0 && !ctx->ext_checked[ctx->current]) {
+		verify_extension(ctx, ctx->current);
+		select_current(ctx, true);
+	}
+	if (ctx->current < 0) {
+		errno = EIO;
+		return -1;
+	}
+	ctx->vars_loaded = true;
+	if (parse_vars(ctx) < 0) {
+		/* internal error ? */
+		if (!ctx->readonly)
+			set_writeable(&ctx->backend, &ctx->stats, false);
+		ctx->readonly = true;
+	}
+	return 0;
+
+} /* load_vars */
+
+/*
+ * snapshot_map
+ *
+ * Maps the snapshot file for a writer, creating it if needed.
+ * If that fails, the file is removed so readers cannot pick
+ * up a snapshot that is no longer being kept up to date.
+ */
+static struct bootinfo_snapshot *
+snapshot_map (struct devinfo_context *ctx)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (ctx->snapshot != NULL)
+		return ctx->snapshot;
+	if (lockdir_path(path, sizeof(path), &ctx->backend, SNAPSHOT_NAME) < 0)
+		return NULL;
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0640);
+	if (fd < 0 || fstat(fd, &st) < 0 ||
+	    (st.st_size < SNAPSHOT_SIZE && ftruncate(fd, SNAPSHOT_SIZE) < 0)) {
+		if (fd >= 0)
+			close(fd);
+		unlink(path);
+		return NULL;
+	}
+	map = mmap(NULL, SNAPSHOT_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(path);
+		return NULL;
+	}
+	ctx->snapshot = map;
+	return ctx->snapshot;
+
+} /* snapshot_map */
+
+/*
+ * snapshot_write_begin/snapshot_write_end
+ *
+ * Bracket changes to the snapshot with the sequence lock.
+ */
+static void
+snapshot_write_begin (struct bootinfo_snapshot *snap)
+{
+	__atomic_store_n(&snap->seq, snap->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+} /* snapshot_write_begin */
+
+static void
+snapshot_write_end (struct bootinfo_snapshot *snap)
+{
+	__atomic_store_n(&snap->seq, snap->seq + 1, __ATOMIC_RELEASE);
+
+} /* snapshot_write_end */
+
+/*
+ * snapshot_current
+ *
+ * True if the snapshot describes the storage state
+ * the context has.
+ */
+static bool
+snapshot_current (struct devinfo_context *ctx, struct bootinfo_snapshot *snap)
+{
+	return memcmp(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic)) == 0 &&
+		snap->valid && !snap->pending &&
+		snap->sernum == ctx->curinfo.sernum &&
+		snap->bootstate_seq == ctx->bootstate_seq &&
+		snap->journal_seq == (ctx->current >= 0 ? ctx->journal_seq[ctx->current] : 0);
+
+} /* snapshot_current */
+
+/*
+ * snapshot_begin_update
+ *
+ * Called by a writer before it changes storage.  Since
+ * the writer holds the lock, a pending flag that is already
+ * set was left by one that died, and storage may have changed
+ * after all, even with the same sernum (for an appended journal
+ * record), so the snapshot is no longer trusted.
+ */
+static void
+snapshot_begin_update (struct devinfo_context *ctx)
+{
+	struct bootinfo_snapshot *snap = snapshot_map(ctx);
+
+	if (snap == NULL)
+		return;
+	snapshot_write_begin(snap);
+	if (snap->pending)
+		snap->valid = 0;
+	snap->pending = 1;
+	snapshot_write_end(snap);
+
+} /* snapshot_begin_update */
+
+/*
+ * vars_uncommitted
+ *
+ * Checks whether the variables in the context have been
+ * changed since they were last written to storage.
+ */
+static bool
+vars_uncommitted (struct devinfo_context *ctx)
+{
+	unsigned int n;
+
+	if (ctx->in_batch)
+		return true;
+	for (n = 0; n < ctx->varcount; n++)
+		if (ctx->vars[n].modified)
+			return true;
+	return false;
+
+} /* vars_uncommitted */
+
+/*
+ * snapshot_publish
+ *
+ * Publishes the context's state after a change to storage
+ * (success true), or marks the snapshot invalid if the change
+ * failed, leaving storage in an unknown state.  If the variables
+ * have not been loaded, or have been changed without being
+ * written (as when only the boot state is being updated), only
+ * the boot state can be updated, and only in a snapshot of the
+ * same storage state.
+ */
+static void
+snapshot_publish (struct devinfo_context *ctx, bool success)
+{
+	struct bootinfo_snapshot *snap = snapshot_map(ctx);
+	char *cp, *endp;
+	size_t nlen, vlen;
+	unsigned int n;
+
+	if (snap == NULL)
+		return;
+	snapshot_write_begin(snap);
+	if (!success)
+		snap->valid = 0;
+	else if (ctx->vars_loaded && !vars_uncommitted(ctx)) {
+		cp = (char *)(snap + 1);
+		endp = cp + VARSPACE_SIZE;
+		for (n = 0; n < ctx->varcount; n++) {
+			if (ctx->vars[n].value == NULL)
+				continue;
+			nlen = strlen(ctx->vars[n].name) + 1;
+			vlen = strlen(ctx->vars[n].value) + 1;
+			if (cp + nlen + vlen > endp)
+				break;
+			memcpy(cp, ctx->vars[n].name, nlen);
+			memcpy(cp + nlen, ctx->vars[n].value, vlen);
+			cp += nlen + vlen;
+		}
+		memcpy(snap->magic, SNAPSHOT_MAGIC, sizeof(snap->magic));
+		snap->valid = (n == ctx->varcount);
+		snap->var_len = cp - (char *)(snap + 1);
+		snap->devinfo_version = ctx->curinfo.devinfo_version;
+		snap->ext_sectors = ctx->curinfo.ext_sectors;
+		snap->journal_seq = (ctx->current >= 0 ? ctx->journal_seq[ctx->current] : 0);
+	} else if (snap->valid && snap->sernum != ctx->curinfo.sernum)
+		snap->valid = 0;
+	snap->flags = ctx->curinfo.flags;
+	snap->failed_boots = ctx->curinfo.failed_boots;
+	snap->sernum = ctx->curinfo.sernum;
+	snap->bootstate_seq = ctx->bootstate_seq;
+	snap->pending = 0;
+	snapshot_write_end(snap);
+
+} /* snapshot_publish */
+
+/*
+ * open_snapshot
+ *
+ * Tries to set up a read-only context from the snapshot.
+ *
+ * Returns 1 if the context was set up, 0 if the snapshot is
+ * missing or stale, -1 on error (errno set).
+ */
+static int
+open_snapshot (struct devinfo_context **ctxp, const struct storage_backend *backend)
+{
+	struct devinfo_context *ctx;
+	struct bootinfo_snapshot hdr;
+	const struct bootinfo_snapshot *snap;
+	char path[PATH_MAX];
+	char *vars = NULL;
+	uint32_t seq;
+	int fd, tries, lockfd;
+	bool ok = false;
+
+	if (lockdir_path(path, sizeof(path), backend, SNAPSHOT_NAME) < 0)
+		return 0;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	snap = mmap(NULL, SNAPSHOT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (snap == MAP_FAILED)
+		return 0;
+	vars = malloc(VARSPACE_SIZE);
+	if (vars == NULL) {
+		munmap((void *) snap, SNAPSHOT_SIZE);
+		return -1;
+	}
+	for (tries = 0; !ok && tries < SNAPSHOT_READ_TRIES; tries++) {
+		seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) != 0) {
+			sched_yield();
+			continue;
+		}
+		memcpy(&hdr, snap, sizeof(hdr));
+		if (hdr.var_len <= VARSPACE_SIZE)
+			memcpy(vars, snap + 1, hdr.var_len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		ok = __atomic_load_n(&snap->seq, __ATOMIC_RELAXED) == seq;
+	}
+	munmap((void *) snap, SNAPSHOT_SIZE);
+	if (!ok || memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    !hdr.valid || hdr.var_len > VARSPACE_SIZE) {
+		free(vars);
+		return 0;
+	}
+	if (hdr.pending) {
+		/*
+		 * A writer is updating storage; if it still holds
+		 * the lock, what we have is what is committed.
+		 */
+		if (lockdir_path(path, sizeof(path), backend, LOCKFILE_NAME) < 0)
+			lockfd = -1;
+		else
+			lockfd = open(path, O_RDONLY|O_CLOEXEC);
+		if (lockfd < 0 || flock(lockfd, LOCK_SH|LOCK_NB) == 0)
+			ok = false;
+		if (lockfd >= 0)
+			close(lockfd);
+		if (!ok) {
+			free(vars);
+			return 0;
+		}
+	}
+	ctx = calloc(1, sizeof(struct devinfo_context));
+	if (ctx == NULL) {
+		free(vars);
+		return -1;
+	}
+	ctx->fd = ctx->lockfd = ctx->daemonfd = -1;
+	ctx->readonly = true;
+	ctx->backend = *backend;
+	ctx->current = -1;
+	ctx->curinfo.devinfo_version = hdr.devinfo_version;
+	ctx->curinfo.flags = hdr.flags;
+	ctx->curinfo.failed_boots = hdr.failed_boots;
+	ctx->curinfo.ext_sectors = hdr.ext_sectors;
+	ctx->curinfo.sernum = hdr.sernum;
+	ctx->bootstate_seq = hdr.bootstate_seq;
+	if (unpack_vars(ctx, vars, hdr.var_len) < 0) {
+		free(ctx->vars);
+		free(ctx);
+		free(vars);
+		return 0;
+	}
+	ctx->vars_loaded = true;
+	*ctxp = ctx;
+	return 1;
+
+} /* open_snapshot */
+
+/*
+ * header_valid
+ *
+ * Checks the header of an info block.
+ */
+static bool
+header_valid (struct devinfo_context *ctx, const struct device_info *dp)
+{
+	if (memcmp(dp->magic, DEVICE_MAGIC, DEVICE_MAGIC_SIZE) != 0)
+		return false;
+	if (dp->devinfo_version < DEVINFO_VERSION_MIN ||
+	    dp->devinfo_version > DEVINFO_VERSION_MAX)
+		return false; /* unrecognized version */
+	if (dp->ext_sectors != EXTENSION_SECTOR_COUNT)
+		return false;
+	if (dp->devinfo_version >= DEVINFO_VERSION_BOOTSTATE &&
+	    header_crc(ctx, (const uint8_t *) dp) != dp->crcsum)
+		return false;
+	if (dp->devinfo_version >= DEVINFO_VERSION_VARLEN &&
+	    (dp->var_len == 0 ||
+	     dp->var_len > varspace_end(dp->devinfo_version) - varspace_start(dp->devinfo_version)))
+		return false;
+	return true;
+
+} /* header_valid */
+
+/*
+ * probe_copy
+ *
+ * Reads the header of copy idx, marking the copy valid if the
+ * header checks out, and its boot-state journal sector.  Older
+ * layouts have no verified header checksum, so for those the
+ * extension has to be read and checked as well (it holds the
+ * journal sector's bytes); that is left to the caller.
+ *
+ * Returns true if the extension needs to be verified.
+ */
+static bool
+probe_copy (struct devinfo_context *ctx, int idx)
+{
+	struct device_info *dp = (struct device_info *)(ctx->infobuf[idx]);
+
+	if (dev_read(&ctx->stats, ctx->fd, ctx->infobuf[idx], DEVINFO_BLOCK_SIZE,
+		     ctx->backend.devinfo_offset[idx]) < 0)
+		return false;
+	if (header_valid(ctx, dp)) {
+		ctx->valid[idx] = 1;
+		if (dp->devinfo_version < DEVINFO_VERSION_BOOTSTATE)
+			return true;
+	}
+	if (dev_read(&ctx->stats, ctx->fd, &ctx->infobuf[idx][BOOTSTATE_OFFSET], SECTOR_SIZE,
+		     ctx->backend.devinfo_offset[idx] + BOOTSTATE_OFFSET) == 0)
+		ctx->bootstate_read[idx] = true;
+	return false;
+
+} /* probe_copy */
+
+struct copy_probe {
+	struct devinfo_context *ctx;
+	int idx;
+	struct bootinfo_stats stats;
+};
+
+/*
+ * verify_thread
+ */
+static void *
+verify_thread (void *arg)
+{
+	struct copy_probe *probe = arg;
+
+	thread_stats = &probe->stats;
+	verify_extension(probe->ctx, probe->idx);
+	return NULL;
+
+} /* verify_thread */
+
+/*
+ * probe_copies
+ *
+ * Probes both copies.  When both are in an older layout,
+ * whose extensions have to be read and checksummed before
+ * either copy can be used, the second copy's extension is
+ * verified in a thread of its own, so the two reads are
+ * queued together and the checksums are computed on
+ * separate cores.  That thread touches only the per-copy
+ * state in the context, apart from the statistics, which
+ * are kept separately for it.  For later layouts the work
+ * left is a couple of sector reads per copy, less than it
+ * would cost to start a thread, so nothing is threaded.
+ */
+static void
+probe_copies (struct devinfo_context *ctx)
+{
+	struct copy_probe probe;
+	pthread_t thread;
+	bool verify[2];
+	int i;
+
+	for (i = 0; i < 2; i++)
+		verify[i] = probe_copy(ctx, i);
+	if (verify[0] && verify[1]) {
+		memset(&probe, 0, sizeof(probe));
+		probe.ctx = ctx;
+		probe.idx = 1;
+		if (pthread_create(&thread, NULL, verify_thread, &probe) == 0) {
+			verify_extension(ctx, 0);
+			pthread_join(thread, NULL);
+			add_stats(&ctx->stats, &probe.stats);
+			return;
+		}
+	}
+	for (i = 0; i < 2; i++)
+		if (verify[i])
+			verify_extension(ctx, i);
+
+} /* probe_copies */
+
+/*
+ * find_bootinfo
+ *
+ * Tries to find a valid bootinfo block, and initializes a context
+ * if one is found.
+ *
+ * Returns negative value on an underlying error or if neither block
+ * is valid.
+ *
+ * ctxp is set to NULL if an internal error occurred, otherwise it is
+ * set to point to a valid context, and (*ctxp)->fd is the fd of
+ * the open channel to the MMC boot1 device. Device is opened readonly
+ * and (*ctxp)->readonly is set to true if the readonly arg is non-zero;
+ * otherwise, (*ctxp)->readonly is set to true if a valid block is found
+ * but an internal error occurred parsing the variables stored in the block.
+ *
+ * Wherever the layout version provides a header checksum, the
+ * current copy is chosen based on the headers, and only its
+ * extension block is then read and verified (falling back to the
+ * other copy if that fails); the other copy's extension is left
+ * until an update needs it.  If header_only is true, reading the
+ * current copy's extension is also deferred, until the variables
+ * are first needed.
+ */
+static int
+find_bootinfo (bool readonly, bool header_only, struct devinfo_context **ctxp, const struct storage_backend *backend)
+{
+	struct devinfo_context *ctx;
+	int dirfd;
+
+	*ctxp = NULL;
+	ctx = calloc(1, sizeof(struct devinfo_context));
+	if (ctx == NULL)
+		return -1;
+	ctx->readonly = readonly;
+	ctx->daemonfd = -1;
+	ctx->backend = *backend;
+
+	dirfd = open(backend->lockdir, O_PATH);
+	if (dirfd < 0) {
+		if (mkdir(backend->lockdir, 02770) < 0) {
+			free(ctx);
+			return -1;
+		}
+		dirfd = open(backend->lockdir, O_PATH);
+	}
+	ctx->lockfd = openat(dirfd, LOCKFILE_NAME, O_CREAT|O_RDWR, 0770);
+	if (ctx->lockfd < 0) {
+		close(dirfd);
+		free(ctx);
+		return -1;
+	}
+	close(dirfd);
+	if (lock_store(ctx) < 0) {
+		close(ctx->lockfd);
+		free(ctx);
+		return -1;
+	}
+	if (!ctx->readonly)
+		set_writeable(&ctx->backend, &ctx->stats, true);
+
+	ctx->fd = blkio_open(backend->device, (readonly ? O_RDONLY : O_RDWR|O_DSYNC), true);
+	if (ctx->fd < 0 || map_infobufs(ctx) < 0) {
+		if (ctx->fd >= 0)
+			close(ctx->fd);
+		if (!ctx->readonly)
+			set_writeable(&ctx->backend, &ctx->stats, false);
+		close(ctx->lockfd);
+		unmap_infobufs(ctx);
+		free(ctx);
+		return -1;
+	}
+	probe_copies(ctx);
+	*ctxp = ctx;
+	if (select_current(ctx, false) < 0) {
+		trace("no valid copy found on %s", backend->device);
+		return -1;
+	}
+	trace("opened %s, current copy %d, version %u", backend->device, ctx->current,
+	      (unsigned int) ctx->curinfo.devinfo_version);
+	if (!header_only) {
+		/*
+		 * Both headers may check out while neither extension
+		 * does; treat that the same as no valid copy.
+		 */
+		if (load_vars(ctx) < 0) {
+			trace("no valid copy found on %s", backend->device);
+			return -1;
+		}
+		/*
+		 * Writers make sure the snapshot is there for readers.
+		 */
+		if (!ctx->readonly && snapshot_map(ctx) != NULL &&
+		    !snapshot_current(ctx, ctx->snapshot))
+			snapshot_publish(ctx, true);
+	}
+	return 0;
+
+} /* find_bootinfo */
+
+/*
+ * update_layout
+ *
+ * Returns the layout version the next update is to write.
+ */
+static uint16_t
+update_layout (struct devinfo_context *ctx)
+{
+	if (ctx->backend.layout_version != 0)
+		return ctx->backend.layout_version;
+	if (ctx->current < 0)
+		return BOOTINFO_DEFAULT_LAYOUT;
+	return (ctx->curinfo.devinfo_version >= DEVINFO_VERSION_JOURNAL
+		? DEVINFO_VERSION_JOURNAL : DEVINFO_VERSION_CURRENT);
+
+} /* update_layout */
+
+/*
+ * append_journal
+ *
+ * Writes the variables set since the last update as a
+ * record appended to the journal of the current copy.
+ *
+ * Returns 1 if the record was written (or there was nothing
+ * to write), 0 if it does not fit, -1 on error (errno set).
+ */
+static int
+append_journal (struct devinfo_context *ctx)
+{
+	int cur = ctx->current;
+	uint8_t *block = ctx->infobuf[cur];
+	const struct device_info *dp = (const struct device_info *) block;
+	unsigned int start = ctx->journal_end[cur], nsectors;
+	struct journal_record rec;
+	struct info_var *var;
+	size_t len = 0, space, nlen, vlen;
+	uint8_t *zbuf = NULL, *data;
+	const char *value;
+
+	if (values_size(ctx) > MAX_DECODED_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (start >= BOOTSTATE_SECTOR)
+		return 0;
+	space = (size_t) (BOOTSTATE_SECTOR - start) * SECTOR_SIZE - sizeof(rec);
+	data = block + (size_t) start * SECTOR_SIZE + sizeof(rec);
+	/* the buffer from here on is about to stop matching storage */
+	if (ctx->cached[cur] > start)
+		ctx->cached[cur] = start;
+	for (var = ctx->vars; var < ctx->vars + ctx->varcount; var++) {
+		if (!var->modified)
+			continue;
+		nlen = strlen(var->name) + 1;
+		if (var->value == NULL) {
+			value = "";
+			vlen = 1;
+		} else
+			value = store_value(var, &zbuf, &vlen);
+		if (len + nlen + vlen > space) {
+			free(zbuf);
+			return 0;
+		}
+		memcpy(data + len, var->name, nlen);
+		memcpy(data + len + nlen, value, vlen);
+		len += nlen + vlen;
+	}
+	free(zbuf);
+	if (len == 0)
+		return 1;
+	nsectors = journal_sectors(len);
+	memset(data + len, 0, (size_t) nsectors * SECTOR_SIZE - sizeof(rec) - len);
+	memcpy(rec.magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+	rec.base_seq = dp->bootstate_seq;
+	rec.seq = ctx->journal_seq[cur] + 1;
+	rec.len = len;
+	rec.crcsum = 0;
+	rec.crcsum = ctx_crc32(ctx, ctx_crc32(ctx, 0, &rec, sizeof(rec)), data, len);
+	memcpy(block + (size_t) start * SECTOR_SIZE, &rec, sizeof(rec));
+	snapshot_begin_update(ctx);
+	if (write_sectors(ctx, cur, start, nsectors) < 0) {
+		snapshot_publish(ctx, false);
+		return -1;
+	}
+	ctx->cached[cur] = start + nsectors;
+	ctx->journal_end[cur] = start + nsectors;
+	ctx->journal_seq[cur] = rec.seq;
+	trace("appended journal record %u to copy %d, %zu bytes of variables",
+	      (unsigned int) rec.seq, cur, len);
+	return 1;
+
+} /* append_journal */
+
+/*
+ * do_update
+ *
+ * Write out a device info block based on the current context.
+ */
+static int
+do_update (struct devinfo_context *ctx)
+{
+	struct device_info *info;
+	unsigned int sector, count, used_sectors, cached;
+	size_t var_len, old_used = 0;
+	uint32_t old_crcs[CRC_CHUNK_COUNT];
+	uint16_t version;
+	bool reuse_crcs;
+	int idx, ret;
+
+	if (ctx->readonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (ctx->in_batch) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (ctx->daemonfd >= 0) {
+		if (daemon_state_request(ctx, BOOTINFOD_COMMIT, ctx->pending, ctx->pending_len, NULL) < 0)
+			return -1;
+		ctx->pending_len = 0;
+		/*
+		 * The variables that were set point at the caller's
+		 * strings, which need not outlive the update, so drop
+		 * them and fetch the variables from the daemon again
+		 * when they are next needed.
+		 */
+		ctx->varcount = 0;
+		ctx->vars_loaded = false;
+		free_strings(ctx);
+		return 0;
+	}
+	/*
+	 * If neither copy turns out to be usable, fall through
+	 * to initializing one below.
+	 */
+	if (load_vars(ctx) < 0 && ctx->current >= 0)
+		return -1;
+	/*
+	 * With the journal layout, append to the current copy
+	 * if there is room, as long as the other one is there
+	 * to fall back on.
+	 */
+	version = update_layout(ctx);
+	if (version == DEVINFO_VERSION_JOURNAL && ctx->current >= 0 &&
+	    ctx->curinfo.devinfo_version == DEVINFO_VERSION_JOURNAL) {
+		verify_extension(ctx, 1 - ctx->current);
+		ret = (ctx->valid[1 - ctx->current] ? append_journal(ctx) : 0);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			goto repoint;
+	}
+	/*
+	 * Invalid current index -> initialize
+	 */
+	if (ctx->current < 0 || ctx->current > 1)
+		idx = 0;
+	else
+		idx = 1 - ctx->current;
+	/*
+	 * If reading the extension for the copy we are about to
+	 * overwrite was deferred, read it now so we only need
+	 * to write the sectors that change.
+	 */
+	verify_extension(ctx, idx);
+
+	info = (struct device_info *) ctx->infobuf[idx];
+	reuse_crcs = (ctx->valid[idx] && ctx->cached[idx] > 0 &&
+		      info->devinfo_version >= DEVINFO_VERSION_CHUNKCRC);
+	if (reuse_crcs) {
+		old_used = ext_bytes_used(info);
+		memcpy(old_crcs, ctx->infobuf[idx] + DEVINFO_HDR_SIZE, sizeof(old_crcs));
+	}
+	memset(ctx->dirty, 0, sizeof(ctx->dirty));
+	for (sector = ctx->cached[idx]; sector < INFOBLOCK_SECTORS; sector++)
+		mark_dirty(ctx, sector);
+	/*
+	 * From here on, the buffer no longer matches storage until
+	 * the write completes.  If packing or writing fails, the
+	 * next update then rewrites the whole block, instead of
+	 * skipping sectors that were changed here but never written.
+	 */
+	cached = ctx->cached[idx];
+	ctx->cached[idx] = 0;
+	memset(info, 0, DEVINFO_BLOCK_SIZE);
+	memcpy(info->magic, DEVICE_MAGIC, sizeof(info->magic));
+	info->devinfo_version = version;
+	info->flags = ctx->curinfo.flags;
+	info->failed_boots = ctx->curinfo.failed_boots;
+	info->sernum = ctx->curinfo.sernum + 1;
+	info->ext_sectors = EXTENSION_SECTOR_COUNT;
+	info->bootstate_seq = ctx->bootstate_seq + 1;
+	if (pack_vars(ctx, idx, &var_len) < 0)
+		return -1;
+	info->var_len = var_len;
+	update_chunk_crcs(ctx, idx, (reuse_crcs ? old_crcs : NULL), old_used);
+	info->crcsum = header_crc(ctx, ctx->infobuf[idx]);
+	used_sectors = 1 + ext_sectors_to_read(info);
+
+	/*
+	 * Write out only the runs of extension sectors in use that
+	 * changed, and write the header last, so the new sernum does
+	 * not appear in storage until the rest of the block is in
+	 * place.  The boot-state journal sector is never written here;
+	 * the new header supersedes any record it holds.
+	 */
+	if (cached > used_sectors)
+		used_sectors = cached;
+	snapshot_begin_update(ctx);
+	for (sector = 1; sector < used_sectors && sector < BOOTSTATE_SECTOR; sector += count) {
+		for (count = 0;
+		     sector + count < used_sectors && sector + count < BOOTSTATE_SECTOR &&
+			     sector_is_dirty(ctx, sector + count);
+		     count++);
+		if (count == 0) {
+			count = 1;
+			continue;
+		}
+		if (write_sectors(ctx, idx, sector, count) < 0)
+			goto write_failed;
+	}
+	if (write_sectors(ctx, idx, 0, 1) < 0)
+		goto write_failed;
+	ctx->bootstate_seq = info->bootstate_seq;
+	ctx->bootstate_slot = -1;
+	ctx->cached[idx] = used_sectors;
 
-#define OFFSET_COUNT 2
-static const off_t devinfo_offset[OFFSET_COUNT] = {
-	[0] = BOOTINFO_STORAGE_OFFSET_A,
-	[1] = BOOTINFO_STORAGE_OFFSET_B,
-};
+	/*
+	 * The copy just written is now the current one, so the
+	 * next update goes to the other copy.  Re-point the variables
+	 * at the packed copy, since the buffer they were parsed from
+	 * is the one that gets overwritten next, and the strings
+	 * that were set are no longer needed.
+	 */
+	ctx->valid[idx] = 1;
+	ctx->ext_checked[idx] = true;
+	ctx->journal_end[idx] = journal_start(info);
+	ctx->journal_seq[idx] = 0;
+	ctx->current = idx;
+	memcpy(&ctx->curinfo, info, sizeof(ctx->curinfo));
+	trace("updated copy %d, sernum %u, %zu bytes of variables", idx,
+	      (unsigned int) info->sernum, var_len);
 
-static const off_t extension_offset[OFFSET_COUNT] = {
-	[0] = (BOOTINFO_STORAGE_OFFSET_A + DEVINFO_BLOCK_SIZE),
-	[1] = (BOOTINFO_STORAGE_OFFSET_B + DEVINFO_BLOCK_SIZE),
-};
+  repoint:
+	if (parse_vars(ctx) < 0) {
+		set_writeable(&ctx->backend, &ctx->stats, false);
+		ctx->readonly = true;
+	}
+	free_strings(ctx);
+	free(ctx->varstore);
+	ctx->varstore = NULL;
+	snapshot_publish(ctx, true);
 
-static const char *devinfo_devices[] = {
-	[0] = BOOTINFO_STORAGE_DEVICE,
-};
+	return 0;
+
+  write_failed:
+	snapshot_publish(ctx, false);
+	return -1;
+
+} /* do_update */
 
 /*
- * find_storage_dev
- *
- * Identifies the devinfo storage device
- * by iterating through devinfo_devices[]. First
- * successful access(F_OK) wins.
+ * bootinfo_update
  *
- * returns 0 on success, non-0 on failure.
+ * Public API for do_update.  This also takes care of
+ * any update requested with bootinfo_update_async() that
+ * has not been done yet.
  */
-static int
-find_storage_dev (char *buf, size_t bufsize)
+int
+bootinfo_update (struct devinfo_context *ctx)
 {
-	unsigned int i;
+	int ret;
 
-	for (i = 0; i < sizeof(devinfo_devices)/sizeof(devinfo_devices[0]); i++) {
-		if (access(devinfo_devices[i], F_OK) == 0) {
-		        strncpy(buf, devinfo_devices[i], bufsize-1);
-			buf[bufsize-1] = '\0';
-			return 0;
-		}
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
-	errno = ENODEV;
-	return -1;
+	lock_ctx(ctx);
+	ctx->async_pending = false;
+	ret = do_update(ctx);
+	unlock_ctx(ctx);
+	return ret;
 
-} /* find_storage_dev */
+} /* bootinfo_update */
 
 /*
- * parse_vars
- *
- * A variable consists of a null-terminated name followed
- * by a null-terminated value.	Names and values are simply
- * concatenated into the space after the header, up to the
- * block size. A null byte at the beginning of a variable
- * name indicates the end of the list.
+ * async_writer
  *
- * It's possible to have a null value, but in this implementation
- * null-valued variables are not written to the info block;
- * setting a value to the null string deletes the variable.
+ * Background thread for bootinfo_update_async(), which does
+ * the requested update once the delay has passed, or as soon
+ * as a flush or close asks for it.
  */
-static int
-parse_vars (struct devinfo_context *ctx)
+static void *
+async_writer (void *arg)
 {
-	struct info_var *var, *last;
-	char *cp, *endp, *valp;
-	ssize_t remain, varbytes;
+	struct devinfo_context *ctx = arg;
 
-	ctx->vars = NULL;
-	if (ctx->current < 0) {
-		fprintf(stderr, "error: parse_vars called with no valid info block\n");
-		return -1;
-	}
-	for (cp = (char *)(ctx->infobuf[ctx->current] + DEVINFO_HDR_SIZE),
-		     remain = sizeof(ctx->infobuf[ctx->current]) - (DEVINFO_HDR_SIZE+sizeof(uint32_t)),
-		     ctx->varsize = 0,
-		     last = NULL;
-	     remain > 0 && *cp != '\0';
-	     cp += varbytes, remain -= varbytes) {
-		for (endp = cp + 1, varbytes = 1;
-		     varbytes < remain && *endp != '\0';
-		     endp++, varbytes++);
-		if (varbytes >= remain)
-			break;
-		for (valp = endp + 1, varbytes += 1;
-		     varbytes < remain && *valp != '\0';
-		     valp++, varbytes++);
-		if (varbytes >= remain)
+	pthread_mutex_lock(&ctx->async_lock);
+	for (;;) {
+		while (!ctx->async_pending && !ctx->async_stop)
+			pthread_cond_wait(&ctx->async_cond, &ctx->async_lock);
+		if (!ctx->async_pending)
 			break;
-		var = calloc(1, sizeof(struct info_var));
-		if (var == NULL) {
-			perror("variable storage");
-			return -1;
-		}
-		var->name = cp;
-		var->value = endp + 1;
-		if (last == NULL)
-			ctx->vars = var;
-		else
-			last->next = var;
-		last = var;
-		varbytes += 1; /* for trailing null at end of value */
-		ctx->varsize += varbytes;
+		while (ctx->async_pending && !ctx->async_flush && !ctx->async_stop &&
+		       pthread_cond_timedwait(&ctx->async_cond, &ctx->async_lock,
+					      &ctx->async_deadline) == 0);
+		if (!ctx->async_pending)
+			continue;
+		ctx->async_pending = false;
+		if (do_update(ctx) < 0 && ctx->async_error == 0)
+			ctx->async_error = errno;
+		ctx->async_flush = false;
+		pthread_cond_broadcast(&ctx->async_cond);
 	}
+	pthread_mutex_unlock(&ctx->async_lock);
+	return NULL;
 
-	return 0;
-
-} /* parse_vars */
+} /* async_writer */
 
 /*
- * pack_vars
+ * start_async
+ *
+ * Starts the background writer for a context.
  *
- * Pack the list of variables into the current devinfo block.
+ * Returns 0 on success, -1 on error (errno set).
  */
 static int
-pack_vars (struct devinfo_context *ctx, int idx)
+start_async (struct devinfo_context *ctx)
 {
-	struct info_var *var;
-	char *cp;
-	size_t remain, nlen, vlen;
+	pthread_condattr_t attr;
+	int rc;
 
-	if (idx != 0 && idx != 1)
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	rc = pthread_cond_init(&ctx->async_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (rc != 0) {
+		errno = rc;
 		return -1;
-	if (ctx->vars == NULL)
-		return 0;
-	for (var = ctx->vars, cp = (char *)(ctx->infobuf[idx] + DEVINFO_HDR_SIZE),
-		     remain = sizeof(ctx->infobuf[ctx->current]) - (DEVINFO_HDR_SIZE+sizeof(uint32_t)+1);
-	     var != NULL && remain > 0;
-	     var = var->next) {
-		nlen = strlen(var->name) + 1;
-		vlen = strlen(var->value) + 1;
-		if (nlen + vlen > remain) {
-			fprintf(stderr, "error: variables list too large\n");
-			return -1;
-		}
-		memcpy(cp, var->name, nlen);
-		cp += nlen; remain -= nlen;
-		memcpy(cp, var->value, vlen);
-		cp += vlen; remain -= vlen;
 	}
-	if (var != NULL || remain == 0) {
-		fprintf(stderr, "error: variables list too large\n");
+	pthread_mutex_init(&ctx->async_lock, NULL);
+	rc = pthread_create(&ctx->async_thread, NULL, async_writer, ctx);
+	if (rc != 0) {
+		pthread_cond_destroy(&ctx->async_cond);
+		pthread_mutex_destroy(&ctx->async_lock);
+		errno = rc;
 		return -1;
 	}
-	*cp = '\0';
-
+	ctx->async_started = true;
 	return 0;
 
-} /* pack_vars */
+} /* start_async */
 
 /*
- * free_vars
+ * stop_async
  *
- * Frees the memory for variable tracking.
+ * Stops the background writer, after it has done
+ * any update still pending.
  */
 static void
-free_vars (struct info_var *firstvar)
+stop_async (struct devinfo_context *ctx)
 {
-	struct info_var *var, *vnext;
-	for (var = firstvar; var != NULL; var = vnext) {
-		vnext = var->next;
-		free(var);
-	}
+	if (!ctx->async_started)
+		return;
+	pthread_mutex_lock(&ctx->async_lock);
+	ctx->async_stop = true;
+	pthread_cond_broadcast(&ctx->async_cond);
+	pthread_mutex_unlock(&ctx->async_lock);
+	pthread_join(ctx->async_thread, NULL);
+	pthread_cond_destroy(&ctx->async_cond);
+	pthread_mutex_destroy(&ctx->async_lock);
+	ctx->async_started = false;
 
-} /* free_vars */
+} /* stop_async */
 
 /*
- * find_bootinfo
- *
- * Tries to find a valid bootinfo block, and initializes a context
- * if one is found.
+ * bootinfo_update_async
  *
- * Returns negative value on an underlying error or if neither block
- * is valid.
+ * Requests an update to storage, as with bootinfo_update(),
+ * but returns without waiting for it.  The update is done
+ * in the background within BOOTINFO_ASYNC_DELAY_MS, and
+ * further requests made in the meantime are folded into the
+ * same write.  bootinfo_flush() waits for it to be done and
+ * reports any error; closing the context also completes it.
  *
- * ctxp is set to NULL if an internal error occurred, otherwise it is
- * set to point to a valid context, and (*ctxp)->fd is the fd of
- * the open channel to the MMC boot1 device. Device is opened readonly
- * and (*ctxp)->readonly is set to true if the readonly arg is non-zero;
- * otherwise, (*ctxp)->readonly is set to true if a valid block is found
- * but an internal error occurred parsing the variables stored in the block.
+ * When the background update is done, the variables are
+ * re-read from the copy just written, so value pointers from
+ * bootinfo_bootvar_get() and iterations in progress are
+ * invalidated at that point; call bootinfo_flush() first if
+ * they need to stay valid.  The boot-state functions are not
+ * affected and still write synchronously.
  */
-static int
-find_bootinfo (bool readonly, struct devinfo_context **ctxp, const char *devinfo_dev)
+int
+bootinfo_update_async (struct devinfo_context *ctx)
 {
-	struct devinfo_context *ctx;
-	struct device_info *dp;
-	ssize_t n, cnt;
-	int i, dirfd;
-
-	*ctxp = NULL;
-	ctx = calloc(1, sizeof(struct devinfo_context));
-	if (ctx == NULL)
-		return -1;
-	ctx->readonly = readonly;
-	strcpy(ctx->devinfo_dev, devinfo_dev);
+	struct timespec now;
+	long nsec;
 
-	dirfd = open("/run/rk-bootinfo", O_PATH);
-	if (dirfd < 0) {
-		if (mkdir("/run/rk-bootinfo", 02770) < 0) {
-			close(ctx->fd);
-			if (!ctx->readonly)
-				set_bootdev_writeable_status(ctx->devinfo_dev, false);
-			free(ctx);
-			return -1;
-		}
-		dirfd = open("/run/rk-bootinfo", O_PATH);
-	}
-	ctx->lockfd = openat(dirfd, "lockfile", O_CREAT|O_RDWR, 0770);
-	if (ctx->lockfd < 0) {
-		close(dirfd);
-		free(ctx);
+	if (ctx == NULL) {
+		errno = EINVAL;
 		return -1;
 	}
-	close(dirfd);
-	if (flock(ctx->lockfd, (readonly ? LOCK_SH : LOCK_EX)) < 0) {
-		close(ctx->lockfd);
-		free(ctx);
+	if (ctx->readonly) {
+		errno = EROFS;
 		return -1;
 	}
-	if (!ctx->readonly)
-		set_bootdev_writeable_status(ctx->devinfo_dev, true);
-
-	ctx->fd = open(devinfo_dev, (readonly ? O_RDONLY : O_RDWR|O_DSYNC));
-	if (ctx->fd < 0) {
-		if (!ctx->readonly)
-			set_bootdev_writeable_status(ctx->devinfo_dev, false);
-		close(ctx->lockfd);
-		free(ctx);
+	if (ctx->in_batch) {
+		errno = EBUSY;
 		return -1;
 	}
-	for (i = 0; i < OFFSET_COUNT; i++) {
-		/*
-		 * Read base block
-		 */
-		if (lseek(ctx->fd, devinfo_offset[i], SEEK_SET) < 0)
-			continue;
-		for (n = 0; n < DEVINFO_BLOCK_SIZE; n += cnt) {
-			cnt = read(ctx->fd, &ctx->infobuf[i][n], DEVINFO_BLOCK_SIZE-n);
-			if (cnt < 0)
-				break;
-		}
-		if (n < DEVINFO_BLOCK_SIZE)
-			continue;
-
-		dp = (struct device_info *)(ctx->infobuf[i]);
-
-		if (memcmp(dp->magic, DEVICE_MAGIC, DEVICE_MAGIC_SIZE) != 0)
-			continue;
-		if (dp->devinfo_version >= DEVINFO_VERSION_CURRENT) {
-			uint32_t crcsum;
-			if (dp->ext_sectors != EXTENSION_SECTOR_COUNT) {
-				continue;
-			}
-			/*
-			 * Read extension block
-			 */
-			if (lseek(ctx->fd, extension_offset[i], SEEK_SET) < 0)
-				continue;
-			for (n = 0; n < EXTENSION_SIZE; n += cnt) {
-				cnt = read(ctx->fd, &ctx->infobuf[i][DEVINFO_BLOCK_SIZE+n], EXTENSION_SIZE-n);
-				if (cnt < 0)
-					break;
-			}
-			if (n < EXTENSION_SIZE)
-				continue;
-			crcsum = *(uint32_t *)(&ctx->infobuf[i][DEVINFO_BLOCK_SIZE+EXTENSION_SIZE-sizeof(uint32_t)]);
-			if (crc32(0, &ctx->infobuf[i][DEVINFO_BLOCK_SIZE], EXTENSION_SIZE-sizeof(uint32_t)) != crcsum)
-				continue;
-		} else
-			continue; /* unrecognized version */
-		ctx->valid[i] = 1;
-	}
-	*ctxp = ctx;
-	if (!(ctx->valid[0] || ctx->valid[1])) {
-		ctx->current = -1;
-		memset(&ctx->curinfo, 0, sizeof(ctx->curinfo));
+	if (!ctx->async_started && start_async(ctx) < 0)
 		return -1;
-	} else if (ctx->valid[0] && !ctx->valid[1])
-		ctx->current = 0;
-	else if (!ctx->valid[0] && ctx->valid[1])
-		ctx->current = 1;
-	else {
-		/* both valid */
-		struct device_info *dp1 = (struct device_info *)(ctx->infobuf[1]);
-		dp = (struct device_info *)(ctx->infobuf[0]);
-		if (dp->sernum == 255 && dp1->sernum == 0)
-			ctx->current = 1;
-		else if (dp1->sernum == 255 && dp->sernum == 0)
-			ctx->current = 0;
-		else if (dp1->sernum > dp->sernum)
-			ctx->current = 1;
-		else
-			ctx->current = 0;
-	}
-	memcpy(&ctx->curinfo, ctx->infobuf[ctx->current], sizeof(ctx->curinfo));
-	if (parse_vars(ctx) < 0) {
-		/* internal error ? */
-		if (!ctx->readonly)
-			set_bootdev_writeable_status(ctx->devinfo_dev, false);
-		ctx->readonly = true;
+	pthread_mutex_lock(&ctx->async_lock);
+	if (!ctx->async_pending) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		nsec = now.tv_nsec + (BOOTINFO_ASYNC_DELAY_MS % 1000) * 1000000L;
+		ctx->async_deadline.tv_sec = now.tv_sec + BOOTINFO_ASYNC_DELAY_MS / 1000 + nsec / 1000000000L;
+		ctx->async_deadline.tv_nsec = nsec % 1000000000L;
+		ctx->async_pending = true;
+		pthread_cond_broadcast(&ctx->async_cond);
 	}
+	pthread_mutex_unlock(&ctx->async_lock);
 	return 0;
 
-} /* find_bootinfo */
+} /* bootinfo_update_async */
 
 /*
- * bootinfo_update
+ * bootinfo_flush
  *
- * Write out a device info block based on the current context.
+ * Waits for any update requested with bootinfo_update_async()
+ * to be written.  Returns -1 (errno set) if that, or any earlier
+ * background update since the last flush, failed.
  */
 int
-bootinfo_update (struct devinfo_context *ctx)
+bootinfo_flush (struct devinfo_context *ctx)
 {
-	uint32_t *crcptr;
-	struct device_info *info;
-	ssize_t n, cnt;
-	int idx;
+	int err;
 
 	if (ctx == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	if (ctx->readonly) {
-		errno = EROFS;
+	if (!ctx->async_started)
+		return 0;
+	pthread_mutex_lock(&ctx->async_lock);
+	if (ctx->async_pending) {
+		ctx->async_flush = true;
+		pthread_cond_broadcast(&ctx->async_cond);
+		while (ctx->async_pending)
+			pthread_cond_wait(&ctx->async_cond, &ctx->async_lock);
+	}
+	err = ctx->async_error;
+	ctx->async_error = 0;
+	pthread_mutex_unlock(&ctx->async_lock);
+	if (err != 0) {
+		errno = err;
 		return -1;
 	}
-	/*
-	 * Invalid current index -> initialize
-	 */
-	if (ctx->current < 0 || ctx->current > 1)
-		idx = 0;
-	else
-		idx = 1 - ctx->current;
+	return 0;
 
-	info = (struct device_info *) ctx->infobuf[idx];
-	crcptr = (uint32_t *) &ctx->infobuf[idx][DEVINFO_BLOCK_SIZE + EXTENSION_SIZE - sizeof(uint32_t)];
-	memset(info, 0, DEVINFO_BLOCK_SIZE);
-	memcpy(info->magic, DEVICE_MAGIC, sizeof(info->magic));
-	info->devinfo_version = DEVINFO_VERSION_CURRENT;
-	info->flags = ctx->curinfo.flags;
-	info->failed_boots = ctx->curinfo.failed_boots;
-	info->sernum = ctx->curinfo.sernum + 1;
-	info->ext_sectors = EXTENSION_SECTOR_COUNT;
-	if (pack_vars(ctx, idx) < 0)
-		return -1;
-	info->crcsum = crc32(0, ctx->infobuf[idx], DEVINFO_BLOCK_SIZE);
-	*crcptr = crc32(0, &ctx->infobuf[idx][DEVINFO_BLOCK_SIZE], EXTENSION_SIZE-sizeof(uint32_t));
+} /* bootinfo_flush */
 
-	if (lseek(ctx->fd, devinfo_offset[idx], SEEK_SET) < 0)
-		return -1;
-	for (n = 0; n < DEVINFO_BLOCK_SIZE; n += cnt) {
-		cnt = write(ctx->fd, ctx->infobuf[idx] + n, DEVINFO_BLOCK_SIZE-n);
-		if (cnt < 0)
-			return -1;
+/*
+ * update_bootstate
+ *
+ * Commits the boot state (flags and failed boot count) in the
+ * context to storage.  When neither copy holds an older layout
+ * that uses the journal sectors for variable data, this writes
+ * just the next journal record; otherwise, it falls back to a
+ * full update.
+ */
+static int
+update_bootstate (struct devinfo_context *ctx)
+{
+	struct bootstate_record rec;
+	struct device_info *dp;
+	int i, slot;
+
+	if (ctx->current < 0 || ctx->curinfo.devinfo_version < DEVINFO_VERSION_BOOTSTATE)
+		return do_update(ctx);
+	for (i = 0; i < OFFSET_COUNT; i++) {
+		dp = (struct device_info *) ctx->infobuf[i];
+		if (ctx->valid[i] && dp->devinfo_version < DEVINFO_VERSION_BOOTSTATE)
+			return do_update(ctx);
 	}
-	if (lseek(ctx->fd, extension_offset[idx], SEEK_SET) < 0)
+	slot = (ctx->bootstate_slot < 0 ? 0 : 1 - ctx->bootstate_slot);
+	memset(&rec, 0, sizeof(rec));
+	memcpy(rec.magic, BOOTSTATE_MAGIC, sizeof(rec.magic));
+	rec.seq = ctx->bootstate_seq + 1;
+	rec.flags = ctx->curinfo.flags;
+	rec.failed_boots = ctx->curinfo.failed_boots;
+	rec.crcsum = ctx_crc32(ctx, 0, &rec, sizeof(rec));
+	memset(&ctx->infobuf[slot][BOOTSTATE_OFFSET], 0, SECTOR_SIZE);
+	memcpy(&ctx->infobuf[slot][BOOTSTATE_OFFSET], &rec, sizeof(rec));
+	snapshot_begin_update(ctx);
+	if (write_sectors(ctx, slot, BOOTSTATE_SECTOR, 1) < 0) {
+		if (ctx->cached[slot] > BOOTSTATE_SECTOR)
+			ctx->cached[slot] = BOOTSTATE_SECTOR;
+		snapshot_publish(ctx, false);
 		return -1;
-	for (n = 0; n < EXTENSION_SIZE; n += cnt) {
-		cnt = write(ctx->fd, ctx->infobuf[idx] + DEVINFO_BLOCK_SIZE + n, EXTENSION_SIZE-n);
-		if (cnt < 0)
-			return -1;
 	}
-
+	ctx->bootstate_seq = rec.seq;
+	ctx->bootstate_slot = slot;
+	snapshot_publish(ctx, true);
 	return 0;
 
-} /* bootinfo_update */
+} /* update_bootstate */
 
 /*
  * close_bootinfo
@@ -499,8 +3292,11 @@ close_bootinfo (struct devinfo_context *ctx, bool keeplock)
 
 	if (ctx == NULL)
 		return lockfd;
-	if (!ctx->readonly)
-		set_bootdev_writeable_status(ctx->devinfo_dev, false);
+	stop_async(ctx);
+	if (ctx->daemonfd >= 0)
+		close(ctx->daemonfd);
+	else if (!ctx->readonly)
+		set_writeable(&ctx->backend, &ctx->stats, false);
 	if (ctx->fd >= 0)
 		close(ctx->fd);
 	if (keeplock)
@@ -509,13 +3305,40 @@ close_bootinfo (struct devinfo_context *ctx, bool keeplock)
 		close(ctx->lockfd);
 	ctx->fd = -1;
 	ctx->lockfd = -1;
-	free_vars(ctx->vars);
+	free(ctx->vars);
+	free(ctx->sorted);
+	if (ctx->snapshot != NULL)
+		munmap(ctx->snapshot, SNAPSHOT_SIZE);
+	unmap_infobufs(ctx);
+	free(ctx->varstore);
+	free(ctx->batch_vars);
+	free_strings(ctx);
+	free(ctx->pending);
 	free(ctx);
 
 	return lockfd;
 
 } /* close_bootinfo */
 
+/*
+ * bootinfo_get_stats
+ *
+ * Returns the I/O statistics for the context.
+ */
+int
+bootinfo_get_stats (struct devinfo_context *ctx, struct bootinfo_stats *stats)
+{
+	if (ctx == NULL || stats == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	lock_ctx(ctx);
+	*stats = ctx->stats;
+	unlock_ctx(ctx);
+	return 0;
+
+} /* bootinfo_get_stats */
+
 /*
  * bootinfo_close
  *
@@ -536,34 +3359,80 @@ bootinfo_close (struct devinfo_context *ctx)
  * Flags:
  *    BOOTINFO_O_RDONLY      - open read-only, otherwise will be read-write
  *    BOOTINFO_O_FORCE_INIT  - init in-storage structures even if present
+ *    BOOTINFO_O_HEADER_ONLY - defer reading the variable storage until
+ *                             the variables are first used; if it then
+ *                             turns out to be corrupted in both copies,
+ *                             the variable functions fail with EIO
+ *                             (no automatic re-initialization)
+ *    BOOTINFO_O_NO_DAEMON   - access storage directly, even if
+ *                             rk-bootinfod is running or a snapshot
+ *                             is available
+ *
+ * Read-only opens use the snapshot published by writers, if it is
+ * up to date.  Otherwise, if rk-bootinfod is running, the context is
+ * served through it rather than by accessing the storage directly.
  *
  * If ctxp is non-NULL, the initialized context is left open for
  * further bootinfo API calls.
  */
 int
 bootinfo_open (struct devinfo_context **ctxp, unsigned int flags)
+{
+	return bootinfo_open_config(ctxp, flags, NULL);
+
+} /* bootinfo_open */
+
+/*
+ * bootinfo_open_config
+ *
+ * As bootinfo_open, for the store described by config
+ * (NULL for the built-in defaults); see bootinfo_config_init.
+ */
+int
+bootinfo_open_config (struct devinfo_context **ctxp, unsigned int flags,
+		      const struct bootinfo_config *config)
 {
 	int i, fd = -1, lockfd = -1;
-	bool reset_bootdev = false;
-	ssize_t n, cnt;
+	bool reset_bootdev = false, header_only;
 	struct devinfo_context *ctx = NULL;
-	uint8_t *buf = NULL;
-	struct info_var *var, *preserve_list = NULL;
-	char devinfo_dev[PATH_MAX];
+	struct info_var *var;
+	char *preserved = NULL, *cp;
+	size_t preserved_size = 0;
+	struct storage_backend backend;
+	struct bootinfo_stats stats;
 
 	if (ctxp == NULL || ((flags & BOOTINFO_O_RDONLY) != 0 &&
 			     (flags & BOOTINFO_O_FORCE_INIT) != 0)) {
 		errno = EINVAL;
 		return -1;
 	}
-
-	if (find_storage_dev(devinfo_dev, sizeof(devinfo_dev)) < 0) {
-		*ctxp = NULL;
+	*ctxp = NULL;
+	if (setup_backend(&backend, config) < 0)
 		return -1;
+
+	if ((flags & BOOTINFO_O_NO_DAEMON) == 0) {
+		i = 0;
+		if ((flags & BOOTINFO_O_RDONLY) != 0) {
+			i = open_snapshot(ctxp, &backend);
+			if (i > 0)
+				trace("opened from snapshot in %s", backend.lockdir);
+		}
+		if (i == 0) {
+			i = open_daemon(ctxp, flags, &backend);
+			if (i > 0)
+				trace("opened through rk-bootinfod");
+		}
+		if (i != 0)
+			return (i < 0 ? -1 : 0);
 	}
 
+	if (backend.device[0] == '\0' &&
+	    find_storage_dev(backend.device, sizeof(backend.device)) < 0)
+		return -1;
+
+	header_only = (flags & (BOOTINFO_O_HEADER_ONLY|BOOTINFO_O_FORCE_INIT)) == BOOTINFO_O_HEADER_ONLY;
 	if ((flags & BOOTINFO_O_RDONLY) != 0)
-		return find_bootinfo(true, ctxp, devinfo_dev);
+		return find_bootinfo(true, header_only, ctxp, &backend);
 
 	/*
 	 * For read-write opens, we initialize the in-storage
@@ -571,77 +3440,71 @@ bootinfo_open (struct devinfo_context **ctxp, unsigned int flags)
 	 * does *not* return an error, we only initialize if
 	 * the FORCE_INIT flag is set.
 	 */
-	if (find_bootinfo(false, &ctx, devinfo_dev) == 0 &&
+	if (find_bootinfo(false, header_only, &ctx, &backend) == 0 &&
 	    ctx != NULL &&
 	    (flags & BOOTINFO_O_FORCE_INIT) == 0) {
 		*ctxp = ctx;
 		return 0;
 	}
+	/* never initialize under a running rk-bootinfod */
+	if (ctx == NULL && errno == EBUSY)
+		return -1;
 	/*
 	 * Initialization code below here.
 	 *
 	 *
 	 * Preserve variables that begin with an underscore.
-	 * The linked list we build here gets reused in the new
-	 * context we create after initialization as the new variable
-	 * list.
+	 * They are copied, packed as they are in storage, into
+	 * a single buffer that the new context we create after
+	 * initialization takes over for its variable array.
 	 */
 	if (ctx != NULL) {
-		struct info_var *prev = NULL;
-		for (var = ctx->vars; var != NULL; var = var->next) {
-			if (*var->name == '_') {
-				struct info_var *varcopy;
-				size_t namelen = strlen(var->name);
-				size_t vallen = strlen(var->value);
-				varcopy = calloc(1, sizeof(*var) + namelen + vallen + 2);
-				if (varcopy == NULL) {
-					close_bootinfo(ctx, false);
-					*ctxp = NULL;
-					return -1;
-				}
-				varcopy->name = (char *)(varcopy + 1);
-				memcpy(varcopy->name, var->name, namelen);
-				varcopy->value = varcopy->name + namelen + 1;
-				memcpy(varcopy->value, var->value, vallen);
-				if (prev == NULL)
-					prev = preserve_list = varcopy;
-				else
-					prev->next = varcopy;
-				prev = varcopy;
+		for (var = ctx->vars; var < ctx->vars + ctx->varcount; var++)
+			if (*var->name == '_' && var->value != NULL)
+				preserved_size += strlen(var->name) + strlen(var->value) + 2;
+		if (preserved_size > 0) {
+			preserved = malloc(preserved_size);
+			if (preserved == NULL) {
+				close_bootinfo(ctx, false);
+				*ctxp = NULL;
+				return -1;
+			}
+		}
+		for (var = ctx->vars, cp = preserved; var < ctx->vars + ctx->varcount; var++) {
+			if (*var->name == '_' && var->value != NULL) {
+				cp = stpcpy(cp, var->name) + 1;
+				cp = stpcpy(cp, var->value) + 1;
 			}
 		}
+		/* a journal store stays one unless the config says otherwise */
+		if (backend.layout_version == 0 &&
+		    ctx->curinfo.devinfo_version >= DEVINFO_VERSION_JOURNAL)
+			backend.layout_version = DEVINFO_VERSION_JOURNAL;
+		stats = ctx->stats;
 		lockfd = close_bootinfo(ctx, true);
-	} else
+		ctx = NULL;
+	} else {
+		memset(&stats, 0, sizeof(stats));
 		lockfd = -1;
+	}
 
-	buf = calloc(1, DEVINFO_BLOCK_SIZE + EXTENSION_SIZE);
-	if (buf == NULL)
+	trace("initializing %s", backend.device);
+	ctx = calloc(1, sizeof(struct devinfo_context));
+	if (ctx == NULL || map_infobufs(ctx) < 0)
 		goto error_depart;
-	reset_bootdev = set_bootdev_writeable_status(devinfo_dev, true);
-	fd = open(devinfo_dev, O_RDWR|O_DSYNC);
+	reset_bootdev = set_writeable(&backend, &stats, true);
+	fd = blkio_open(backend.device, O_RDWR|O_DSYNC, true);
 	if (fd < 0)
 		goto error_depart;
 	/*
-	 * Initialize the header block in both copies
+	 * Initialize the header block in both copies.  The
+	 * buffers have not been touched yet, so the zeros are
+	 * written from the shared zero page.
 	 */
 	for (i = 0; i < 2; i++) {
-		if (lseek(fd, devinfo_offset[i], SEEK_SET) < 0)
-			break;
-		for (n = 0; n < DEVINFO_BLOCK_SIZE; n += cnt) {
-			cnt = write(fd, buf+n, DEVINFO_BLOCK_SIZE-n);
-			if (cnt < 0)
-				break;
-		}
-		if (n < DEVINFO_BLOCK_SIZE)
-			break;
-		if (lseek(fd, extension_offset[i], SEEK_SET) < 0)
-			break;
-		for (n = 0; n < EXTENSION_SIZE; n += cnt) {
-			cnt = write(fd, buf+DEVINFO_BLOCK_SIZE+n, EXTENSION_SIZE-n);
-			if (cnt < 0)
-				break;
-		}
-		if (n < EXTENSION_SIZE)
+		if (dev_write(&stats, fd, ctx->infobuf[i], DEVINFO_BLOCK_SIZE, backend.devinfo_offset[i]) < 0 ||
+		    dev_write(&stats, fd, ctx->infobuf[i] + DEVINFO_BLOCK_SIZE, EXTENSION_SIZE,
+			      EXTENSION_OFFSET(&backend, i)) < 0)
 			break;
 	}
 	/*
@@ -652,15 +3515,20 @@ bootinfo_open (struct devinfo_context **ctxp, unsigned int flags)
 		goto error_depart;
 	}
 
-	ctx = calloc(1, sizeof(struct devinfo_context));
-	if (ctx == NULL)
-		goto error_depart;
 	ctx->fd = fd;
 	ctx->lockfd = lockfd;
+	ctx->backend = backend;
+	ctx->stats = stats;
 	ctx->current = -1;
-	ctx->vars = preserve_list;
+	ctx->bootstate_slot = -1;
+	/* both copies were just zeroed, matching the zeroed buffers */
+	ctx->cached[0] = ctx->cached[1] = INFOBLOCK_SECTORS;
+	ctx->daemonfd = -1;
+	if (unpack_vars(ctx, preserved, preserved_size) < 0)
+		goto error_depart;
+	preserved = NULL;
+	ctx->vars_loaded = true;
 	*ctxp = ctx;
-	free(buf);
 	return bootinfo_update(ctx);
 
   error_depart:
@@ -669,17 +3537,18 @@ bootinfo_open (struct devinfo_context **ctxp, unsigned int flags)
 	if (lockfd >= 0)
 		close(lockfd);
 	if (reset_bootdev)
-		set_bootdev_writeable_status(devinfo_dev, false);
-	if (buf != NULL)
-		free(buf);
-	if (ctx != NULL)
+		set_writeable(&backend, &stats, false);
+	if (ctx != NULL) {
+		unmap_infobufs(ctx);
+		free(ctx->vars);
 		free(ctx);
+	}
 	*ctxp = NULL;
-	free_vars(preserve_list);
+	free(preserved);
 	return -1;
 
 
-} /* bootinfo_open */
+} /* bootinfo_open_config */
 
 /*
  * bootinfo_mark_successful
@@ -701,12 +3570,19 @@ bootinfo_mark_successful (struct devinfo_context *ctx,
 		errno = EINVAL;
 	else if (ctx->readonly)
 		errno = EROFS;
+	else if (ctx->daemonfd >= 0) {
+		lock_ctx(ctx);
+		ret = daemon_state_request(ctx, BOOTINFOD_MARK_SUCCESSFUL, NULL, 0, failed_boot_count);
+		unlock_ctx(ctx);
+	}
 	else {
+		lock_ctx(ctx);
 		ctx->curinfo.flags &= ~FLAG_BOOT_IN_PROGRESS;
 		if (failed_boot_count != NULL)
 			*failed_boot_count = ctx->curinfo.failed_boots;
 		ctx->curinfo.failed_boots = 0;
-		ret = bootinfo_update(ctx);
+		ret = update_bootstate(ctx);
+		unlock_ctx(ctx);
 	}
 
 	return ret;
@@ -737,14 +3613,21 @@ bootinfo_mark_in_progress (struct devinfo_context *ctx,
 		errno = EINVAL;
 	else if (ctx->readonly)
 		errno = EROFS;
+	else if (ctx->daemonfd >= 0) {
+		lock_ctx(ctx);
+		ret = daemon_state_request(ctx, BOOTINFOD_MARK_IN_PROGRESS, NULL, 0, failed_boot_count);
+		unlock_ctx(ctx);
+	}
 	else {
+		lock_ctx(ctx);
 		if (ctx->curinfo.flags & FLAG_BOOT_IN_PROGRESS)
 			ctx->curinfo.failed_boots += 1;
 		else
 			ctx->curinfo.flags |= FLAG_BOOT_IN_PROGRESS;
 		if (failed_boot_count != NULL)
 			*failed_boot_count = ctx->curinfo.failed_boots;
-		ret = bootinfo_update(ctx);
+		ret = update_bootstate(ctx);
+		unlock_ctx(ctx);
 	}
 	return ret;
 
@@ -757,45 +3640,65 @@ bootinfo_mark_in_progress (struct devinfo_context *ctx,
 int
 bootinfo_is_in_progress (struct devinfo_context *ctx)
 {
+	int ret;
+
 	if (ctx == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	return (ctx->curinfo.flags & FLAG_BOOT_IN_PROGRESS) != 0 ? 1 : 0;
+	lock_ctx(ctx);
+	ret = (ctx->curinfo.flags & FLAG_BOOT_IN_PROGRESS) != 0 ? 1 : 0;
+	unlock_ctx(ctx);
+	return ret;
 }
 
 int
 bootinfo_devinfo_version (struct devinfo_context *ctx)
 {
+	int ret;
+
 	if (ctx == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	return (int) ctx->curinfo.devinfo_version;
+	lock_ctx(ctx);
+	ret = (int) ctx->curinfo.devinfo_version;
+	unlock_ctx(ctx);
+	return ret;
 }
 
 int
 bootinfo_failed_boot_count (struct devinfo_context *ctx)
 {
+	int ret;
+
 	if (ctx == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	return (int) ctx->curinfo.failed_boots;
+	lock_ctx(ctx);
+	ret = (int) ctx->curinfo.failed_boots;
+	unlock_ctx(ctx);
+	return ret;
 }
 
 int
 bootinfo_extension_sectors (struct devinfo_context *ctx)
 {
+	int ret;
+
 	if (ctx == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	return (int) ctx->curinfo.ext_sectors;
+	lock_ctx(ctx);
+	ret = (int) ctx->curinfo.ext_sectors;
+	unlock_ctx(ctx);
+	return ret;
 }
 
 /*
- * bootinfo_bootvar_iterate
+ * iterate_vars
  *
  * Iterates through the list of boot variables.
  * Set itercontext to NULL before first call, and
@@ -807,90 +3710,254 @@ bootinfo_extension_sectors (struct devinfo_context *ctx)
  * Zero return code on success, with name and value set to NULL
  * if the end of the list has been passed.
  */
+static int
+iterate_vars (struct devinfo_context *ctx,
+	      void **itercontext,
+	      char **name, char **value)
+{
+	struct info_var *var;
+
+	*name = *value = NULL;
+	if (load_vars(ctx) < 0)
+		return -1;
+	if (*itercontext == NULL)
+		var = ctx->vars;
+	else
+		var = (struct info_var *) *itercontext + 1;
+	while (var < ctx->vars + ctx->varcount && var->value == NULL)
+		var++;
+	*itercontext = var;
+	if (var < ctx->vars + ctx->varcount) {
+		*value = decode_value(ctx, var);
+		if (*value == NULL)
+			return -1;
+		*name = var->name;
+	}
+	return 0;
+
+} /* iterate_vars */
+
+/*
+ * bootinfo_bootvar_iterate
+ *
+ * Public API for iterate_vars.
+ */
 int
 bootinfo_bootvar_iterate (struct devinfo_context *ctx,
 			  void **itercontext,
 			  char **name, char **value)
 {
-	struct info_var *var;
+	int ret;
 
 	if (ctx == NULL || itercontext == NULL || name == NULL || value == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
-	*name = *value = NULL;
-	if (*itercontext == NULL) {
-		var = ctx->vars;
-	} else {
-		var = *itercontext;
-		var = var->next;
-	}
-	*itercontext = var;
-	if (var != NULL) {
-		*name = var->name;
-		*value = var->value;
-	}
-	return 0;
+	lock_ctx(ctx);
+	ret = iterate_vars(ctx, itercontext, name, value);
+	unlock_ctx(ctx);
+	return ret;
 
 } /* bootinfo_bootvar_iterate */
 
 /*
- * bootinfo_bootvar_get
+ * get_var
  *
  * Retrieves a single boot variable by name.
  * The returned value pointer is to a null-terminated
  * printable character string and should be treated
- * as read-only and not freeable.
+ * as read-only and not freeable.  It remains valid
+ * until the next update.
+ */
+static int
+get_var (struct devinfo_context *ctx, const char *name, char **value)
+{
+	struct info_var *var;
+
+	if (load_vars(ctx) < 0)
+		return -1;
+	var = find_var(ctx, name);
+	if (var == NULL || var->value == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	*value = decode_value(ctx, var);
+	return (*value == NULL ? -1 : 0);
+
+} /* get_var */
+
+/*
+ * bootinfo_bootvar_get
+ *
+ * Public API for get_var.
  */
 int
 bootinfo_bootvar_get (struct devinfo_context *ctx,
 		      const char *name, char **value)
 {
-	void *iterctx = 0;
-	char *vname, *vval;
 	int ret;
 
 	if (ctx == NULL || name == NULL || value == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
+	lock_ctx(ctx);
+	ret = get_var(ctx, name, value);
+	unlock_ctx(ctx);
+	return ret;
 
-	for (ret = bootinfo_bootvar_iterate(ctx, &iterctx, &vname, &vval);
-	     ret >= 0 && vname != NULL;
-	     ret = bootinfo_bootvar_iterate(ctx, &iterctx, &vname, &vval)) {
-		if (strcmp(name, vname) == 0) {
-			*value = vval;
-			return 0;
+} /* bootinfo_bootvar_get */
+
+/*
+ * get_many
+ *
+ * Looks up each of count names, setting the corresponding
+ * values[] entry to its value, as for get_var(), or to NULL
+ * if the variable is not set.
+ *
+ * Returns the number of variables found, or -1 on error.
+ */
+static int
+get_many (struct devinfo_context *ctx, const char *const names[],
+	  char *values[], unsigned int count)
+{
+	struct info_var *var;
+	unsigned int i;
+	int found = 0;
+
+	if (load_vars(ctx) < 0)
+		return -1;
+	for (i = 0; i < count; i++) {
+		var = find_var(ctx, names[i]);
+		if (var == NULL || var->value == NULL) {
+			values[i] = NULL;
+			continue;
 		}
+		values[i] = decode_value(ctx, var);
+		if (values[i] == NULL)
+			return -1;
+		found += 1;
 	}
-	errno = ENOENT;
-	return -1;
+	return found;
 
-} /* bootinfo_bootvar_get */
+} /* get_many */
 
 /*
- * bootinfo_bootvar_set
+ * bootinfo_bootvar_get_many
  *
- * Sets or deletes a variable. To delete, either pass NULL as
- * the value pointer, or use a null string as the value.
- * Caller must call bootinfo_update() to finalize the set
- * before freeing the name or value strings.
+ * Public API for get_many.
+ */
+int
+bootinfo_bootvar_get_many (struct devinfo_context *ctx, const char *const names[],
+			   char *values[], unsigned int count)
+{
+	unsigned int i;
+	int ret;
+
+	if (ctx == NULL || (count > 0 && (names == NULL || values == NULL))) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (names[i] == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	lock_ctx(ctx);
+	ret = get_many(ctx, names, values, count);
+	unlock_ctx(ctx);
+	return ret;
+
+} /* bootinfo_bootvar_get_many */
+
+/*
+ * iterate_prefix
+ *
+ * As iterate_vars(), for just the variables whose names
+ * begin with prefix, in name order.  The same restrictions
+ * on calls between iterations apply.
+ */
+static int
+iterate_prefix (struct devinfo_context *ctx, const char *prefix,
+		void **itercontext, char **name, char **value)
+{
+	size_t prefixlen = strlen(prefix);
+	uint32_t *pos, *end;
+	struct info_var *var;
+
+	*name = *value = NULL;
+	if (load_vars(ctx) < 0 || sort_vars(ctx) < 0)
+		return -1;
+	end = ctx->sorted + ctx->varcount;
+	if (*itercontext == NULL)
+		pos = first_with_prefix(ctx, prefix);
+	else
+		pos = (uint32_t *) *itercontext + 1;
+	for (; pos < end; pos++) {
+		var = &ctx->vars[*pos];
+		if (strncmp(var->name, prefix, prefixlen) != 0) {
+			pos = end;
+			break;
+		}
+		/* skip deleted entries, and duplicates that get_var() would not return */
+		if (var->value != NULL && find_var(ctx, var->name) == var)
+			break;
+	}
+	*itercontext = pos;
+	if (pos < end) {
+		*value = decode_value(ctx, var);
+		if (*value == NULL)
+			return -1;
+		*name = var->name;
+	}
+	return 0;
+
+} /* iterate_prefix */
+
+/*
+ * bootinfo_bootvar_iterate_prefix
  *
+ * Public API for iterate_prefix.
  */
 int
-bootinfo_bootvar_set (struct devinfo_context *ctx, const char *name,
-		      const char *value)
+bootinfo_bootvar_iterate_prefix (struct devinfo_context *ctx, const char *prefix,
+				 void **itercontext, char **name, char **value)
 {
-	struct info_var *var, *prev;
+	int ret;
 
-	if (ctx == NULL || name == NULL) {
+	if (ctx == NULL || prefix == NULL || itercontext == NULL ||
+	    name == NULL || value == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
+	lock_ctx(ctx);
+	ret = iterate_prefix(ctx, prefix, itercontext, name, value);
+	unlock_ctx(ctx);
+	return ret;
+
+} /* bootinfo_bootvar_iterate_prefix */
+
+/*
+ * set_var
+ *
+ * Sets or deletes a variable. To delete, either pass NULL as
+ * the value pointer, or use a null string as the value.
+ * Caller must call bootinfo_update() to finalize the set
+ * before freeing the name or value strings.
+ *
+ */
+static int
+set_var (struct devinfo_context *ctx, const char *name, const char *value)
+{
+	struct info_var *var;
+
 	if (ctx->readonly) {
 		errno = EROFS;
 		return -1;
 	}
+	if (load_vars(ctx) < 0)
+		return -1;
 	/*
 	 * Check for a null (0-length) value and just set value to NULL
 	 * to indicate that we want to delete the variable in that
@@ -932,46 +3999,257 @@ bootinfo_bootvar_set (struct devinfo_context *ctx, const char *name,
 		return -1;
 	}
 
+	/*
+	 * A value that may be deflated might still fit when the
+	 * rest do not; pack_vars() has the final say for those.
+	 */
 	if (value != NULL) {
 		size_t vallen = strlen(value);
 		size_t s = strlen(name) + vallen + 2;
 		if (vallen >= MAX_VALUE_SIZE ||
-		    ctx->varsize + s > MAX_VALUE_SIZE) {
+		    (vallen < BOOTINFO_COMPRESS_MIN && ctx->varsize + s > MAX_VALUE_SIZE)) {
 			errno = EMSGSIZE;
 			return -1;
 		}
 	}
 
-	for (var = ctx->vars, prev = NULL;
-	     var != NULL && strcmp(name, var->name) != 0;
-	     prev = var, var = var->next);
+	var = find_var(ctx, name);
 
-	if (var == NULL) {
+	if (var == NULL || var->value == NULL) {
 		if (value == NULL) {
 			errno = ENOENT;
 			return -1;
 		}
-		var = calloc(1, sizeof(struct info_var));
-		if (var == NULL)
+		if (ctx->varcount >= ctx->maxvars &&
+		    alloc_vars(ctx, 2 * ctx->maxvars) < 0)
+			return -1;
+		if (ctx->daemonfd >= 0 && add_pending(ctx, name, value) < 0)
 			return -1;
+		/* Add to end of array */
+		var = &ctx->vars[ctx->varcount];
 		var->name = (char *) name;
 		var->value = (char *) value;
-		/* Add to end of list */
-		if (prev == NULL)
-			ctx->vars = var;
-		else
-			prev->next = var;
-	} else if (value == NULL) {
-		/* Deleting found variable */
-		if (prev == NULL)
-			ctx->vars = var->next;
-		else
-			prev->next = var->next;
-		free(var);
-	} else
+		var->plain = NULL;
+		var->modified = true;
+		index_var(ctx, ctx->varcount);
+		ctx->varcount += 1;
+	} else if (ctx->daemonfd >= 0 && add_pending(ctx, name, value) < 0)
+		return -1;
+	else if (value == NULL) {
+		/* Deleting found variable, see index_var() */
+		var->value = NULL;
+		var->modified = true;
+	} else {
 		/* Changing value of found variable */
 		var->value = (char *) value;
+		var->plain = NULL;
+		var->modified = true;
+	}
 
 	return 0;
 
+} /* set_var */
+
+/*
+ * bootinfo_bootvar_set
+ *
+ * Public API for set_var.
+ */
+int
+bootinfo_bootvar_set (struct devinfo_context *ctx, const char *name,
+		      const char *value)
+{
+	int ret;
+
+	if (ctx == NULL || name == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	lock_ctx(ctx);
+	ret = set_var(ctx, name, value);
+	unlock_ctx(ctx);
+	return ret;
+
 } /* bootinfo_bootvar_set */
+
+/*
+ * copy_string
+ *
+ * Copies a string into the context's string
+ * storage; see alloc_string().
+ */
+static char *
+copy_string (struct devinfo_context *ctx, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *copy = alloc_string(ctx, len);
+
+	if (copy != NULL)
+		memcpy(copy, str, len);
+	return copy;
+
+} /* copy_string */
+
+/*
+ * bootinfo_batch_begin
+ *
+ * Starts a batch of variable sets, which are applied
+ * together with a single update by bootinfo_batch_commit(),
+ * or discarded by bootinfo_batch_abort().
+ */
+int
+bootinfo_batch_begin (struct devinfo_context *ctx)
+{
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ctx->readonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (ctx->in_batch) {
+		errno = EBUSY;
+		return -1;
+	}
+	/* a batch must not overlap a background update */
+	if (bootinfo_flush(ctx) < 0)
+		return -1;
+	if (load_vars(ctx) < 0)
+		return -1;
+	free(ctx->batch_vars);
+	ctx->batch_vars = NULL;
+	if (ctx->varcount > 0) {
+		ctx->batch_vars = malloc(ctx->varcount * sizeof(struct info_var));
+		if (ctx->batch_vars == NULL)
+			return -1;
+		memcpy(ctx->batch_vars, ctx->vars, ctx->varcount * sizeof(struct info_var));
+	}
+	ctx->batch_varcount = ctx->varcount;
+	ctx->batch_varsize = ctx->varsize;
+	ctx->batch_pending_len = ctx->pending_len;
+	ctx->in_batch = true;
+	return 0;
+
+} /* bootinfo_batch_begin */
+
+/*
+ * bootinfo_batch_set
+ *
+ * Sets or deletes a variable as part of a batch, as with
+ * bootinfo_bootvar_set(), except that the name and value
+ * are copied, so the caller may free or reuse them at once.
+ */
+int
+bootinfo_batch_set (struct devinfo_context *ctx, const char *name,
+		    const char *value)
+{
+	char *namecopy, *valuecopy = NULL;
+
+	if (ctx == NULL || name == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!ctx->in_batch) {
+		errno = EINVAL;
+		return -1;
+	}
+	namecopy = copy_string(ctx, name);
+	if (namecopy == NULL)
+		return -1;
+	if (value != NULL && *value != '\0') {
+		valuecopy = copy_string(ctx, value);
+		if (valuecopy == NULL)
+			return -1;
+	}
+	return bootinfo_bootvar_set(ctx, namecopy, valuecopy);
+
+} /* bootinfo_batch_set */
+
+/*
+ * end_batch
+ *
+ * Ends a batch, discarding the state saved when it began.
+ */
+static void
+end_batch (struct devinfo_context *ctx)
+{
+	ctx->in_batch = false;
+	free(ctx->batch_vars);
+	ctx->batch_vars = NULL;
+
+} /* end_batch */
+
+/*
+ * restore_batch
+ *
+ * Puts the variables back the way they were when
+ * the batch began, and ends the batch.
+ */
+static void
+restore_batch (struct devinfo_context *ctx)
+{
+	unsigned int n;
+
+	/*
+	 * The array only grows during the batch, so the saved
+	 * entries always fit; the index has to be rebuilt, though,
+	 * since it may refer to entries added by the batch.
+	 */
+	if (ctx->batch_varcount > 0)
+		memcpy(ctx->vars, ctx->batch_vars, ctx->batch_varcount * sizeof(struct info_var));
+	ctx->varcount = ctx->batch_varcount;
+	ctx->varsize = ctx->batch_varsize;
+	ctx->pending_len = ctx->batch_pending_len;
+	memset(ctx->varindex, 0, ctx->varindex_size * sizeof(uint32_t));
+	for (n = 0; n < ctx->varcount; n++)
+		index_var(ctx, n);
+	end_batch(ctx);
+
+} /* restore_batch */
+
+/*
+ * bootinfo_batch_commit
+ *
+ * Ends a batch, writing all of its changes to
+ * storage with one bootinfo_update().  If the
+ * update fails, none of the changes are kept.
+ */
+int
+bootinfo_batch_commit (struct devinfo_context *ctx)
+{
+	int save_errno;
+
+	if (ctx == NULL || !ctx->in_batch) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* updates are refused during a batch */
+	ctx->in_batch = false;
+	if (bootinfo_update(ctx) < 0) {
+		save_errno = errno;
+		restore_batch(ctx);
+		errno = save_errno;
+		return -1;
+	}
+	end_batch(ctx);
+	return 0;
+
+} /* bootinfo_batch_commit */
+
+/*
+ * bootinfo_batch_abort
+ *
+ * Ends a batch, discarding all of its changes.
+ */
+int
+bootinfo_batch_abort (struct devinfo_context *ctx)
+{
+	if (ctx == NULL || !ctx->in_batch) {
+		errno = EINVAL;
+		return -1;
+	}
+	restore_batch(ctx);
+	return 0;
+
+} /* bootinfo_batch_abort */
@@ -2,6 +2,9 @@
 #define bootinfo_h_included
 /* Copyright (c) 2022, Matthew Madison */
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,11 +14,53 @@ typedef struct devinfo_context bootinfo_ctx_t;
 
 /*
  * Flags for bootinfo_open
+ *
+ * rk-bootinfod holds the store's lock for as long as it
+ * runs, so an open that does not go through it (with
+ * BOOTINFO_O_NO_DAEMON, or when its socket cannot be
+ * reached) fails with EBUSY instead of waiting for the
+ * lock while the daemon is running.
  */
 #define BOOTINFO_O_RDONLY	(1U<<0)
 #define BOOTINFO_O_FORCE_INIT	(1U<<1)
+#define BOOTINFO_O_HEADER_ONLY	(1U<<2)
+#define BOOTINFO_O_NO_DAEMON	(1U<<3)
+
+/*
+ * Storage backend for bootinfo_open_config.  Use
+ * bootinfo_config_init to fill in the built-in defaults,
+ * then change what is needed.  A NULL storage_device
+ * means the default device.  A store other than the
+ * default one needs its own lock_dir, which also holds
+ * the snapshot and the rk-bootinfod socket for it.
+ *
+ * layout_version selects the storage layout written by
+ * updates, converting the store on its next update if it
+ * has the other one; 0 keeps the layout the store has
+ * (the build's default layout for a new store).
+ */
+struct bootinfo_config {
+	const char *storage_device;
+	off_t storage_offset_a;
+	off_t storage_offset_b;
+	const char *lock_dir;
+	unsigned int flags;
+	unsigned int layout_version;
+};
+/*
+ * Flags for bootinfo_config
+ */
+#define BOOTINFO_CFG_NO_FORCE_RO (1U<<0)	/* leave the sysfs force_ro switch alone */
+/*
+ * Layouts for bootinfo_config
+ */
+#define BOOTINFO_LAYOUT_COPIES	7	/* each update rewrites the variables in the other copy */
+#define BOOTINFO_LAYOUT_JOURNAL	8	/* updates append to a journal in the current copy */
 
 int bootinfo_open(bootinfo_ctx_t **ctxp, unsigned int flags);
+void bootinfo_config_init(struct bootinfo_config *config);
+int bootinfo_open_config(bootinfo_ctx_t **ctxp, unsigned int flags,
+			 const struct bootinfo_config *config);
 int bootinfo_mark_successful(bootinfo_ctx_t *ctx, unsigned int *failed_boot_count);
 int bootinfo_mark_in_progress(bootinfo_ctx_t *ctx, unsigned int *failed_boot_count);
 int bootinfo_is_in_progress(bootinfo_ctx_t *ctx);
@@ -24,8 +69,48 @@ int bootinfo_failed_boot_count(bootinfo_ctx_t *ctx);
 int bootinfo_extension_sectors(bootinfo_ctx_t *ctx);
 int bootinfo_bootvar_iterate(bootinfo_ctx_t *ctx, void **iterctx, char **name, char **value);
 int bootinfo_bootvar_get(bootinfo_ctx_t *ctx, const char *name, char **value);
+/*
+ * Looks up count variables at once, setting values[i] to NULL
+ * for each one not set; returns the number found.
+ */
+int bootinfo_bootvar_get_many(bootinfo_ctx_t *ctx, const char *const names[],
+			      char *values[], unsigned int count);
+/*
+ * As bootinfo_bootvar_iterate, for the variables whose
+ * names begin with prefix, in name order.
+ */
+int bootinfo_bootvar_iterate_prefix(bootinfo_ctx_t *ctx, const char *prefix,
+				    void **iterctx, char **name, char **value);
 int bootinfo_bootvar_set(bootinfo_ctx_t *ctx, const char *name, const char *value);
 int bootinfo_update(bootinfo_ctx_t *ctx);
+int bootinfo_update_async(bootinfo_ctx_t *ctx);
+int bootinfo_flush(bootinfo_ctx_t *ctx);
+/*
+ * Batched sets, committed with one update
+ */
+int bootinfo_batch_begin(bootinfo_ctx_t *ctx);
+int bootinfo_batch_set(bootinfo_ctx_t *ctx, const char *name, const char *value);
+int bootinfo_batch_commit(bootinfo_ctx_t *ctx);
+int bootinfo_batch_abort(bootinfo_ctx_t *ctx);
+/*
+ * I/O counters and times (in nanoseconds) for a context,
+ * covering the storage device accesses made by it.  They
+ * stay zero for contexts served by rk-bootinfod or from
+ * the snapshot.
+ */
+struct bootinfo_stats {
+	uint64_t read_calls;		/* read system calls */
+	uint64_t read_bytes;
+	uint64_t read_ns;
+	uint64_t write_calls;		/* write system calls (O_DSYNC) */
+	uint64_t write_bytes;
+	uint64_t write_ns;
+	uint64_t lock_ns;		/* waiting for the lock file */
+	uint64_t force_ro_ns;		/* in the sysfs force_ro switching */
+	uint64_t crc_bytes;
+	uint64_t crc_ns;
+};
+int bootinfo_get_stats(bootinfo_ctx_t *ctx, struct bootinfo_stats *stats);
 void bootinfo_close(bootinfo_ctx_t *ctx);
 
 #ifdef __cplusplus
@@ -0,0 +1,52 @@
+#ifndef bootinfod_h_included
+#define bootinfod_h_included
+/* Copyright (c) 2024, Matthew Madison */
+
+/*
+ * Protocol between librkbootinfo and rk-bootinfod.
+ *
+ * Every message, in either direction, is a struct bootinfod_msg
+ * followed by 'length' bytes of payload; see send_message() and
+ * receive_message() in util.c.  Requests carry one of the opcodes
+ * below in 'code', replies carry 0 for success or an errno value.
+ *
+ * Variable lists are packed as they are in storage: name, NUL,
+ * value, NUL, for each variable.  In a commit request, an empty
+ * value means the variable is to be deleted.
+ */
+#include <stdint.h>
+
+#define BOOTINFO_LOCK_DIR "/run/rk-bootinfo"
+#define BOOTINFOD_SOCKET_NAME "bootinfod.sock"
+#define BOOTINFOD_SOCKET BOOTINFO_LOCK_DIR "/" BOOTINFOD_SOCKET_NAME
+#define BOOTINFOD_MAX_MESSAGE (8 * 1024 * 1024)
+
+struct bootinfod_msg {
+	uint32_t code;
+	uint32_t length;
+};
+
+enum {
+	BOOTINFOD_OPEN = 1,		/* payload: uint32 open flags; reply: state + variables */
+	BOOTINFOD_GET_VARS,		/* reply: variables */
+	BOOTINFOD_COMMIT,		/* payload: variables set; reply: state */
+	BOOTINFOD_MARK_SUCCESSFUL,	/* reply: state */
+	BOOTINFOD_MARK_IN_PROGRESS,	/* reply: state */
+	BOOTINFOD_INIT,			/* reply: state + variables */
+};
+
+/*
+ * Boot info header state, at the start of the
+ * reply payload for the requests noted above.  For
+ * the mark requests, failed_boot_count is what the
+ * corresponding bootinfo_mark_xxx() call passed back.
+ */
+struct bootinfod_state {
+	int32_t devinfo_version;
+	int32_t in_progress;
+	int32_t failed_boots;
+	int32_t ext_sectors;
+	uint32_t failed_boot_count;
+};
+
+#endif /* bootinfod_h_included */
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * checksum.c
+ *
+ * CRC-32 computation, compatible with zlib's crc32().
+ *
+ * The backend is chosen at build time:
+ *   CHECKSUM_BACKEND_ZLIB   always use zlib
+ *   CHECKSUM_BACKEND_ARMV8  always use the ARMv8 CRC32 instructions
+ *   (neither)               use the ARMv8 instructions if the CPU
+ *                           has them, and zlib otherwise
+ *
+ * Copyright (c) 2024, Matthew Madison
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include "checksum.h"
+
+#if defined(CHECKSUM_BACKEND_ZLIB) && defined(CHECKSUM_BACKEND_ARMV8)
+#error "select only one checksum backend"
+#endif
+
+#if defined(__aarch64__) && !defined(CHECKSUM_BACKEND_ZLIB)
+#define HAVE_ARMV8_CRC32 1
+#include <arm_acle.h>
+#ifndef CHECKSUM_BACKEND_ARMV8
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#if defined(__clang__)
+#define CRC_TARGET __attribute__((target("crc")))
+#else
+#define CRC_TARGET __attribute__((target("+crc")))
+#endif
+#elif defined(CHECKSUM_BACKEND_ARMV8)
+#error "ARMv8 checksum backend requires an aarch64 target"
+#endif
+
+typedef uint32_t (*crc_routine_t)(uint32_t crc, const void *buf, size_t len);
+
+/*
+ * crc32_zlib
+ */
+static uint32_t
+crc32_zlib (uint32_t crc, const void *buf, size_t len)
+{
+	return crc32(crc, buf, len);
+
+} /* crc32_zlib */
+
+#ifdef HAVE_ARMV8_CRC32
+/*
+ * crc32_armv8
+ *
+ * CRC-32 using the ARMv8 CRC32 instructions, which implement
+ * the same polynomial as zlib, on the bit-inverted CRC.
+ */
+static CRC_TARGET uint32_t
+crc32_armv8 (uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t v;
+
+	crc = ~crc;
+	for (; len > 0 && ((uintptr_t) p & 7) != 0; p++, len--)
+		crc = __crc32b(crc, *p);
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32d(crc, v);
+	}
+	for (; len > 0; p++, len--)
+		crc = __crc32b(crc, *p);
+	return ~crc;
+
+} /* crc32_armv8 */
+#endif /* HAVE_ARMV8_CRC32 */
+
+/*
+ * crc_routine
+ *
+ * Returns the routine for the configured backend, checking
+ * the CPU capabilities on the first call if needed.
+ */
+static crc_routine_t
+crc_routine (void)
+{
+#if defined(CHECKSUM_BACKEND_ARMV8)
+	return crc32_armv8;
+#elif defined(HAVE_ARMV8_CRC32)
+	static crc_routine_t routine;
+	crc_routine_t r = __atomic_load_n(&routine, __ATOMIC_RELAXED);
+
+	if (r == NULL) {
+		r = ((getauxval(AT_HWCAP) & HWCAP_CRC32) != 0 ? crc32_armv8 : crc32_zlib);
+		__atomic_store_n(&routine, r, __ATOMIC_RELAXED);
+	}
+	return r;
+#else
+	return crc32_zlib;
+#endif
+
+} /* crc_routine */
+
+/*
+ * checksum_crc32
+ *
+ * Updates a CRC-32 with the contents of a buffer; the
+ * result is the same as from zlib's crc32().
+ */
+uint32_t
+checksum_crc32 (uint32_t crc, const void *buf, size_t len)
+{
+	return crc_routine()(crc, buf, len);
+
+} /* checksum_crc32 */
+
+/*
+ * checksum_backend
+ *
+ * Returns the name of the backend in use.
+ */
+const char *
+checksum_backend (void)
+{
+#ifdef HAVE_ARMV8_CRC32
+	if (crc_routine() == crc32_armv8)
+		return "armv8";
+#endif
+	return "zlib";
+
+} /* checksum_backend */
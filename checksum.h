@@ -0,0 +1,11 @@
+#ifndef checksum_h_included
+#define checksum_h_included
+/* Copyright (c) 2024, Matthew Madison */
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t checksum_crc32(uint32_t crc, const void *buf, size_t len);
+const char *checksum_backend(void);
+
+#endif /* checksum_h_included */
@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * crc-bench.c
+ *
+ * Micro-benchmark comparing the librkbootinfo checksum
+ * backend against zlib's crc32(), for the transfer sizes
+ * used in the boot info store.
+ *
+ * Copyright (c) 2024, Matthew Madison
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <zlib.h>
+#include "checksum.h"
+
+#define BUFFER_SIZE (512 * 1024)
+#define MIN_BYTES (256UL * 1024 * 1024)
+
+static const size_t sizes[] = { 32, 512, 8192, 512 * 1024 };
+
+/*
+ * elapsed
+ */
+static double
+elapsed (const struct timespec *start, const struct timespec *end)
+{
+	return (double) (end->tv_sec - start->tv_sec) +
+		(double) (end->tv_nsec - start->tv_nsec) / 1e9;
+
+} /* elapsed */
+
+/*
+ * main program
+ */
+int
+main (int argc, char * const argv[])
+{
+	struct timespec start, end;
+	unsigned long iter, count;
+	unsigned int i;
+	uint8_t *buf;
+	uint32_t crc_zlib, crc_backend;
+	double t_zlib, t_backend, mbytes;
+	int ret = 0;
+
+	buf = malloc(BUFFER_SIZE);
+	if (buf == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < BUFFER_SIZE; i++)
+		buf[i] = (uint8_t) rand();
+
+	printf("checksum backend: %s\n", checksum_backend());
+	printf("%10s %12s %12s %8s\n", "size", "zlib MB/s", "backend MB/s", "speedup");
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		count = MIN_BYTES / sizes[i];
+		/*
+		 * Unaligned start, to cover the head and tail handling.
+		 */
+		crc_zlib = crc32(0, buf + 1, sizes[i] - 1);
+		crc_backend = checksum_crc32(0, buf + 1, sizes[i] - 1);
+		if (crc_zlib != crc_backend) {
+			fprintf(stderr, "CRC mismatch at size %zu: zlib %08x, backend %08x\n",
+				sizes[i] - 1, (unsigned int) crc_zlib, (unsigned int) crc_backend);
+			ret = 1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (iter = 0, crc_zlib = 0; iter < count; iter++)
+			crc_zlib = crc32(crc_zlib, buf, sizes[i]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t_zlib = elapsed(&start, &end);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (iter = 0, crc_backend = 0; iter < count; iter++)
+			crc_backend = checksum_crc32(crc_backend, buf, sizes[i]);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		t_backend = elapsed(&start, &end);
+		if (crc_zlib != crc_backend) {
+			fprintf(stderr, "CRC mismatch at size %zu\n", sizes[i]);
+			ret = 1;
+		}
+		mbytes = (double) count * (double) sizes[i] / 1e6;
+		printf("%10zu %12.1f %12.1f %7.2fx\n", sizes[i],
+		       mbytes / t_zlib, mbytes / t_backend, t_zlib / t_backend);
+	}
+	free(buf);
+	return ret;
+
+} /* main */
@@ -29,14 +29,19 @@
 #define _GNU_SOURCE 1
 #endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <stdbool.h>
 #include "bootinfo.h"
 
 #define MAX_BOOT_FAILURES 3
 
 static char *progname;
+static bool show_stats;
+static struct bootinfo_config config;
 
 static struct option options[] = {
 	{ "boot-success",	no_argument,		0, 'b' },
@@ -47,12 +52,17 @@ static struct option options[] = {
 	{ "from-file",		required_argument,	0, 'f' },
 	{ "force-initialize",	no_argument,		0, 'F' },
 	{ "get-variable",	no_argument,		0, 'v' },
+	{ "prefix",		required_argument,	0, 'p' },
 	{ "set-variable",	no_argument,		0, 'V' },
+	{ "set",		no_argument,		0, 'S' },
+	{ "set-from-file",	required_argument,	0, 'M' },
+	{ "stats",		no_argument,		0, 0   },
+	{ "layout",		required_argument,	0, 0   },
 	{ "help",		no_argument,		0, 'h' },
 	{ "version",		no_argument,		0, 0   },
 	{ 0,			0,			0, 0   }
 };
-static const char *shortopts = ":bcIsnf:FvVh";
+static const char *shortopts = ":bcIsnf:Fvp:VSM:h";
 
 static char *optarghelp[] = {
 	"--boot-success	      ",
@@ -63,7 +73,12 @@ static char *optarghelp[] = {
 	"--from-file FILE     ",
 	"--force-initialize   ",
 	"--get-variable	      ",
+	"--prefix PREFIX      ",
 	"--set-variable	      ",
+	"--set		      ",
+	"--set-from-file FILE ",
+	"--stats	      ",
+	"--layout LAYOUT      ",
 	"--help		      ",
 	"--version	      ",
 };
@@ -76,8 +91,13 @@ static char *opthelp[] = {
 	"omit variable name in output (for use with --get-variable)",
 	"take variable value from FILE (for use with --set-variable)",
 	"force initialization even if bootinfo already initialized (for use with --initialize)",
-	"get the value of a stored variable by name, list all if no name specified",
+	"get the values of stored variables by name, list all if no name specified",
+	"get the variables whose names begin with PREFIX (implies --get-variable)",
 	"set the value of a stored variable (delete if no value)",
+	"set multiple variables, given as name=value arguments, in one update",
+	"set the variables listed in FILE (name=value per line) in one update",
+	"print storage I/O statistics to stderr when done",
+	"write the store with LAYOUT (copies or journal) from now on",
 	"display this help text",
 	"display version information"
 };
@@ -102,16 +122,44 @@ print_usage (void)
 
 } /* print_usage */
 
+/*
+ * close_ctx
+ *
+ * Closes a context, printing its I/O statistics
+ * first if --stats was given.
+ */
+static void
+close_ctx (bootinfo_ctx_t *ctx)
+{
+	struct bootinfo_stats st;
+
+	if (show_stats && bootinfo_get_stats(ctx, &st) == 0)
+		fprintf(stderr,
+			"reads:    %llu calls, %llu bytes, %.3f ms\n"
+			"writes:   %llu calls, %llu bytes, %.3f ms\n"
+			"locking:  %.3f ms\n"
+			"force_ro: %.3f ms\n"
+			"CRC:      %llu bytes, %.3f ms\n",
+			(unsigned long long) st.read_calls, (unsigned long long) st.read_bytes,
+			st.read_ns / 1e6,
+			(unsigned long long) st.write_calls, (unsigned long long) st.write_bytes,
+			st.write_ns / 1e6,
+			st.lock_ns / 1e6, st.force_ro_ns / 1e6,
+			(unsigned long long) st.crc_bytes, st.crc_ns / 1e6);
+	bootinfo_close(ctx);
+
+} /* close_ctx */
+
 static int
 boot_devinfo_init(int force_init)
 {
 	bootinfo_ctx_t *ctx;
 
-	if (bootinfo_open(&ctx, force_init ? BOOTINFO_O_FORCE_INIT : 0) < 0) {
+	if (bootinfo_open_config(&ctx, force_init ? BOOTINFO_O_FORCE_INIT : 0, &config) < 0) {
 		perror("bootinfo_open");
 		return 1;
 	}
-	bootinfo_close(ctx);
+	close_ctx(ctx);
 	return 0;
 
 } /* boot_devinfo_init */
@@ -122,16 +170,16 @@ boot_successful(void)
 	bootinfo_ctx_t *ctx;
 	unsigned int failed_boots;
 
-	if (bootinfo_open(&ctx, 0) < 0) {
+	if (bootinfo_open_config(&ctx, BOOTINFO_O_HEADER_ONLY, &config) < 0) {
 		perror("bootinfo_open");
 		return 1;
 	}
 	if (bootinfo_mark_successful(ctx, &failed_boots) < 0) {
 		perror("bootinfo_mark_successful");
-		bootinfo_close(ctx);
+		close_ctx(ctx);
 		return 1;
 	}
-	bootinfo_close(ctx);
+	close_ctx(ctx);
 	fprintf(stderr, "Failed boot count: %u\n", failed_boots);
 	return 0;
 
@@ -144,7 +192,7 @@ boot_check_status(void)
 	unsigned int failed_boots;
 	int rc = 0;
 
-	if (bootinfo_open(&ctx, 0) < 0) {
+	if (bootinfo_open_config(&ctx, BOOTINFO_O_HEADER_ONLY, &config) < 0) {
 		perror("bootinfo_open");
 		return 1;
 	}
@@ -157,7 +205,7 @@ boot_check_status(void)
 		/* clear the boot-in-progress status for the next check after the slot switch */
 		bootinfo_mark_successful(ctx, NULL);
 	}
-	bootinfo_close(ctx);
+	close_ctx(ctx);
 	return rc;
 
 } /* boot_check_status */
@@ -173,7 +221,7 @@ show_bootinfo(void) {
 	bootinfo_ctx_t *ctx;
 	int sectors;
 
-	if (bootinfo_open(&ctx, BOOTINFO_O_RDONLY) < 0) {
+	if (bootinfo_open_config(&ctx, BOOTINFO_O_RDONLY|BOOTINFO_O_HEADER_ONLY, &config) < 0) {
 		perror("bootinfo_open");
 		return 1;
 	}
@@ -186,51 +234,87 @@ show_bootinfo(void) {
 	       bootinfo_is_in_progress(ctx) ? "YES" : "NO",
 	       bootinfo_failed_boot_count(ctx),
 	       sectors, (sectors == 1 ? "" : "s"));
-	bootinfo_close(ctx);
+	close_ctx(ctx);
 	return 0;
 
 } /* show_bootinfo */
 
 /*
- * show_bootvar
+ * print_bootvar
+ */
+static void
+print_bootvar (const char *name, const char *value, int omitname)
+{
+	if (omitname)
+		printf("%s\n", value);
+	else
+		printf("%s=%s\n", name, value);
+
+} /* print_bootvar */
+
+/*
+ * show_bootvars
  *
- * Prints out the value of a variable, or
- * all var=value settings if varname == NULL
+ * Prints out the variables whose names begin with prefix
+ * (if not NULL), in name order, followed by the values of
+ * the count variables named, all from one open of the store.
+ * With neither, prints all var=value settings.
  */
 int
-show_bootvar (const char *name, int omitname)
+show_bootvars (char * const names[], int count, const char *prefix, int omitname)
 {
 	bootinfo_ctx_t *ctx;
-	void *iterctx = 0;
-	char *vname, *value;
-	int ret;
-	int found = (name == NULL) ? 1 : 0;
-
-	if (bootinfo_open(&ctx, BOOTINFO_O_RDONLY) < 0) {
+	void *iterctx = NULL;
+	char *vname, *value, **values = NULL;
+	int i, ret, rc = 0;
+
+	if (count > 0) {
+		values = calloc(count, sizeof(char *));
+		if (values == NULL) {
+			perror("show_bootvars");
+			return 1;
+		}
+	}
+	if (bootinfo_open_config(&ctx, BOOTINFO_O_RDONLY, &config) < 0) {
 		perror("bootinfo_open");
+		free(values);
 		return 1;
 	}
-	for (ret = bootinfo_bootvar_iterate(ctx, &iterctx, &vname, &value);
-	     ret >= 0 && vname != NULL;
-	     ret = bootinfo_bootvar_iterate(ctx, &iterctx, &vname, &value)) {
-		if (name == NULL || strcmp(name, vname) == 0) {
-			found = 1;
-			if (omitname)
-				printf("%s\n", value);
-			else
-				printf("%s=%s\n", vname, value);
-			if (name != NULL)
-				break;
+	if (count == 0 && prefix == NULL) {
+		for (ret = bootinfo_bootvar_iterate(ctx, &iterctx, &vname, &value);
+		     ret >= 0 && vname != NULL;
+		     ret = bootinfo_bootvar_iterate(ctx, &iterctx, &vname, &value))
+			print_bootvar(vname, value, 0);
+	}
+	if (prefix != NULL) {
+		for (ret = bootinfo_bootvar_iterate_prefix(ctx, prefix, &iterctx, &vname, &value);
+		     ret >= 0 && vname != NULL;
+		     ret = bootinfo_bootvar_iterate_prefix(ctx, prefix, &iterctx, &vname, &value))
+			print_bootvar(vname, value, omitname);
+		if (ret < 0) {
+			perror("bootinfo_bootvar_iterate_prefix");
+			rc = 1;
 		}
 	}
-	bootinfo_close(ctx);
-	if (!found) {
-		fprintf(stderr, "not found: %s\n", name);
-		return 1;
+	if (count > 0) {
+		if (bootinfo_bootvar_get_many(ctx, (const char *const *) names, values, count) < 0) {
+			perror("bootinfo_bootvar_get_many");
+			rc = 1;
+		} else {
+			for (i = 0; i < count; i++) {
+				if (values[i] == NULL) {
+					fprintf(stderr, "not found: %s\n", names[i]);
+					rc = 1;
+				} else
+					print_bootvar(names[i], values[i], omitname);
+			}
+		}
 	}
-	return 0;
+	close_ctx(ctx);
+	free(values);
+	return rc;
 
-} /* show_bootvar */
+} /* show_bootvars */
 
 /*
  * set_bootvar
@@ -304,7 +388,7 @@ set_bootvar (const char *name, const char *value, char *inputfile)
 			value = cp + 1;
 		}
 	}
-	if (bootinfo_open(&ctx, 0) < 0) {
+	if (bootinfo_open_config(&ctx, 0, &config) < 0) {
 		perror("bootinfo_open");
 		return 1;
 	}
@@ -316,11 +400,116 @@ set_bootvar (const char *name, const char *value, char *inputfile)
 		perror("bootinfo_update");
 		ret = 1;
 	}
-	bootinfo_close(ctx);
+	close_ctx(ctx);
 	return ret;
 
 } /* set_bootvar */
 
+/*
+ * split_setting
+ *
+ * Splits a 'name=value' setting in place, with
+ * 'name=' meaning the variable is to be deleted.
+ */
+static int
+split_setting (char *setting, char **value)
+{
+	char *cp = strchr(setting, '=');
+
+	if (cp == NULL || cp == setting) {
+		fprintf(stderr, "invalid setting: %s\n", setting);
+		return -1;
+	}
+	*cp = '\0';
+	*value = cp + 1;
+	return 0;
+
+} /* split_setting */
+
+/*
+ * set_bootvars
+ *
+ * Sets or deletes multiple variables, from name=value
+ * arguments and/or a manifest file, with a single update.
+ * Nothing is written if any of the settings fails.
+ *
+ * Manifest lines are name=value; blank lines and
+ * lines starting with '#' are ignored.
+ */
+int
+set_bootvars (char * const settings[], int count, const char *manifest)
+{
+	bootinfo_ctx_t *ctx;
+	FILE *fp = NULL;
+	char *line = NULL, *value;
+	size_t linesize = 0;
+	ssize_t len;
+	int i, lineno, ret = 1;
+
+	if (manifest != NULL) {
+		if (strcmp(manifest, "-") == 0)
+			fp = stdin;
+		else {
+			fp = fopen(manifest, "r");
+			if (fp == NULL) {
+				perror(manifest);
+				return 1;
+			}
+		}
+	}
+	if (bootinfo_open_config(&ctx, 0, &config) < 0) {
+		perror("bootinfo_open");
+		goto depart;
+	}
+	if (bootinfo_batch_begin(ctx) < 0) {
+		perror("bootinfo_batch_begin");
+		close_ctx(ctx);
+		goto depart;
+	}
+	for (i = 0; i < count; i++) {
+		if (split_setting(settings[i], &value) < 0)
+			goto abort_batch;
+		if (bootinfo_batch_set(ctx, settings[i], value) < 0) {
+			perror(settings[i]);
+			goto abort_batch;
+		}
+	}
+	for (lineno = 1; fp != NULL && (len = getline(&line, &linesize, fp)) >= 0; lineno++) {
+		if (len > 0 && line[len-1] == '\n')
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		if (split_setting(line, &value) < 0) {
+			fprintf(stderr, "%s: line %d\n", manifest, lineno);
+			goto abort_batch;
+		}
+		if (bootinfo_batch_set(ctx, line, value) < 0) {
+			fprintf(stderr, "%s: line %d: %s: %s\n", manifest, lineno, line, strerror(errno));
+			goto abort_batch;
+		}
+	}
+	if (fp != NULL && ferror(fp)) {
+		fprintf(stderr, "error reading %s\n", manifest);
+		goto abort_batch;
+	}
+	if (bootinfo_batch_commit(ctx) < 0)
+		perror("bootinfo_update");
+	else
+		ret = 0;
+	close_ctx(ctx);
+	goto depart;
+
+  abort_batch:
+	bootinfo_batch_abort(ctx);
+	close_ctx(ctx);
+  depart:
+	free(line);
+	if (fp != NULL && fp != stdin)
+		fclose(fp);
+	return ret;
+
+} /* set_bootvars */
+
 /*
  * main program
  */
@@ -332,6 +521,8 @@ main (int argc, char * const argv[])
 	int omitname = 0;
 	int force_init = 0;
 	char *inputfile = NULL;
+	char *manifest = NULL;
+	char *prefix = NULL;
 	char *argv0_copy = strdup(argv[0]);
 	enum {
 		nocmd,
@@ -340,6 +531,7 @@ main (int argc, char * const argv[])
 		show,
 		showvar,
 		setvar,
+		setvars,
 		init,
 	} cmd = nocmd;
 
@@ -349,6 +541,7 @@ main (int argc, char * const argv[])
 	}
 
 	progname = basename(argv0_copy);
+	bootinfo_config_init(&config);
 
 	while ((c = getopt_long_only(argc, argv, shortopts, options, &which)) != -1) {
 
@@ -377,20 +570,45 @@ main (int argc, char * const argv[])
 		case 'F':
 			force_init = 1;
 			break;
+		case 'p':
+			prefix = strdup(optarg);
+			break;
+		case 'M':
+			manifest = strdup(optarg);
+			/* fallthrough */
+		case 'S':
+			if (cmd == setvars)
+				break;
+			/* fallthrough */
 		case 'v':
 		case 'V':
 			if (cmd != nocmd) {
-				fprintf(stderr, "Error: only one of -v/-V permitted\n");
+				fprintf(stderr, "Error: only one of -v/-V/-S permitted\n");
 				print_usage();
 				return 1;
 			}
-			cmd = (c == 'v' ? showvar : setvar);
+			cmd = (c == 'v' ? showvar : (c == 'V' ? setvar : setvars));
 			break;
 		case 0:
 			if (strcmp(options[which].name, "version") == 0) {
 				printf("%s\n", VERSION);
 				return 0;
 			}
+			if (strcmp(options[which].name, "stats") == 0) {
+				show_stats = true;
+				break;
+			}
+			if (strcmp(options[which].name, "layout") == 0) {
+				if (strcmp(optarg, "copies") == 0)
+					config.layout_version = BOOTINFO_LAYOUT_COPIES;
+				else if (strcmp(optarg, "journal") == 0)
+					config.layout_version = BOOTINFO_LAYOUT_JOURNAL;
+				else {
+					fprintf(stderr, "Error: unrecognized layout: %s\n", optarg);
+					return 1;
+				}
+				break;
+			}
 			/* fallthrough */
 		default:
 			fprintf(stderr, "Error: unrecognized option\n");
@@ -400,6 +618,16 @@ main (int argc, char * const argv[])
 
 	} /* while getopt */
 
+	if (prefix != NULL) {
+		if (cmd == nocmd)
+			cmd = showvar;
+		else if (cmd != showvar) {
+			fprintf(stderr, "Error: --prefix is only for use with --get-variable\n");
+			print_usage();
+			return 1;
+		}
+	}
+
 	switch (cmd) {
 	case success:
 		return boot_successful();
@@ -410,9 +638,7 @@ main (int argc, char * const argv[])
 	case init:
 		return boot_devinfo_init(force_init);
 	case showvar:
-		if (optind >= argc)
-			return show_bootvar(NULL, 0);
-		return show_bootvar(argv[optind], omitname);
+		return show_bootvars(argv + optind, argc - optind, prefix, omitname);
 	case setvar:
 		if (optind >= argc) {
 			fprintf(stderr, "Error: missing variable name\n");
@@ -420,6 +646,13 @@ main (int argc, char * const argv[])
 			return 1;
 		}
 		return set_bootvar(argv[optind], (optind < argc - 1 ? argv[optind+1] : NULL), inputfile);
+	case setvars:
+		if (optind >= argc && manifest == NULL) {
+			fprintf(stderr, "Error: missing variable settings\n");
+			print_usage();
+			return 1;
+		}
+		return set_bootvars(argv + optind, argc - optind, manifest);
 	default:
 		break;
 	}
@@ -0,0 +1,498 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * rk-bootinfod.c
+ *
+ * Daemon that keeps the boot variable store open and serves
+ * requests from librkbootinfo over a Unix socket, so that
+ * clients do not each have to lock, read, and verify the
+ * storage.  Variable updates that arrive together are
+ * grouped into a single write to storage.
+ *
+ * The protocol is described in bootinfod.h.  Clients that
+ * are not running as root may only read.
+ *
+ * Copyright (c) 2024, Matthew Madison
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "bootinfo.h"
+#include "bootinfod.h"
+#include "util.h"
+
+#define MAX_CLIENTS 64
+#define CLIENT_TIMEOUT_SEC 2
+
+static char *progname;
+static bootinfo_ctx_t *ctx;
+static volatile sig_atomic_t stop_requested;
+
+static struct option options[] = {
+	{ "help",		no_argument,		0, 'h' },
+	{ "version",		no_argument,		0, 0   },
+	{ 0,			0,			0, 0   }
+};
+static const char *shortopts = ":h";
+
+static char *optarghelp[] = {
+	"--help               ",
+	"--version            ",
+};
+
+static char *opthelp[] = {
+	"display this help text",
+	"display version information"
+};
+
+struct client {
+	int fd;
+	uid_t uid;
+	/* commit request waiting for the next grouped update */
+	char *commit;
+	size_t commit_len;
+	bool commit_pending;
+};
+
+static struct client clients[MAX_CLIENTS];
+static unsigned int client_count;
+
+/*
+ * print_usage
+ */
+static void
+print_usage (void)
+{
+	int i;
+	printf("\nUsage:\n");
+	printf("\t%s\n", progname);
+	printf("Options:\n");
+	for (i = 0; i < sizeof(options)/sizeof(options[0]) && options[i].name != 0; i++) {
+		printf(" %s\t%c%c\t%s\n",
+		       optarghelp[i],
+		       (options[i].val == 0 ? ' ' : '-'),
+		       (options[i].val == 0 ? ' ' : options[i].val),
+		       opthelp[i]);
+	}
+
+} /* print_usage */
+
+static void
+handle_signal (int signo)
+{
+	stop_requested = 1;
+}
+
+/*
+ * build_reply
+ *
+ * Builds a reply payload with the current header state,
+ * followed by the packed variables if with_vars is true.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+build_reply (bool with_state, bool with_vars, unsigned int failed_boot_count,
+	     char **bufp, size_t *lenp)
+{
+	struct bootinfod_state state;
+	void *iterctx = NULL;
+	char *name, *value, *buf, *newbuf;
+	size_t len = 0, size = 4096, nlen, vlen;
+
+	buf = malloc(size);
+	if (buf == NULL)
+		return -1;
+	if (with_state) {
+		state.devinfo_version = bootinfo_devinfo_version(ctx);
+		state.in_progress = bootinfo_is_in_progress(ctx);
+		state.failed_boots = bootinfo_failed_boot_count(ctx);
+		state.ext_sectors = bootinfo_extension_sectors(ctx);
+		state.failed_boot_count = failed_boot_count;
+		memcpy(buf, &state, sizeof(state));
+		len = sizeof(state);
+	}
+	while (with_vars) {
+		if (bootinfo_bootvar_iterate(ctx, &iterctx, &name, &value) < 0) {
+			free(buf);
+			return -1;
+		}
+		if (name == NULL)
+			break;
+		nlen = strlen(name) + 1;
+		vlen = strlen(value) + 1;
+		if (len + nlen + vlen > size) {
+			while (len + nlen + vlen > size)
+				size *= 2;
+			newbuf = realloc(buf, size);
+			if (newbuf == NULL) {
+				free(buf);
+				return -1;
+			}
+			buf = newbuf;
+		}
+		memcpy(buf + len, name, nlen);
+		memcpy(buf + len + nlen, value, vlen);
+		len += nlen + vlen;
+	}
+	*bufp = buf;
+	*lenp = len;
+	return 0;
+
+} /* build_reply */
+
+/*
+ * send_reply
+ *
+ * Sends a success reply built by build_reply(), or
+ * an error reply if that fails or status is non-zero.
+ */
+static int
+send_reply (struct client *cl, int status, bool with_state, bool with_vars,
+	    unsigned int failed_boot_count)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	int ret;
+
+	if (status == 0 && build_reply(with_state, with_vars, failed_boot_count, &buf, &len) < 0)
+		status = errno;
+	ret = send_message(cl->fd, status, buf, (status == 0 ? len : 0));
+	free(buf);
+	return ret;
+
+} /* send_reply */
+
+/*
+ * apply_commit
+ *
+ * Applies the sets in a commit request to the current batch.
+ * Deleting a variable that is already gone is not an error,
+ * since another client may have deleted it in the meantime.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+apply_commit (const char *buf, size_t len)
+{
+	const char *cp, *value, *endp = buf + len;
+
+	for (cp = buf; cp < endp; cp = value + strlen(value) + 1) {
+		value = cp + strlen(cp) + 1;
+		if (value >= endp) {
+			errno = EPROTO;
+			return -1;
+		}
+		if (bootinfo_batch_set(ctx, cp, value) < 0 &&
+		    !(errno == ENOENT && *value == '\0'))
+			return -1;
+	}
+	return 0;
+
+} /* apply_commit */
+
+/*
+ * process_commits
+ *
+ * Applies all the waiting commit requests with a single
+ * update to storage, then replies to the clients.  If any
+ * of the requests cannot be applied, each is retried on
+ * its own so that one bad request does not fail the others.
+ * A batch whose update fails is rolled back, so the sets
+ * of clients told that their commit failed are neither
+ * visible to other clients nor written by a later update.
+ */
+static void
+process_commits (void)
+{
+	unsigned int i, count;
+	int status = 0;
+	bool grouped = true;
+
+	for (i = count = 0; i < client_count; i++)
+		if (clients[i].commit_pending)
+			count += 1;
+	if (count == 0)
+		return;
+	if (bootinfo_batch_begin(ctx) < 0)
+		status = errno;
+	for (i = 0; status == 0 && i < client_count; i++) {
+		if (clients[i].commit_pending &&
+		    apply_commit(clients[i].commit, clients[i].commit_len) < 0) {
+			bootinfo_batch_abort(ctx);
+			grouped = false;
+			break;
+		}
+	}
+	if (status == 0 && grouped && bootinfo_batch_commit(ctx) < 0)
+		status = errno;
+
+	for (i = 0; i < client_count; i++) {
+		if (!clients[i].commit_pending)
+			continue;
+		if (!grouped) {
+			status = 0;
+			if (bootinfo_batch_begin(ctx) < 0)
+				status = errno;
+			else if (apply_commit(clients[i].commit, clients[i].commit_len) < 0) {
+				status = errno;
+				bootinfo_batch_abort(ctx);
+			} else if (bootinfo_batch_commit(ctx) < 0)
+				status = errno;
+		}
+		send_reply(&clients[i], status, true, false, 0);
+		free(clients[i].commit);
+		clients[i].commit = NULL;
+		clients[i].commit_pending = false;
+	}
+
+} /* process_commits */
+
+/*
+ * reinitialize
+ *
+ * Re-initializes the variable store, as for bootinfo_open()
+ * with BOOTINFO_O_FORCE_INIT.
+ *
+ * Returns: 0 on success, otherwise an errno value
+ */
+static int
+reinitialize (void)
+{
+	int status = 0;
+
+	bootinfo_close(ctx);
+	if (bootinfo_open(&ctx, BOOTINFO_O_FORCE_INIT|BOOTINFO_O_NO_DAEMON) < 0)
+		status = errno;
+	if (ctx == NULL && bootinfo_open(&ctx, BOOTINFO_O_NO_DAEMON) < 0) {
+		perror("bootinfo_open");
+		exit(1);
+	}
+	return status;
+
+} /* reinitialize */
+
+/*
+ * handle_request
+ *
+ * Reads and handles one request from a client.  Commit requests
+ * are held until process_commits() is called.
+ *
+ * Returns: 0 on success, -1 if the client should be dropped
+ */
+static int
+handle_request (struct client *cl)
+{
+	uint32_t code, openflags;
+	void *payload;
+	size_t len;
+	unsigned int failed_boots = 0;
+	int status = 0;
+
+	if (receive_message(cl->fd, &code, &payload, &len) < 0)
+		return -1;
+	if (cl->uid != 0 &&
+	    (code == BOOTINFOD_COMMIT || code == BOOTINFOD_MARK_SUCCESSFUL ||
+	     code == BOOTINFOD_MARK_IN_PROGRESS || code == BOOTINFOD_INIT)) {
+		free(payload);
+		return send_message(cl->fd, EPERM, NULL, 0);
+	}
+	switch (code) {
+	case BOOTINFOD_OPEN:
+		openflags = 0;
+		if (len >= sizeof(openflags))
+			memcpy(&openflags, payload, sizeof(openflags));
+		free(payload);
+		return send_reply(cl, 0, true, (openflags & BOOTINFO_O_HEADER_ONLY) == 0, 0);
+	case BOOTINFOD_GET_VARS:
+		free(payload);
+		return send_reply(cl, 0, false, true, 0);
+	case BOOTINFOD_COMMIT:
+		cl->commit = payload;
+		cl->commit_len = len;
+		cl->commit_pending = true;
+		return 0;
+	case BOOTINFOD_MARK_SUCCESSFUL:
+		if (bootinfo_mark_successful(ctx, &failed_boots) < 0)
+			status = errno;
+		break;
+	case BOOTINFOD_MARK_IN_PROGRESS:
+		if (bootinfo_mark_in_progress(ctx, &failed_boots) < 0)
+			status = errno;
+		break;
+	case BOOTINFOD_INIT:
+		status = reinitialize();
+		free(payload);
+		return send_reply(cl, status, true, true, 0);
+	default:
+		status = EINVAL;
+		break;
+	}
+	free(payload);
+	return send_reply(cl, status, true, false, failed_boots);
+
+} /* handle_request */
+
+/*
+ * accept_client
+ */
+static void
+accept_client (int listenfd)
+{
+	struct timeval tv = { .tv_sec = CLIENT_TIMEOUT_SEC };
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	int fd;
+
+	fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (client_count >= MAX_CLIENTS ||
+	    getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0) {
+		close(fd);
+		return;
+	}
+	/* keep a stalled client from blocking everyone else */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	memset(&clients[client_count], 0, sizeof(clients[client_count]));
+	clients[client_count].fd = fd;
+	clients[client_count].uid = cred.uid;
+	client_count += 1;
+
+} /* accept_client */
+
+/*
+ * open_socket
+ */
+static int
+open_socket (void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, BOOTINFOD_SOCKET);
+	unlink(BOOTINFOD_SOCKET);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    chmod(BOOTINFOD_SOCKET, 0660) < 0 ||
+	    listen(fd, MAX_CLIENTS) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+
+} /* open_socket */
+
+/*
+ * main program
+ */
+int
+main (int argc, char * const argv[])
+{
+	struct pollfd fds[MAX_CLIENTS+1];
+	struct sigaction sa;
+	int c, which, listenfd;
+	unsigned int i, j;
+	char *argv0_copy = strdup(argv[0]);
+
+	progname = basename(argv0_copy);
+
+	while ((c = getopt_long_only(argc, argv, shortopts, options, &which)) != -1) {
+		switch (c) {
+		case 'h':
+			print_usage();
+			return 0;
+		case 0:
+			if (strcmp(options[which].name, "version") == 0) {
+				printf("%s\n", VERSION);
+				return 0;
+			}
+			/* fallthrough */
+		default:
+			fprintf(stderr, "Error: unrecognized option\n");
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (bootinfo_open(&ctx, BOOTINFO_O_NO_DAEMON) < 0) {
+		perror("bootinfo_open");
+		return 1;
+	}
+	listenfd = open_socket();
+	if (listenfd < 0) {
+		perror(BOOTINFOD_SOCKET);
+		bootinfo_close(ctx);
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!stop_requested) {
+		fds[0].fd = listenfd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < client_count; i++) {
+			fds[i+1].fd = clients[i].fd;
+			fds[i+1].events = POLLIN;
+			fds[i+1].revents = 0;
+		}
+		if (poll(fds, client_count + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		/*
+		 * Handle one request from every client that has one,
+		 * then write out all of the commits among them at once.
+		 */
+		for (i = 0; i < client_count; i++) {
+			if (fds[i+1].revents == 0)
+				continue;
+			if (handle_request(&clients[i]) < 0) {
+				close(clients[i].fd);
+				clients[i].fd = -1;
+			}
+		}
+		process_commits();
+		for (i = j = 0; i < client_count; i++) {
+			if (clients[i].fd < 0) {
+				free(clients[i].commit);
+				continue;
+			}
+			clients[j++] = clients[i];
+		}
+		client_count = j;
+		if (fds[0].revents & POLLIN)
+			accept_client(listenfd);
+	}
+
+	for (i = 0; i < client_count; i++)
+		close(clients[i].fd);
+	close(listenfd);
+	unlink(BOOTINFOD_SOCKET);
+	bootinfo_close(ctx);
+	return 0;
+
+} /* main */
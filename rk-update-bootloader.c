@@ -8,6 +8,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <getopt.h>
@@ -15,7 +16,20 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "bootinfo.h"
+#include "blkio.h"
+#include "checksum.h"
 
 #ifndef UBOOT_SIZE_KB
 #if TARGET == 3588
@@ -31,29 +45,136 @@
 #define UBOOT_COPIES 2
 #endif /* UBOOT_COPIES */
 
+/*
+ * Digests of the images written to each slot are recorded in
+ * boot variables named _bl_<slot><copy>, as "<length>:<crc32>".
+ * A verify run can then skip the full compare for a slot whose
+ * recorded digest matches the image and whose first
+ * SIGNATURE_SIZE bytes match.
+ */
+#define SIGNATURE_SIZE 4096
+/*
+ * Slots are compared, and erased, in chunks of this size.
+ */
+#define IO_CHUNK_SIZE (64 * 1024)
+#define IO_BUFFER_ALIGN 4096
+#define UBOOT_PARTITION "/dev/disk/by-partlabel/uboot"
+#define BOOT_DEVICE "/dev/mmcblk0"
+#define IDBLOCK_SLOT_SIZE (1024 * 512)
+#define IDBLOCK_COPIES 5
+#define MAX_DIGEST_RECORDS 16
+struct digest_record {
+	char name[32];
+	char value[32];
+};
+static struct digest_record digest_records[MAX_DIGEST_RECORDS];
+static int digest_record_count;
+static bootinfo_ctx_t *digest_ctx;
+static bool full_verify;
+/*
+ * With --delta, a mismatched slot is compared with the image in
+ * erase-block-sized chunks (see erase_block_size()), and only the
+ * chunks that differ are rewritten.
+ */
+static bool delta_mode;
+static enum {
+	report_text,
+	report_json,
+} report_format = report_text;
+
+/*
+ * Each group is a set of slots holding copies of one
+ * image, the first slot being the primary copy.  Slots
+ * are read and written by a small pool of threads.
+ */
+#define IO_THREADS 4
+#define MAX_SLOTS (2 * UBOOT_COPIES + IDBLOCK_COPIES)
+typedef enum {
+	SLOT_COMPARE,
+	SLOT_WRITE,
+	SLOT_CHECK_DIGEST,
+	/* full compare after a write */
+	SLOT_VERIFY,
+	SLOT_OP_COUNT
+} slot_op_t;
+static const char *const slot_op_names[SLOT_OP_COUNT] = {
+	[SLOT_COMPARE] = "compare",
+	[SLOT_WRITE] = "write",
+	[SLOT_CHECK_DIGEST] = "check_digest",
+	[SLOT_VERIFY] = "verify",
+};
+struct slot_group {
+	const char *label;
+	const char *device;
+	int first;
+	int count;
+	/* slot written (and, in delta mode, verified) before the others */
+	int first_write;
+	char digest[32];
+};
+struct slot {
+	int fd;
+	off_t offset;
+	const void *image;
+	size_t image_len;
+	size_t slot_size;
+	size_t erase_size;
+	/* I/O done on the slot, and time spent in each operation */
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	uint64_t elapsed_ns[SLOT_OP_COUNT];
+	unsigned int ops_done;
+	struct slot_group *group;
+	char varname[32];
+	char recorded[32];
+	bool digest_known;
+	bool mismatched;
+	bool selected;
+	int result;
+	int error;
+};
+struct slot_run {
+	pthread_mutex_t lock;
+	slot_op_t op;
+	int next;
+};
+static struct slot_group slot_groups[3];
+static int slot_group_count;
+static struct slot slots[MAX_SLOTS];
+static int slot_count;
+
 static char *progname;
 
 static struct option options[] = {
 	{ "help",  		no_argument,		0, 'h' },
 	{ "verify", 		no_argument,		0, 'v' },
+	{ "full-verify",	no_argument,		0, 'F' },
+	{ "delta",		no_argument,		0, 'd' },
+	{ "report",		required_argument,	0, 'r' },
 	{ "version",		no_argument,		0, 0   },
 	{ 0,			0,			0, 0   }
 };
-static const char *shortopts = ":hv";
+static const char *shortopts = ":hvFdr:";
 
 static char *optarghelp[] = {
 	"--help               ",
 	"--verify             ",
+	"--full-verify        ",
+	"--delta              ",
+	"--report=FORMAT      ",
 	"--version            ",
 };
 
 static char *opthelp[] = {
 	"display this help text",
 	"verify that bootloader contents match the file contents",
+	"always compare full slot contents, even if a recorded digest matches",
+	"rewrite only the erase blocks of each slot that differ from the image",
+	"format for the results: text (default) or json",
 	"display version information"
 };
 
-static uint8_t zerobuf[UBOOT_SIZE_KB * 1024];
+static const uint8_t zerobuf[IO_CHUNK_SIZE];
 
 
 /*
@@ -81,214 +202,1020 @@ print_usage (void)
 	printf("\nArguments:\n");
 	printf(" <uboot-img>\tpathname of U-Boot FIT image\n");
 	printf(" <idblock-img>\tpathname of idblock image\n");
+	printf("\nEither image may be gzip- or zstd-compressed, and either\n"
+	       "(but not both) may be given as - to read it from standard input.\n");
 
 } /* print_usage */
 
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+
+} /* now_ns */
+
 /*
- * read_completely_at
+ * write_image_at
  *
- * Utility function for seeking to a specific offset
- * and reading a fixed number of bytes into a buffer,
- * handling short reads.
+ * Writes an image at a specific offset, padding it with
+ * zeros to a whole sector, so that the transfers stay
+ * sector-aligned for direct I/O.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+write_image_at (int fd, const void *buf, size_t bufsiz, off_t offset)
+{
+	uint8_t lastsect[BLKIO_SECTOR_SIZE];
+	size_t body = bufsiz & ~((size_t) BLKIO_SECTOR_SIZE - 1);
+
+	if (blkio_write(fd, buf, body, offset) < 0)
+		return -1;
+	if (body == bufsiz)
+		return 0;
+	memset(lastsect, 0, sizeof(lastsect));
+	memcpy(lastsect, (const uint8_t *) buf + body, bufsiz - body);
+	return blkio_write(fd, lastsect, sizeof(lastsect), offset + (off_t) body);
+
+} /* write_image_at */
+
+/*
+ * write_completely_at
+ *
+ * Utility function for writing a fixed number of bytes
+ * at a specific offset in a file or device.
+ *
+ * The rest of the erase_size bytes starting at offset are
+ * zeroed.  On block devices, this is done with BLKZEROOUT
+ * (which the kernel turns into a discard or write-zeroes
+ * command where the device supports one), so the data is
+ * written only once.  Otherwise, the whole area is written
+ * with zeros, then the data written over it.
  *
  * fd: file descriptor
- * buf: pointer to read buffer
- * bufsiz: number of bytes to read
+ * buf: pointer to data to be written
+ * bufsiz: number of bytes to write
  * offset: offset from start of file/device
+ * erase_size: number of bytes to zero from offset
  *
- * Returns: number of bytes read, or
+ * Returns: number of bytes written, or
  *          -1 on error (errno set)
  *
  */
 static ssize_t
-read_completely_at (int fd, void *buf, size_t bufsiz, off_t offset)
+write_completely_at (int fd, const void *buf, size_t bufsiz, off_t offset, size_t erase_size)
 {
-	ssize_t n, total;
-	size_t remain;
+	size_t data_end = (bufsiz + BLKIO_SECTOR_SIZE - 1) & ~((size_t) BLKIO_SECTOR_SIZE - 1);
+	size_t pos, n;
+	uint64_t range[2];
 
-	if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
+	if (data_end < erase_size) {
+		range[0] = (uint64_t) offset + data_end;
+		range[1] = erase_size - data_end;
+		if (ioctl(fd, BLKZEROOUT, range) == 0) {
+			if (write_image_at(fd, buf, bufsiz, offset) < 0)
+				return -1;
+			return (ssize_t) bufsiz;
+		}
+		if (errno != ENOTTY && errno != EOPNOTSUPP && errno != EINVAL)
+			return -1;
+	}
+	for (pos = 0; pos < erase_size; pos += n) {
+		n = (erase_size - pos < sizeof(zerobuf) ? erase_size - pos : sizeof(zerobuf));
+		if (blkio_write(fd, zerobuf, n, offset + (off_t) pos) < 0)
+			return -1;
+	}
+	fsync(fd);
+	if (write_image_at(fd, buf, bufsiz, offset) < 0)
 		return -1;
-	for (remain = bufsiz, total = 0; remain > 0; total += n, remain -= n) {
-		n = read(fd, (uint8_t *) buf + total, remain);
-		if (n <= 0)
+	return (ssize_t) bufsiz;
+
+} /* write_completely_at */
+
+/*
+ * range_matches
+ *
+ * Compares len bytes of a slot, starting pos bytes in, against
+ * the image, a chunk at a time, stopping at the first difference.
+ * Past the end of the image, the slot must hold zeros.  pos and
+ * len must be multiples of the sector size.
+ *
+ * chunkbuf: IO_CHUNK_SIZE-byte buffer for the reads
+ *
+ * Returns: 1 if the range matches, 0 if not,
+ *          -1 on error (errno set)
+ */
+static int
+range_matches (int bootfd, off_t offset, const void *image, size_t image_len,
+	       size_t pos, size_t len, uint8_t *chunkbuf)
+{
+	size_t end = pos + len, n, cmplen;
+
+	for (; pos < end; pos += n) {
+		n = end - pos;
+		if (n > IO_CHUNK_SIZE)
+			n = IO_CHUNK_SIZE;
+		if (blkio_read(bootfd, chunkbuf, n, offset + (off_t) pos) < 0)
 			return -1;
+		cmplen = (pos >= image_len ? 0 : (image_len - pos < n ? image_len - pos : n));
+		if (memcmp(chunkbuf, (const uint8_t *) image + pos, cmplen) != 0)
+			return 0;
+		if (cmplen < n && memcmp(chunkbuf + cmplen, zerobuf, n - cmplen) != 0)
+			return 0;
 	}
-	return total;
+	return 1;
 
-} /* read_completely_at */
+} /* range_matches */
 
 /*
- * write_completely_at
+ * slot_matches
  *
- * Utility function for seeking to a specific offset
- * and writing a fixed number of bytes to a file or device,
- * handling short writes.
+ * Compares a slot against an image.  Only the image
+ * length, rounded up to a whole sector, is read; the
+ * padding past the end of the image must be zeros.
  *
- * fd: file descriptor
- * buf: pointer to data to be written
- * bufsiz: number of bytes to write
- * offset: offset from start of file/device
+ * Returns: 1 if the slot matches, 0 if not,
+ *          -1 on error (errno set)
+ */
+static int
+slot_matches (int bootfd, off_t offset, const void *image, size_t image_len, uint8_t *chunkbuf)
+{
+	size_t readlen = (image_len + BLKIO_SECTOR_SIZE - 1) & ~((size_t) BLKIO_SECTOR_SIZE - 1);
+
+	return range_matches(bootfd, offset, image, image_len, 0, readlen, chunkbuf);
+
+} /* slot_matches */
+
+/*
+ * write_range
+ *
+ * Writes len bytes of the intended contents of a slot (the
+ * image, then zeros), starting pos bytes in.  pos and len
+ * must be multiples of the sector size.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+write_range (int fd, const void *image, size_t image_len, off_t offset, size_t pos, size_t len)
+{
+	size_t datalen = (pos >= image_len ? 0 : (image_len - pos < len ? image_len - pos : len));
+	size_t n;
+
+	if (datalen > 0) {
+		if (write_image_at(fd, (const uint8_t *) image + pos, datalen, offset + (off_t) pos) < 0)
+			return -1;
+		datalen = (datalen + BLKIO_SECTOR_SIZE - 1) & ~((size_t) BLKIO_SECTOR_SIZE - 1);
+	}
+	for (pos += datalen, len -= datalen; len > 0; pos += n, len -= n) {
+		n = (len < sizeof(zerobuf) ? len : sizeof(zerobuf));
+		if (blkio_write(fd, zerobuf, n, offset + (off_t) pos) < 0)
+			return -1;
+	}
+	return 0;
+
+} /* write_range */
+
+/*
+ * write_delta_at
+ *
+ * Brings a slot up to date by comparing it with the image in
+ * erase_size chunks, over the whole slot, and rewriting only the
+ * chunks that differ.
  *
  * Returns: number of bytes written, or
  *          -1 on error (errno set)
- *
  */
 static ssize_t
-write_completely_at (int fd, void *buf, size_t bufsiz, off_t offset, size_t erase_size)
+write_delta_at (int fd, const void *image, size_t image_len, off_t offset,
+		size_t slot_size, size_t erase_size, uint8_t *chunkbuf)
+{
+	size_t pos, n, written = 0;
+	int ret;
+
+	for (pos = 0; pos < slot_size; pos += n) {
+		n = (slot_size - pos < erase_size ? slot_size - pos : erase_size);
+		ret = range_matches(fd, offset, image, image_len, pos, n, chunkbuf);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			continue;
+		if (write_range(fd, image, image_len, offset, pos, n) < 0)
+			return -1;
+		written += n;
+	}
+	return (ssize_t) written;
+
+} /* write_delta_at */
+
+/*
+ * erase_block_size
+ *
+ * Returns the chunk size for delta updates of slots on a
+ * device: its discard granularity, as reported in sysfs
+ * (for a partition, by its parent disk), if that is a whole
+ * number of sectors no larger than max_size, or IO_CHUNK_SIZE.
+ */
+static size_t
+erase_block_size (int fd, size_t max_size)
+{
+	static const char *const paths[] = {
+		"/sys/dev/block/%u:%u/queue/discard_granularity",
+		"/sys/dev/block/%u:%u/../queue/discard_granularity",
+	};
+	char path[128];
+	unsigned long size = 0;
+	struct stat st;
+	unsigned int i;
+	FILE *fp;
+
+	if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode))
+		return IO_CHUNK_SIZE;
+	for (i = 0; i < sizeof(paths)/sizeof(paths[0]) && size == 0; i++) {
+		snprintf(path, sizeof(path), paths[i], major(st.st_rdev), minor(st.st_rdev));
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		if (fscanf(fp, "%lu", &size) != 1)
+			size = 0;
+		fclose(fp);
+	}
+	if (size == 0 || size % BLKIO_SECTOR_SIZE != 0 || size > max_size)
+		return IO_CHUNK_SIZE;
+	return size;
+
+} /* erase_block_size */
+
+/*
+ * image_digest
+ *
+ * Formats the digest of an image for recording.
+ */
+static void
+image_digest (const void *image, size_t image_len, char *buf, size_t bufsize)
 {
-	ssize_t n, total;
-	size_t remain;
+	snprintf(buf, bufsize, "%zu:%08lx", image_len,
+		 (unsigned long) checksum_crc32(0, image, image_len));
 
-	if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
+} /* image_digest */
+
+/*
+ * digest_recorded
+ *
+ * Checks whether the digest recorded for a slot
+ * matches the image digest.
+ */
+static bool
+digest_recorded (const char *varname, const char *digest)
+{
+	char *recorded;
+
+	return (digest_ctx != NULL &&
+		bootinfo_bootvar_get(digest_ctx, varname, &recorded) == 0 &&
+		strcmp(recorded, digest) == 0);
+
+} /* digest_recorded */
+
+/*
+ * signature_matches
+ *
+ * For a slot whose recorded digest matches the image,
+ * checks that the start of the slot still holds the image.
+ *
+ * Returns: 1 if it does, 0 if not (a full compare is needed),
+ *          -1 on error (errno set)
+ */
+static int
+signature_matches (int bootfd, off_t offset, const void *image, size_t image_len,
+		   uint8_t *chunkbuf)
+{
+	size_t siglen = (image_len < SIGNATURE_SIZE ? image_len : SIGNATURE_SIZE);
+	size_t readlen = (siglen + BLKIO_SECTOR_SIZE - 1) & ~((size_t) BLKIO_SECTOR_SIZE - 1);
+
+	if (blkio_read(bootfd, chunkbuf, readlen, offset) < 0)
 		return -1;
-	for (remain = erase_size, total = 0; remain > 0; total += n, remain -= n) {
-		n = write(fd, (uint8_t *) zerobuf + total, remain);
-		if (n <= 0)
+	return memcmp(chunkbuf, image, siglen) == 0;
+
+} /* signature_matches */
+
+/*
+ * recorded_copy_intact
+ *
+ * For a slot that does not hold the image, checks whether it
+ * still holds what its digest record says was written to it, by
+ * comparing the CRC-32 of that many bytes with the recorded one.
+ *
+ * Returns: 1 if it does, 0 if not (or no digest is recorded),
+ *          -1 on error (errno set)
+ */
+static int
+recorded_copy_intact (const struct slot *slot, uint8_t *chunkbuf)
+{
+	size_t len, pos, n;
+	unsigned long crcsum;
+	uint32_t sum = 0;
+
+	if (sscanf(slot->recorded, "%zu:%lx", &len, &crcsum) != 2 ||
+	    len == 0 || len > slot->slot_size)
+		return 0;
+	for (pos = 0; pos < len; pos += n) {
+		n = (len - pos < IO_CHUNK_SIZE ? len - pos : IO_CHUNK_SIZE);
+		if (blkio_read(slot->fd, chunkbuf, (n + BLKIO_SECTOR_SIZE - 1) & ~((size_t) BLKIO_SECTOR_SIZE - 1),
+			       slot->offset + (off_t) pos) < 0)
 			return -1;
+		sum = checksum_crc32(sum, chunkbuf, n);
 	}
-	fsync(fd);
-	if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
+	return sum == crcsum;
+
+} /* recorded_copy_intact */
+
+/*
+ * record_digest
+ *
+ * Notes the digest for a slot that is known to hold
+ * the image, to be saved by save_digests().
+ */
+static void
+record_digest (const char *varname, const char *digest)
+{
+	if (digest_ctx == NULL || digest_record_count >= MAX_DIGEST_RECORDS ||
+	    digest_recorded(varname, digest))
+		return;
+	strcpy(digest_records[digest_record_count].name, varname);
+	strcpy(digest_records[digest_record_count].value, digest);
+	digest_record_count += 1;
+
+} /* record_digest */
+
+/*
+ * save_digests
+ *
+ * Stores the recorded digests in the boot variables,
+ * with one update.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+save_digests (void)
+{
+	bootinfo_ctx_t *ctx;
+	int i;
+
+	if (digest_record_count == 0)
+		return 0;
+	if (bootinfo_open(&ctx, 0) < 0) {
+		perror("bootinfo_open");
 		return -1;
-	for (remain = bufsiz, total = 0; remain > 0; total += n, remain -= n) {
-		n = write(fd, (uint8_t *) buf + total, remain);
-		if (n <= 0)
+	}
+	if (bootinfo_batch_begin(ctx) < 0) {
+		perror("bootinfo_batch_begin");
+		bootinfo_close(ctx);
+		return -1;
+	}
+	for (i = 0; i < digest_record_count; i++) {
+		if (bootinfo_batch_set(ctx, digest_records[i].name, digest_records[i].value) < 0) {
+			perror(digest_records[i].name);
+			bootinfo_batch_abort(ctx);
+			bootinfo_close(ctx);
 			return -1;
+		}
+	}
+	if (bootinfo_batch_commit(ctx) < 0) {
+		perror("bootinfo_update");
+		bootinfo_close(ctx);
+		return -1;
 	}
-	return total;
+	bootinfo_close(ctx);
+	return 0;
 
-} /* write_completely_at */
+} /* save_digests */
 
 /*
- * process_idblock
+ * add_slots
  *
- * Updates or verifies the IDBLOCK slots.  On systems booting from eMMC,
- * the idblock is expected at sector 64, with up to 4 backup copies at
- * 1024-sector intervals thereafter.
+ * Adds a group of slots holding copies of an image, the
+ * first of which is the primary copy, to the slot table.
  *
- * update: true if updating, false if just verifying
- * bootfd: file descriptor for boot device
- * idblock: pointer to new idblock to write (maybe)
- * idblock_len: length of new idblock
+ * label: name for the group in messages
+ * slotname: name for the slots in the digest records
+ * device: pathname of the device holding the slots
+ * bootfd: file descriptor for the device holding the slots
+ * image: pointer to the image
+ * image_len: length of the image
+ * offset: offset of the first slot
+ * slot_size: size of each slot, and the interval between them
+ * copycount: number of copies
  *
+ * Returns: nothing
+ */
+static void
+add_slots (const char *label, const char *slotname, const char *device, int bootfd,
+	   const void *image, size_t image_len, off_t offset, size_t slot_size, int copycount)
+{
+	struct slot_group *group = &slot_groups[slot_group_count++];
+	struct slot *slot;
+	int i;
+
+	group->label = label;
+	group->device = device;
+	group->first = slot_count;
+	group->first_write = slot_count;
+	group->count = copycount;
+	image_digest(image, image_len, group->digest, sizeof(group->digest));
+	for (i = 1; i <= copycount; i++, offset += (off_t) slot_size) {
+		slot = &slots[slot_count++];
+		memset(slot, 0, sizeof(*slot));
+		slot->fd = bootfd;
+		slot->offset = offset;
+		slot->image = image;
+		slot->image_len = image_len;
+		slot->slot_size = slot_size;
+		slot->erase_size = erase_block_size(bootfd, slot_size);
+		slot->group = group;
+		snprintf(slot->varname, sizeof(slot->varname), "_bl_%s%d", slotname, i);
+	}
+
+} /* add_slots */
+
+/*
+ * slot_worker
  *
- * returns: 0 on success, -1 on error (errno not set), >0 = number of copies
- * needing update
+ * Thread routine for run_slots(): takes slots from
+ * the table until none are left, performing the
+ * current operation on each one selected for it.
+ */
+static void *
+slot_worker (void *arg)
+{
+	struct slot_run *run = arg;
+	unsigned long long nread, nwritten;
+	uint8_t *chunkbuf;
+	struct slot *slot;
+	ssize_t written;
+	uint64_t start;
+	int i, ret;
+
+	if (posix_memalign((void **) &chunkbuf, IO_BUFFER_ALIGN, IO_CHUNK_SIZE) != 0)
+		chunkbuf = NULL;
+	for (;;) {
+		pthread_mutex_lock(&run->lock);
+		i = run->next++;
+		pthread_mutex_unlock(&run->lock);
+		if (i >= slot_count)
+			break;
+		slot = &slots[i];
+		if (!slot->selected)
+			continue;
+		if (chunkbuf == NULL) {
+			slot->result = -1;
+			slot->error = ENOMEM;
+			continue;
+		}
+		start = now_ns();
+		nread = blkio_bytes_read();
+		nwritten = blkio_bytes_written();
+		if (run->op == SLOT_COMPARE) {
+			ret = 0;
+			if (slot->digest_known)
+				ret = signature_matches(slot->fd, slot->offset, slot->image,
+							slot->image_len, chunkbuf);
+			if (ret == 0)
+				ret = slot_matches(slot->fd, slot->offset, slot->image,
+						   slot->image_len, chunkbuf);
+		} else if (run->op == SLOT_VERIFY)
+			ret = slot_matches(slot->fd, slot->offset, slot->image,
+					   slot->image_len, chunkbuf);
+		else if (run->op == SLOT_CHECK_DIGEST)
+			ret = recorded_copy_intact(slot, chunkbuf);
+		else {
+			if (delta_mode)
+				written = write_delta_at(slot->fd, slot->image, slot->image_len, slot->offset,
+							 slot->slot_size, slot->erase_size, chunkbuf);
+			else
+				written = write_completely_at(slot->fd, slot->image, slot->image_len,
+							      slot->offset, slot->slot_size);
+			ret = (written < 0 ? -1 : 1);
+		}
+		slot->result = ret;
+		slot->error = (ret < 0 ? errno : 0);
+		slot->bytes_read += blkio_bytes_read() - nread;
+		slot->bytes_written += blkio_bytes_written() - nwritten;
+		slot->elapsed_ns[run->op] += now_ns() - start;
+		slot->ops_done |= 1U << run->op;
+	}
+	free(chunkbuf);
+	return NULL;
+
+} /* slot_worker */
+
+/*
+ * run_slots
+ *
+ * Performs an operation on all of the selected slots,
+ * spread across up to IO_THREADS threads, then syncs
+ * the devices written to, if any.
  *
+ * Returns: 0 if all succeeded, -1 if any failed
  */
 static int
-process_idblock (bool update, int bootfd, void *idblock, size_t idblock_len)
+run_slots (slot_op_t op)
+{
+	struct slot_run run = { .lock = PTHREAD_MUTEX_INITIALIZER, .op = op };
+	pthread_t threads[IO_THREADS];
+	int i, nthreads = 0, selected = 0, failed = 0;
+	uint64_t start;
+
+	for (i = 0; i < slot_count; i++)
+		if (slots[i].selected)
+			selected += 1;
+	while (nthreads < IO_THREADS && nthreads < selected - 1) {
+		if (pthread_create(&threads[nthreads], NULL, slot_worker, &run) != 0)
+			break;
+		nthreads += 1;
+	}
+	slot_worker(&run);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < slot_count; i++) {
+		if (!slots[i].selected)
+			continue;
+		if (slots[i].result < 0) {
+			failed += 1;
+			continue;
+		}
+		if (op != SLOT_WRITE)
+			continue;
+		start = now_ns();
+		if (fsync(slots[i].fd) < 0) {
+			slots[i].result = -1;
+			slots[i].error = errno;
+			failed += 1;
+		}
+		slots[i].elapsed_ns[op] += now_ns() - start;
+	}
+	return (failed == 0 ? 0 : -1);
+
+} /* run_slots */
+
+/*
+ * report_failures
+ *
+ * Prints errors for the slots that failed the last operation.
+ */
+static void
+report_failures (const char *what)
 {
-	static uint8_t idb_buf[1024*512];
-	off_t offset;
 	int i;
-	int mismatched = 0;
 
-	if (idblock_len > sizeof(idb_buf)) {
-		fprintf(stderr, "ERR: idblock image size exceeds 512KiB maximum\n");
+	for (i = 0; i < slot_count; i++)
+		if (slots[i].selected && slots[i].result < 0)
+			fprintf(stderr, "%s %s (copy %d): %s\n", slots[i].group->label, what,
+				(int) (&slots[i] - &slots[slots[i].group->first]) + 1,
+				strerror(slots[i].error));
+
+} /* report_failures */
+
+/*
+ * choose_first_writes
+ *
+ * For delta mode, picks the slot to be written first in each
+ * group with a mismatched primary; see process_slots().
+ *
+ * Returns: 0 on success, -1 on error
+ */
+static int
+choose_first_writes (void)
+{
+	struct slot_group *group;
+	struct slot *slot;
+	char *recorded;
+	bool known_good;
+	int g, i;
+
+	for (i = 0; i < slot_count; i++)
+		slots[i].selected = false;
+	for (g = 0; g < slot_group_count && digest_ctx != NULL; g++) {
+		group = &slot_groups[g];
+		if (group->count < 2 || !slots[group->first].mismatched)
+			continue;
+		for (i = 1, known_good = false; i < group->count && !known_good; i++)
+			known_good = !slots[group->first + i].mismatched;
+		for (i = 1; i < group->count && !known_good; i++) {
+			slot = &slots[group->first + i];
+			if (bootinfo_bootvar_get(digest_ctx, slot->varname, &recorded) == 0 &&
+			    strlen(recorded) < sizeof(slot->recorded)) {
+				strcpy(slot->recorded, recorded);
+				slot->selected = true;
+			}
+		}
+	}
+	if (run_slots(SLOT_CHECK_DIGEST) < 0) {
+		report_failures("read");
 		return -1;
 	}
-	if (update)
-		printf("idblock: ");
-	for (i = 1, offset = 64 * 512; i <= 5; i++, offset += 1024 * 512) {
-		if (read_completely_at(bootfd, idb_buf, sizeof(idb_buf), offset) < 0) {
-			perror("idblock read");
-			return -1;
+	for (g = 0; g < slot_group_count; g++) {
+		group = &slot_groups[g];
+		if (group->count < 2 || !slots[group->first].mismatched)
+			continue;
+		for (i = 1, known_good = false; i < group->count && !known_good; i++) {
+			slot = &slots[group->first + i];
+			known_good = (!slot->mismatched || (slot->selected && slot->result > 0));
 		}
-		if (memcmp(idb_buf, idblock, idblock_len) != 0) {
+		group->first_write = group->first + (known_good ? 0 : 1);
+	}
+	return 0;
+
+} /* choose_first_writes */
+
+/*
+ * process_slots
+ *
+ * Updates or verifies all of the slots in the slot table.
+ *
+ * All slots are compared first, in parallel.  When updating,
+ * the mismatched primary copies are then written and synced,
+ * before any backup copy is touched, so that an interruption
+ * always leaves at least one good copy of each image; the
+ * mismatched backups are written last.
+ *
+ * In delta mode, where a slot is rewritten in place a piece at
+ * a time, the first copy written in each group is read back and
+ * verified before the others are touched.  That is the primary
+ * if some backup is known to be good, either holding the image
+ * already or still holding what its digest record says was
+ * written to it; otherwise, a backup is written and verified
+ * first.
+ *
+ * update: true if updating, false if just verifying
+ *
+ * returns: 0 on success, -1 on error, >0 = number of copies
+ * needing update
+ *
+ */
+static int
+process_slots (bool update)
+{
+	struct slot_group *group;
+	struct slot *slot;
+	int g, i, mismatched = 0;
+
+	for (i = 0; i < slot_count; i++) {
+		slot = &slots[i];
+		slot->selected = true;
+		slot->digest_known = (!update && !full_verify &&
+				      digest_recorded(slot->varname, slot->group->digest));
+	}
+	if (run_slots(SLOT_COMPARE) < 0) {
+		report_failures("read");
+		return -1;
+	}
+	for (i = 0; i < slot_count; i++) {
+		slot = &slots[i];
+		slot->mismatched = (slot->result == 0);
+		if (slot->mismatched)
 			mismatched += 1;
-			if (update) {
-				printf("[copy %d]...", i);
-				if (write_completely_at(bootfd, idblock, idblock_len, offset, sizeof(idb_buf)) < 0) {
-					printf("[FAIL]\n");
-					perror("idblock write");
-					return -1;
-				}
+	}
+	if (!update || mismatched == 0)
+		goto done;
+
+	if (delta_mode && choose_first_writes() < 0)
+		return -1;
+	for (i = 0; i < slot_count; i++)
+		slots[i].selected = (slots[i].mismatched && i == slots[i].group->first_write);
+	if (run_slots(SLOT_WRITE) < 0) {
+		report_failures("write");
+		return -1;
+	}
+	if (delta_mode) {
+		if (run_slots(SLOT_VERIFY) < 0) {
+			report_failures("read");
+			return -1;
+		}
+		for (i = 0; i < slot_count; i++) {
+			if (slots[i].selected && slots[i].result == 0) {
+				fprintf(stderr, "%s (copy %d): verification after write failed\n",
+					slots[i].group->label, i - slots[i].group->first + 1);
+				return -1;
 			}
 		}
 	}
+	for (i = 0; i < slot_count; i++)
+		slots[i].selected = (slots[i].mismatched && i != slots[i].group->first_write);
+	if (run_slots(SLOT_WRITE) < 0) {
+		report_failures("write");
+		return -1;
+	}
 
+  done:
 	if (update) {
-		fsync(bootfd);
-		printf("[OK]\n");
+		for (g = 0; g < slot_group_count; g++) {
+			group = &slot_groups[g];
+			if (report_format == report_text)
+				printf("%s: ", group->label);
+			for (i = 0; i < group->count; i++) {
+				slot = &slots[group->first + i];
+				if (slot->mismatched && report_format == report_text)
+					printf("[copy %d]...", i + 1);
+				record_digest(slot->varname, group->digest);
+			}
+			if (report_format == report_text)
+				printf("[OK]\n");
+		}
 	}
 	return mismatched;
 
-} /* process_idblock */
+} /* process_slots */
+
 
 /*
- * process_uboot
+ * read_fully
  *
- * Updates the u-boot slots.  On systems booting from eMMC,
- * the SPL looks first for a partition named 'uboot'; if present,
- * it loads from there.  If not present, or loading from the partition
- * fails, it tries loading at sector 16384.  Backup copies at
- * each location are possible, 2 by default (CONFIG_SPL_FIT_IMAGE_MULTIPLE),
- * at intervals controlled by CONFIG_SPL_FIT_IMAGE_KB (4096 for 3588,
- * 2048 for 3566/3568, by default).
+ * Reads from a file or pipe until bufsiz bytes have
+ * been read or the end of the input is reached.
  *
- * update: true if updating, false if just verifying
- * bootfd: file descriptor for boot device
- * ubootimg: pointer to new uboot FIT to write (if needed)
- * ubootimg_len: length of ubootimg
- * offset: starting offset
- * copycount: number of copies to check
+ * Returns: number of bytes read, or
+ *          -1 on error (errno set)
+ */
+static ssize_t
+read_fully (int fd, void *buf, size_t bufsiz)
+{
+	size_t total = 0;
+	ssize_t n;
+
+	while (total < bufsiz) {
+		n = read(fd, (uint8_t *) buf + total, bufsiz - total);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		total += (size_t) n;
+	}
+	return (ssize_t) total;
+
+} /* read_fully */
+
+/*
+ * inflate_image
  *
- * returns: 0 on success, -1 on error (errno not set), >0 = number of copies needing update
+ * Decompresses a gzip stream, of which the first inlen
+ * bytes have already been read into inbuf, into the image
+ * buffer.  Concatenated gzip members are handled as one
+ * stream.
  *
+ * Returns: 0 on success, -1 on error (errno set;
+ *          EFBIG if the image does not fit in maxlen bytes)
  */
 static int
-process_uboot (bool update, int bootfd, void *ubootimg, size_t ubootimg_len, off_t offset, int copycount)
+inflate_image (int fd, uint8_t *inbuf, size_t inlen, uint8_t *image, size_t maxlen, size_t *lenp)
 {
-	size_t uboot_size = UBOOT_SIZE_KB * 1024;
-	static uint8_t uboot_buf[UBOOT_SIZE_KB * 1024];
-	int i;
-	int mismatched = 0;
+	z_stream strm;
+	bool in_member = false;
+	ssize_t n;
+	int ret;
 
-	if (ubootimg_len > uboot_size) {
-		fprintf(stderr, "ERR: u-boot FIT image size exceeds %uKiB maximum\n", UBOOT_SIZE_KB);
+	memset(&strm, 0, sizeof(strm));
+	if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+		errno = ENOMEM;
 		return -1;
 	}
-	if (update)
-		printf("uboot: ");
-	for (i = 1;  i <= copycount; i++, offset += (off_t) uboot_size) {
-		if (read_completely_at(bootfd, uboot_buf, sizeof(uboot_buf), offset) < 0) {
-			perror("uboot read");
-			return -1;
+	strm.next_in = inbuf;
+	strm.avail_in = (uInt) inlen;
+	strm.next_out = image;
+	strm.avail_out = (uInt) maxlen;
+	for (;;) {
+		if (strm.avail_in == 0) {
+			n = read_fully(fd, inbuf, IO_CHUNK_SIZE);
+			if (n < 0)
+				goto fail;
+			if (n == 0)
+				break;
+			strm.next_in = inbuf;
+			strm.avail_in = (uInt) n;
 		}
-		if (memcmp(uboot_buf, ubootimg, ubootimg_len) != 0) {
-			mismatched += 1;
-			if (update) {
-				printf("[copy %d]...", i);
-				if (write_completely_at(bootfd, ubootimg, ubootimg_len, offset, sizeof(uboot_buf)) < 0) {
-					printf("[FAIL]\n");
-					perror("uboot write");
-					return -1;
-				}
+		in_member = true;
+		ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			in_member = false;
+			if (inflateReset(&strm) != Z_OK) {
+				errno = EINVAL;
+				goto fail;
 			}
+		} else if (ret == Z_BUF_ERROR) {
+			/* input is always available here, so the output is full */
+			errno = EFBIG;
+			goto fail;
+		} else if (ret != Z_OK) {
+			errno = (ret == Z_MEM_ERROR ? ENOMEM : EINVAL);
+			goto fail;
 		}
 	}
+	if (in_member) {
+		/* truncated stream */
+		errno = EINVAL;
+		goto fail;
+	}
+	*lenp = maxlen - strm.avail_out;
+	inflateEnd(&strm);
+	return 0;
+  fail:
+	inflateEnd(&strm);
+	return -1;
 
-	if (update) {
-		fsync(bootfd);
-		printf("[OK]\n");
+} /* inflate_image */
+
+#ifdef HAVE_ZSTD
+/*
+ * unzstd_image
+ *
+ * Decompresses a zstd stream, of which the first inlen
+ * bytes have already been read into inbuf, into the image
+ * buffer.  Concatenated frames are handled as one stream.
+ *
+ * Returns: 0 on success, -1 on error (errno set;
+ *          EFBIG if the image does not fit in maxlen bytes)
+ */
+static int
+unzstd_image (int fd, uint8_t *inbuf, size_t inlen, uint8_t *image, size_t maxlen, size_t *lenp)
+{
+	ZSTD_DStream *zds = ZSTD_createDStream();
+	ZSTD_inBuffer in = { inbuf, inlen, 0 };
+	ZSTD_outBuffer out = { image, maxlen, 0 };
+	size_t ret = 0, inpos;
+	ssize_t n;
+
+	if (zds == NULL) {
+		errno = ENOMEM;
+		return -1;
 	}
-	return mismatched;
+	for (;;) {
+		if (in.pos == in.size) {
+			n = read_fully(fd, inbuf, IO_CHUNK_SIZE);
+			if (n < 0)
+				goto fail;
+			if (n == 0)
+				break;
+			in.size = (size_t) n;
+			in.pos = 0;
+		}
+		inpos = in.pos;
+		ret = ZSTD_decompressStream(zds, &out, &in);
+		if (ZSTD_isError(ret)) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (ret != 0 && out.pos == out.size && in.pos == inpos) {
+			errno = EFBIG;
+			goto fail;
+		}
+	}
+	if (ret != 0) {
+		/* truncated stream */
+		errno = EINVAL;
+		goto fail;
+	}
+	*lenp = out.pos;
+	ZSTD_freeDStream(zds);
+	return 0;
+  fail:
+	ZSTD_freeDStream(zds);
+	return -1;
+
+} /* unzstd_image */
+#endif /* HAVE_ZSTD */
+
+/*
+ * load_image
+ *
+ * Reads an image from a file, or from standard input if
+ * pathname is "-", into the image buffer.  Input compressed
+ * with gzip (or zstd, if built with it) is recognized by its
+ * magic number and decompressed as it is read, so a compressed
+ * image can be piped in without first being expanded to a file.
+ *
+ * Returns: 0 on success, -1 on error (errno set;
+ *          EFBIG if the image does not fit in maxlen bytes)
+ */
+static int
+load_image (const char *pathname, uint8_t *image, size_t maxlen, size_t *lenp)
+{
+	static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+	static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+	uint8_t *inbuf;
+	ssize_t n, m;
+	int fd, ret = -1, save_errno;
+
+	if (strcmp(pathname, "-") == 0)
+		fd = STDIN_FILENO;
+	else {
+		fd = open(pathname, O_RDONLY);
+		if (fd < 0)
+			return -1;
+	}
+	inbuf = malloc(IO_CHUNK_SIZE);
+	if (inbuf == NULL)
+		goto out;
+	n = read_fully(fd, inbuf, IO_CHUNK_SIZE);
+	if (n < 0)
+		goto out;
+	if (n >= sizeof(gzip_magic) && memcmp(inbuf, gzip_magic, sizeof(gzip_magic)) == 0)
+		ret = inflate_image(fd, inbuf, (size_t) n, image, maxlen, lenp);
+	else if (n >= sizeof(zstd_magic) && memcmp(inbuf, zstd_magic, sizeof(zstd_magic)) == 0) {
+#ifdef HAVE_ZSTD
+		ret = unzstd_image(fd, inbuf, (size_t) n, image, maxlen, lenp);
+#else
+		errno = ENOTSUP;
+#endif
+	} else if (n > maxlen)
+		errno = EFBIG;
+	else {
+		memcpy(image, inbuf, (size_t) n);
+		m = read_fully(fd, image + n, maxlen - (size_t) n);
+		if (m < 0)
+			goto out;
+		*lenp = (size_t) (n + m);
+		/* anything left over means the image is too large */
+		if (*lenp == maxlen && (m = read_fully(fd, inbuf, 1)) != 0) {
+			if (m > 0)
+				errno = EFBIG;
+			goto out;
+		}
+		ret = 0;
+	}
+  out:
+	save_errno = errno;
+	free(inbuf);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	errno = save_errno;
+	return ret;
 
-} /* process_uboot */
+} /* load_image */
 
+/*
+ * print_report
+ *
+ * Prints the results of a run as a JSON object, with a
+ * record for each slot of the I/O done on it and the time
+ * taken by each operation performed on it.  Times are in
+ * microseconds.
+ *
+ * Returns: nothing
+ */
+static void
+print_report (bool update, int totalcount, uint64_t load_ns, uint64_t total_ns)
+{
+	struct slot *slot;
+	const char *sep;
+	int i, op;
+
+	printf("{\"operation\":\"%s\",\"result\":\"%s\",\"updates_needed\":%d,"
+	       "\"load_us\":%llu,\"elapsed_us\":%llu,\"slots\":[",
+	       (update ? "update" : "verify"),
+	       (totalcount < 0 ? "error" : (totalcount > 0 && !update ? "mismatch" : "ok")),
+	       (totalcount < 0 ? 0 : totalcount),
+	       (unsigned long long) (load_ns / 1000), (unsigned long long) (total_ns / 1000));
+	for (i = 0; i < slot_count; i++) {
+		slot = &slots[i];
+		printf("%s\n{\"image\":\"%s\",\"device\":\"%s\",\"offset\":%llu,\"copy\":%d,"
+		       "\"mismatched\":%s,\"bytes_read\":%llu,\"bytes_written\":%llu,\"elapsed_us\":{",
+		       (i == 0 ? "" : ","), slot->group->label, slot->group->device,
+		       (unsigned long long) slot->offset, i - slot->group->first + 1,
+		       (slot->mismatched ? "true" : "false"), slot->bytes_read, slot->bytes_written);
+		for (op = 0, sep = ""; op < SLOT_OP_COUNT; op++) {
+			if ((slot->ops_done & (1U << op)) == 0)
+				continue;
+			printf("%s\"%s\":%llu", sep, slot_op_names[op],
+			       (unsigned long long) (slot->elapsed_ns[op] / 1000));
+			sep = ",";
+		}
+		printf("}");
+		if (slot->result < 0)
+			printf(",\"error\":\"%s\"", strerror(slot->error));
+		printf("}");
+	}
+	printf("]}\n");
+
+} /* print_report */
 
 /*
  * main program
  */
 int
 main (int argc, char * const argv[]) {
-	int c, which, fd = -1;
+	int c, which, fd = -1, partfd = -1;
 	bool update = true;
-	struct stat st;
 	size_t uboot_len, idblock_len;
 	static uint8_t uboot_image[UBOOT_SIZE_KB * 1024];
-	static uint8_t idblock_image[512 * 1024];
-	int totalcount = 0, count;
+	static uint8_t idblock_image[IDBLOCK_SLOT_SIZE];
+	int i, totalcount;
+	unsigned long long written = 0;
+	uint64_t start = now_ns(), load_ns;
 	char *argv0_copy = strdup(argv[0]);
 
 	progname = basename(argv0_copy);
@@ -301,6 +1228,23 @@ main (int argc, char * const argv[]) {
 			case 'v':
 				update = false;
 				break;
+			case 'F':
+				full_verify = true;
+				break;
+			case 'd':
+				delta_mode = true;
+				break;
+			case 'r':
+				if (strcmp(optarg, "text") == 0)
+					report_format = report_text;
+				else if (strcmp(optarg, "json") == 0)
+					report_format = report_json;
+				else {
+					fprintf(stderr, "Error: unrecognized report format: %s\n", optarg);
+					print_usage();
+					return 1;
+				}
+				break;
 			case 0:
 				if (strcmp(options[which].name, "version") == 0) {
 					printf("%s\n", VERSION);
@@ -320,94 +1264,91 @@ main (int argc, char * const argv[]) {
 		return 1;
 	}
 
-	fd = open(argv[optind], O_RDONLY);
-	if (fd < 0 || fstat(fd, &st) != 0) {
-		perror(argv[optind]);
-		if (fd >= 0)
-			close(fd);
+	if (strcmp(argv[optind], "-") == 0 && strcmp(argv[optind+1], "-") == 0) {
+		fprintf(stderr, "Error: only one image can be read from standard input\n");
 		return 1;
 	}
-	if (st.st_size > sizeof(uboot_image)) {
-		fprintf(stderr, "ERR: u-boot image too large\n");
-		close(fd);
+	if (load_image(argv[optind], uboot_image, sizeof(uboot_image), &uboot_len) < 0) {
+		if (errno == EFBIG)
+			fprintf(stderr, "ERR: u-boot image too large\n");
+		else
+			perror(argv[optind]);
 		return 1;
 	}
-	uboot_len = read_completely_at(fd, uboot_image, st.st_size, 0);
-	if (uboot_len != st.st_size) {
-		perror("reading uboot image");
-		close(fd);
-		return 1;
-	}
-	close(fd);
 	optind += 1;
-
-	fd = open(argv[optind], O_RDONLY);
-	if (fd < 0 || fstat(fd, &st) != 0) {
-		perror(argv[optind]);
-		if (fd >= 0)
-			close(fd);
-		return 1;
-	}
-	if (st.st_size > sizeof(idblock_image)) {
-		fprintf(stderr, "ERR: idblock image too large\n");
-		close(fd);
+	if (load_image(argv[optind], idblock_image, sizeof(idblock_image), &idblock_len) < 0) {
+		if (errno == EFBIG)
+			fprintf(stderr, "ERR: idblock image too large\n");
+		else
+			perror(argv[optind]);
 		return 1;
 	}
-	idblock_len = read_completely_at(fd, idblock_image, st.st_size, 0);
-	if (idblock_len != st.st_size) {
-		perror("reading idblock image");
-		close(fd);
-		return 1;
-	}
-	close(fd);
+	load_ns = now_ns() - start;
 
-	fd = open("/dev/disk/by-partlabel/uboot", (update ? O_RDWR : O_RDONLY));
-	if (fd >= 0) {
+	/*
+	 * Digest records are only used if the boot variable
+	 * store is already set up; opening it read-write here
+	 * would initialize it otherwise.
+	 */
+	if (bootinfo_open(&digest_ctx, BOOTINFO_O_RDONLY) < 0)
+		digest_ctx = NULL;
+
+	partfd = blkio_open(UBOOT_PARTITION, (update ? O_RDWR : O_RDONLY), true);
+	if (partfd >= 0) {
 		off_t endpos;
 		int copycount;
-		endpos = lseek(fd, 0, SEEK_END);
+		endpos = lseek(partfd, 0, SEEK_END);
 		if (endpos == (off_t) -1) {
 			perror("uboot partition");
-			close(fd);
+			close(partfd);
 			return 1;
 		}
 		copycount = (int) (endpos / (UBOOT_SIZE_KB * 1024));
 		if (copycount == 0) {
 			fprintf(stderr, "uboot partition too small, skipping\n");
-			close(fd);
+			close(partfd);
+			partfd = -1;
 		} else {
 			if (copycount > UBOOT_COPIES)
 				copycount = UBOOT_COPIES;
-			count = process_uboot(update, fd, uboot_image, uboot_len, 0, copycount);
-			close(fd);
-			if (count < 0) {
-				fprintf(stderr, "error processing uboot partition\n");
-				return 1;
-			}
-			totalcount += count;
+			add_slots("uboot", "ubootpart", UBOOT_PARTITION, partfd, uboot_image, uboot_len,
+				  0, UBOOT_SIZE_KB * 1024, copycount);
 		}
 	}
-	fd = open("/dev/mmcblk0", (update ? O_RDWR: O_RDONLY));
+	fd = blkio_open(BOOT_DEVICE, (update ? O_RDWR: O_RDONLY), true);
 	if (fd < 0) {
-		perror("/dev/mmcblk0");
-		return 1;
-	}
-	count = process_uboot(update, fd, uboot_image, uboot_len, 16384 * 512, UBOOT_COPIES);
-	if (count < 0) {
-		fprintf(stderr, "error processing uboot\n");
-		close(fd);
+		perror(BOOT_DEVICE);
+		if (partfd >= 0)
+			close(partfd);
 		return 1;
 	}
-	totalcount += count;
-	count = process_idblock(update, fd, idblock_image, idblock_len);
-	if (count < 0) {
-		fprintf(stderr, "error processing idblock\n");
-		close(fd);
+	add_slots("uboot", "uboot", BOOT_DEVICE, fd, uboot_image, uboot_len,
+		  16384 * 512, UBOOT_SIZE_KB * 1024, UBOOT_COPIES);
+	add_slots("idblock", "idblock", BOOT_DEVICE, fd, idblock_image, idblock_len,
+		  64 * 512, IDBLOCK_SLOT_SIZE, IDBLOCK_COPIES);
+	totalcount = process_slots(update);
+	close(fd);
+	if (partfd >= 0)
+		close(partfd);
+	if (digest_ctx != NULL)
+		bootinfo_close(digest_ctx);
+	if (report_format == report_json)
+		print_report(update, totalcount, load_ns, now_ns() - start);
+	if (totalcount < 0) {
+		fprintf(stderr, "error processing bootloader slots\n");
 		return 1;
 	}
-	totalcount += count;
 	if (update) {
-		printf("Total update count: %d\n", totalcount);
+		if (report_format == report_text) {
+			printf("Total update count: %d\n", totalcount);
+			if (delta_mode) {
+				for (i = 0; i < slot_count; i++)
+					written += slots[i].bytes_written;
+				printf("Total bytes written: %llu\n", written);
+			}
+		}
+		if (save_digests() < 0)
+			fprintf(stderr, "warning: could not save slot digests\n");
 		return 0;
 	} else if (totalcount > 0) {
 		fprintf(stderr, "Verification failed, updates needed: %d\n", totalcount);
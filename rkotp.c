@@ -0,0 +1,426 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * rkotp.c
+ *
+ * Library for access to the non-protected OEM zone of the OTP
+ * and the secure-boot flag on RK356x/RK3588, through the OP-TEE
+ * rkstorage TA.  A context holds one TEE session open, so that
+ * several operations pay for opening the session only once; the
+ * session is opened on the first operation that needs it.
+ *
+ * Since the machine ID cannot change once programmed, rkotp_query()
+ * caches it, with the secure-boot flag, in a root-owned file in /run
+ * for the rest of the boot, unless RKOTP_O_NO_CACHE is given.
+ *
+ * Copyright (c) 2024, Matthew Madison
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <tee_client_api.h>
+#include "rkotp.h"
+
+#define RKSTORAGE_TA_UUID { 0x2d26d8a8, 0x5134, 0x4dd8, { 0xb3, 0x2f, 0xb3, 0x4b, 0xce, 0xeb, 0xc4, 0x71 } }
+#define RKSTORAGE_CMD_READ_ENABLE_FLAG		5
+#define RKSTORAGE_CMD_WRITE_OEM_NP_OTP		12
+#define RKSTORAGE_CMD_READ_OEM_NP_OTP		13
+
+#define CACHE_PATH "/run/rkotp-info"
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_SIZE 36
+static const char CACHE_MAGIC[8] = {'R', 'K', 'O', 'T', 'P', 'C', '0', '1'};
+
+/*
+ * Contents of the cache file.  The boot ID ties the
+ * cache to the current boot, and crcsum, over the rest
+ * of the record, is the integrity tag.
+ */
+struct otp_cache {
+	unsigned char magic[8];
+	char boot_id[BOOT_ID_SIZE];
+	uint8_t machine_id_set;
+	uint8_t secure_boot_enabled;
+	char machine_id[RKOTP_MACHINE_ID_SIZE];
+	uint32_t crcsum;
+} __attribute__((packed));
+
+struct rkotp_context {
+	unsigned int flags;
+	bool session_open;
+	TEEC_Context tee;
+	TEEC_Session sess;
+};
+
+/*
+ * rkotp_open
+ *
+ * Sets up a context for OTP access.  The TEE
+ * session is opened when it is first needed.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+rkotp_open (rkotp_ctx_t **ctxp, unsigned int flags)
+{
+	struct rkotp_context *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return -1;
+	ctx->flags = flags;
+	*ctxp = ctx;
+	return 0;
+
+} /* rkotp_open */
+
+/*
+ * open_session
+ *
+ * Opens the session to the rkstorage TA, if it
+ * is not already open.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+open_session (struct rkotp_context *ctx)
+{
+	TEEC_Result result;
+	TEEC_UUID rkstorage_uuid = RKSTORAGE_TA_UUID;
+	uint32_t origin;
+
+	if (ctx->session_open)
+		return 0;
+	result = TEEC_InitializeContext(NULL, &ctx->tee);
+	if (result != TEEC_SUCCESS) {
+		fprintf(stderr, "Error initializing TEE client context: 0x%x\n", result);
+		errno = EIO;
+		return -1;
+	}
+	result = TEEC_OpenSession(&ctx->tee, &ctx->sess, &rkstorage_uuid,
+				  TEEC_LOGIN_PUBLIC, NULL, NULL, &origin);
+	if (result != TEEC_SUCCESS) {
+		fprintf(stderr, "Error opening session to rkstorage TA: 0x%x (origin 0x%x)\n",
+			result, origin);
+		TEEC_FinalizeContext(&ctx->tee);
+		errno = EIO;
+		return -1;
+	}
+	ctx->session_open = true;
+	return 0;
+
+} /* open_session */
+
+/*
+ * invoke
+ *
+ * Runs one command in the session.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+static int
+invoke (struct rkotp_context *ctx, uint32_t cmd, TEEC_Operation *oper)
+{
+	TEEC_Result result;
+	uint32_t origin;
+
+	if (open_session(ctx) < 0)
+		return -1;
+	result = TEEC_InvokeCommand(&ctx->sess, cmd, oper, &origin);
+	if (result != TEEC_SUCCESS) {
+		fprintf(stderr, "Error invoking command %u: 0x%x (origin 0x%x)\n",
+			cmd, result, origin);
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+
+} /* invoke */
+
+/*
+ * rkotp_read_oem_np
+ *
+ * Reads from the non-protected OEM zone.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+rkotp_read_oem_np (rkotp_ctx_t *ctx, unsigned int offset, void *buf, size_t bufsize)
+{
+	TEEC_Operation oper;
+
+	if (ctx == NULL || buf == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&oper, 0, sizeof(oper));
+	oper.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					   TEEC_MEMREF_TEMP_OUTPUT,
+					   TEEC_NONE, TEEC_NONE);
+	oper.params[0].value.a = offset;
+	oper.params[1].tmpref.size = bufsize;
+	oper.params[1].tmpref.buffer = buf;
+	return invoke(ctx, RKSTORAGE_CMD_READ_OEM_NP_OTP, &oper);
+
+} /* rkotp_read_oem_np */
+
+/*
+ * rkotp_write_oem_np
+ *
+ * Programs data into the non-protected OEM zone.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+rkotp_write_oem_np (rkotp_ctx_t *ctx, unsigned int offset, const void *buf, size_t bufsize)
+{
+	TEEC_Operation oper;
+
+	if (ctx == NULL || buf == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&oper, 0, sizeof(oper));
+	oper.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					   TEEC_MEMREF_TEMP_INPUT,
+					   TEEC_NONE, TEEC_NONE);
+	oper.params[0].value.a = offset;
+	oper.params[1].tmpref.size = bufsize;
+	oper.params[1].tmpref.buffer = (void *) buf;
+	/*
+	 * The cache is not valid past a change to the zone.
+	 */
+	unlink(CACHE_PATH);
+	return invoke(ctx, RKSTORAGE_CMD_WRITE_OEM_NP_OTP, &oper);
+
+} /* rkotp_write_oem_np */
+
+/*
+ * rkotp_secure_boot_enabled
+ *
+ * Reads the verified-boot flag.
+ *
+ * Returns: 1 if secure boot is enabled, 0 if not,
+ *          -1 on error (errno set)
+ */
+int
+rkotp_secure_boot_enabled (rkotp_ctx_t *ctx)
+{
+	TEEC_Operation oper;
+	uint32_t vbootflag;
+
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&oper, 0, sizeof(oper));
+	oper.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT,
+					   TEEC_NONE, TEEC_NONE, TEEC_NONE);
+	oper.params[0].tmpref.size = sizeof(vbootflag);
+	oper.params[0].tmpref.buffer = &vbootflag;
+	if (invoke(ctx, RKSTORAGE_CMD_READ_ENABLE_FLAG, &oper) < 0)
+		return -1;
+	return vbootflag == 0xff;
+
+} /* rkotp_secure_boot_enabled */
+
+/*
+ * get_boot_id
+ */
+static int
+get_boot_id (char *buf)
+{
+	int fd;
+	ssize_t n;
+
+	fd = open(BOOT_ID_PATH, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, BOOT_ID_SIZE);
+	close(fd);
+	return (n == BOOT_ID_SIZE ? 0 : -1);
+
+} /* get_boot_id */
+
+/*
+ * cache_crc
+ */
+static uint32_t
+cache_crc (const struct otp_cache *cache)
+{
+	return crc32(0, (const Bytef *) cache, offsetof(struct otp_cache, crcsum));
+
+} /* cache_crc */
+
+/*
+ * read_cache
+ *
+ * Fills in info from the cache file, if there is one that
+ * is owned by root, not writable by anyone else, for the
+ * current boot, and intact.
+ *
+ * Returns: 0 on success, -1 if the cache cannot be used
+ */
+static int
+read_cache (struct rkotp_info *info)
+{
+	struct otp_cache cache;
+	char boot_id[BOOT_ID_SIZE];
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	fd = open(CACHE_PATH, O_RDONLY|O_CLOEXEC|O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != 0 ||
+	    (st.st_mode & (S_IWGRP|S_IWOTH)) != 0) {
+		close(fd);
+		return -1;
+	}
+	n = read(fd, &cache, sizeof(cache));
+	close(fd);
+	if (n != sizeof(cache) ||
+	    memcmp(cache.magic, CACHE_MAGIC, sizeof(cache.magic)) != 0 ||
+	    cache_crc(&cache) != cache.crcsum ||
+	    get_boot_id(boot_id) < 0 ||
+	    memcmp(cache.boot_id, boot_id, sizeof(boot_id)) != 0)
+		return -1;
+	memset(info, 0, sizeof(*info));
+	info->machine_id_set = cache.machine_id_set != 0;
+	memcpy(info->machine_id, cache.machine_id, sizeof(cache.machine_id));
+	info->secure_boot_enabled = cache.secure_boot_enabled != 0;
+	return 0;
+
+} /* read_cache */
+
+/*
+ * write_cache
+ *
+ * Saves info in the cache file, if we are root.  The file
+ * is written under a temporary name and renamed into place,
+ * so readers never see a partial record.
+ */
+static void
+write_cache (const struct rkotp_info *info)
+{
+	struct otp_cache cache;
+	char tmppath[sizeof(CACHE_PATH) + 16];
+	int fd;
+
+	if (geteuid() != 0)
+		return;
+	memset(&cache, 0, sizeof(cache));
+	memcpy(cache.magic, CACHE_MAGIC, sizeof(cache.magic));
+	if (get_boot_id(cache.boot_id) < 0)
+		return;
+	cache.machine_id_set = info->machine_id_set;
+	cache.secure_boot_enabled = info->secure_boot_enabled;
+	memcpy(cache.machine_id, info->machine_id, sizeof(cache.machine_id));
+	cache.crcsum = cache_crc(&cache);
+	snprintf(tmppath, sizeof(tmppath), "%s.%ld", CACHE_PATH, (long) getpid());
+	fd = open(tmppath, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if (fd < 0)
+		return;
+	if (write(fd, &cache, sizeof(cache)) != sizeof(cache) ||
+	    fchmod(fd, 0644) < 0) {
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+	close(fd);
+	if (rename(tmppath, CACHE_PATH) < 0)
+		unlink(tmppath);
+
+} /* write_cache */
+
+/*
+ * valid_machine_id
+ *
+ * Only a programmed machine ID that is all hex
+ * digits is cached.
+ */
+static bool
+valid_machine_id (const struct rkotp_info *info)
+{
+	unsigned int i;
+
+	if (!info->machine_id_set)
+		return false;
+	for (i = 0; i < RKOTP_MACHINE_ID_SIZE; i++)
+		if (!isxdigit((unsigned char) info->machine_id[i]))
+			return false;
+	return true;
+
+} /* valid_machine_id */
+
+/*
+ * rkotp_query
+ *
+ * Fetches both the machine ID and the secure-boot flag,
+ * from the cache if possible.  machine_id_set is false if
+ * the machine ID has not been programmed (the zone is all
+ * zeros).  Programmed machine IDs are cached.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+rkotp_query (rkotp_ctx_t *ctx, struct rkotp_info *info)
+{
+	char machid[RKOTP_MACHINE_ID_SIZE];
+	unsigned int i;
+	int enabled;
+
+	if (info == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((ctx->flags & RKOTP_O_NO_CACHE) == 0 && read_cache(info) == 0)
+		return 0;
+	memset(info, 0, sizeof(*info));
+	if (rkotp_read_oem_np(ctx, 0, machid, sizeof(machid)) < 0)
+		return -1;
+	enabled = rkotp_secure_boot_enabled(ctx);
+	if (enabled < 0)
+		return -1;
+	for (i = 0; i < sizeof(machid) && machid[i] == '\0'; i++);
+	info->machine_id_set = i < sizeof(machid);
+	memcpy(info->machine_id, machid, sizeof(machid));
+	info->machine_id[RKOTP_MACHINE_ID_SIZE] = '\0';
+	info->secure_boot_enabled = enabled != 0;
+	if (valid_machine_id(info))
+		write_cache(info);
+	return 0;
+
+} /* rkotp_query */
+
+/*
+ * rkotp_close
+ *
+ * Closes the session and frees the context.
+ */
+void
+rkotp_close (rkotp_ctx_t *ctx)
+{
+	if (ctx == NULL)
+		return;
+	if (ctx->session_open) {
+		TEEC_CloseSession(&ctx->sess);
+		TEEC_FinalizeContext(&ctx->tee);
+	}
+	free(ctx);
+
+} /* rkotp_close */
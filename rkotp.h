@@ -0,0 +1,43 @@
+#ifndef rkotp_h_included
+#define rkotp_h_included
+/* Copyright (c) 2024, Matthew Madison */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rkotp_context;
+typedef struct rkotp_context rkotp_ctx_t;
+
+/*
+ * The machine ID is stored as a 32-character hex string
+ * at the start of the non-protected OEM zone.
+ */
+#define RKOTP_MACHINE_ID_SIZE	32
+
+/*
+ * Flags for rkotp_open
+ */
+#define RKOTP_O_NO_CACHE	(1U<<0)
+
+struct rkotp_info {
+	bool machine_id_set;
+	char machine_id[RKOTP_MACHINE_ID_SIZE+1];
+	bool secure_boot_enabled;
+};
+
+int rkotp_open(rkotp_ctx_t **ctxp, unsigned int flags);
+int rkotp_read_oem_np(rkotp_ctx_t *ctx, unsigned int offset, void *buf, size_t bufsize);
+int rkotp_write_oem_np(rkotp_ctx_t *ctx, unsigned int offset, const void *buf, size_t bufsize);
+int rkotp_secure_boot_enabled(rkotp_ctx_t *ctx);
+int rkotp_query(rkotp_ctx_t *ctx, struct rkotp_info *info);
+void rkotp_close(rkotp_ctx_t *ctx);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* rkotp_h_included */
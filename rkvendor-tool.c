@@ -21,98 +21,25 @@
 #include <libgen.h>
 #include <histedit.h>
 #include <unistd.h>
-#include <ctype.h>
 #include <locale.h>
 #include <stdbool.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-#include <misc/rkflash_vendor_storage.h>
-#include <net/ethernet.h>
-
-typedef enum {
-	SN_ID = 1,
-	WIFI_MAC_ID,
-	LAN_MAC_ID,
-	BT_MAC_ID,
-	HDCP_14_HDMI_ID,
-	HDCP_14_DP_ID,
-	HDCP_2X_ID,
-	DRM_KEY_ID,
-	PLAYREADY_CERT_ID,
-	ATTENTION_KEY_ID,
-	PLAYREADY_ROOT_KEY_0_ID,
-	PLAYREADY_ROOT_KEY_1_ID,
-	HDCP_14_HDMIRX_ID,
-	SENSOR_CALIBRATION_ID,
-	IMEI_ID,
-	LAN_RGMII_DL_ID,
-	EINK_VCOM_ID,
-	FIRMWARE_VER_ID,
-	// must be last
-	RKVENDOR_ID___COUNT
-} rkvendor_id_type;
-
-#define RKVENDOR_ID_COUNT ((unsigned int) RKVENDOR_ID___COUNT)
-#define VENDOR_SN_MAX 513
-#define VENDOR_MAX_ETHER 2
-
-static struct RK_VENDOR_REQ *fill_vendor_req(struct RK_VENDOR_REQ *req, bool writing, rkvendor_id_type id, size_t len, void *data)
-{
-	req->tag = VENDOR_REQ_TAG;
-	req->id = (__u16) id;
-	if (writing) {
-		if (len > sizeof(req->data))
-			len = sizeof(req->data);
-		req->len = (__u16) len;
-		if (len != 0 && data != NULL)
-			memcpy(req->data, data, len);
-	} else
-		req->len = sizeof(req->data);
-	return req;
-}
-
-
-struct context_s {
-	struct RK_VENDOR_REQ data[RKVENDOR_ID_COUNT];
-	bool havedata[RKVENDOR_ID_COUNT];
-	bool modified[RKVENDOR_ID_COUNT];
-	bool readonly;
-	int fd;
-};
-typedef struct context_s *context_t;
+#include "rkvendor.h"
 
-typedef int (*option_routine_t)(context_t ctx, int argc, char * const argv[]);
+typedef int (*option_routine_t)(rkvendor_ctx_t *ctx, int argc, char * const argv[]);
 
-static int do_help(context_t ctx, int argc, char * const argv[]);
-static int do_show(context_t ctx, int argc, char * const argv[]);
-static int do_get(context_t ctx, int argc, char * const argv[]);
-static int do_set(context_t ctx, int argc, char * const argv[]);
-static int do_write(context_t ctx, int argc, char * const argv[]);
-
-static struct {
-	const char *name;
-	rkvendor_id_type id;
-	enum {
-		char_string,
-		mac_address,
-		mac_address_pair,
-	} fieldtype;
-	size_t maxsize;
-} rkvendor_fields[] = {
-	{ "serial-number", SN_ID, char_string, VENDOR_SN_MAX },
-	{ "wifi-mac",  WIFI_MAC_ID, mac_address, ETH_ALEN },
-	{ "bt-mac",  BT_MAC_ID, mac_address, ETH_ALEN },
-	{ "ether-macs", LAN_MAC_ID, mac_address_pair, VENDOR_MAX_ETHER * ETH_ALEN },
-};
-#define RKVENDOR_FIELD_COUNT (sizeof(rkvendor_fields)/sizeof(rkvendor_fields[0]))
+static int do_help(rkvendor_ctx_t *ctx, int argc, char * const argv[]);
+static int do_show(rkvendor_ctx_t *ctx, int argc, char * const argv[]);
+static int do_get(rkvendor_ctx_t *ctx, int argc, char * const argv[]);
+static int do_set(rkvendor_ctx_t *ctx, int argc, char * const argv[]);
+static int do_write(rkvendor_ctx_t *ctx, int argc, char * const argv[]);
 
 static struct {
 	const char *cmd;
 	option_routine_t rtn;
 	const char *help;
 } commands[] = {
-	{ "show",	do_show,	"show vendor data contents" },
-	{ "get",	do_get,		"get value for vendor field" },
+	{ "show",	do_show,	"show vendor data contents (all, or named fields)" },
+	{ "get",	do_get,		"get values for vendor fields" },
 	{ "set",	do_set, 	"set a value for a vendor field" },
 	{ "help",	do_help, 	"display extended help" },
 	// commands not for use in oneshot mode follow
@@ -123,144 +50,31 @@ static const int non_oneshot_commands = 2;
 
 static struct option options[] = {
 	{ "help",		no_argument,		0, 'h' },
+	{ "output",		required_argument,	0, 'o' },
 	{ 0,			0,			0, 0   }
 };
-static const char *shortopts = ":d:ch";
+static const char *shortopts = "+:d:cho:";
 
 static char *optarghelp[] = {
 	"--help               ",
+	"--output=FORMAT      ",
 };
 
 static char *opthelp[] = {
 	"display this help text",
+	"format for show/get output: text (default), keyvalue, or json",
 };
 
+static enum {
+	output_text,
+	output_keyvalue,
+	output_json,
+} output_format = output_text;
+
 static char *progname;
 static char promptstr[256];
 static int continuation;
 
-static int
-get_vendor_data (struct context_s *ctx, int i)
-{
-	int idx = (int) rkvendor_fields[i].id;
-	int ret;
-	if (ctx->havedata[idx])
-		return 0;
-	ret = ioctl(ctx->fd, VENDOR_READ_IO,
-		    fill_vendor_req(&ctx->data[idx], false, rkvendor_fields[i].id, 0, 0));
-	if (ret) {
-		if (errno != EPERM)
-			return -1;
-		ctx->data[idx].len = 0;
-		errno = 0;
-	}
-	ctx->havedata[idx] = true;
-	ctx->modified[idx] = false;
-	return 0;
-}
-
-static int
-set_vendor_data (struct context_s *ctx, int i)
-{
-	int idx = (int) rkvendor_fields[i].id;
-	int ret;
-	if (!(ctx->havedata[idx] && ctx->modified[idx]))
-		return 0;
-	ret = ioctl(ctx->fd, VENDOR_WRITE_IO, &ctx->data[idx]);
-	if (ret)
-		return -1;
-	ctx->modified[idx] = false;
-	return 0;
-}
-
-static uint8_t
-hexdigit (int c)
-{
-	if (c >= 'a' && c <= 'f')
-		return 10 + c - 'a';
-	return c - '0';
-}
-
-static ssize_t
-format_macaddr (char *buf, size_t bufsize, uint8_t *a)
-{
-	ssize_t n;
-	n = snprintf(buf, bufsize-1, "%02x:%02x:%02x:%02x:%02x:%02x",
-		     a[0], a[1], a[2], a[3], a[4], a[5]);
-	if (n > 0)
-		*(buf + n) = '\0';
-
-	return n;
-
-} /* format_macaddr */
-
-static int
-parse_macaddr (uint8_t *a, const char *buf)
-{
-	const char *cp = buf;
-	int count = 0;
-
-	/* empty string == all-zero address */
-	if (*cp == '\0') {
-		memset(a, 0, ETH_ALEN);
-		return 0;
-	}
-	while (*cp != '\0' && count < ETH_ALEN) {
-		if (!isxdigit(*cp) || !isxdigit(*(cp+1)))
-			break;
-		a[count++] = (hexdigit(tolower(*cp)) << 4) | hexdigit(tolower(*(cp+1)));
-		cp += 2;
-		if (*cp == ':' || *cp == '-')
-			cp += 1;
-	}
-	return (count == 6 && *cp == '\0') ? 0 : -1;
-
-} /* parse_macaddr */
-
-static ssize_t
-format_field (context_t ctx, int i, char *strbuf, size_t bufsize)
-{
-	int reqidx = (int) rkvendor_fields[i].id;
-	struct RK_VENDOR_REQ *req = &ctx->data[reqidx];
-	ssize_t len = -1;
-
-	if (req->len == 0) {
-		*strbuf = '\0';
-		return 0;
-	}
-
-	switch (rkvendor_fields[i].fieldtype) {
-	case char_string:
-		len = (ssize_t) req->len;
-		if (len >= bufsize)
-			len = (ssize_t) bufsize-1;
-		memcpy(strbuf, req->data, len);
-		strbuf[len] = '\0';
-		break;
-	case mac_address:
-		len = format_macaddr(strbuf, bufsize, req->data);
-		break;
-	case mac_address_pair:
-		len = format_macaddr(strbuf, bufsize, req->data);
-		strbuf[len++] = ' ';
-		len += format_macaddr(strbuf+len, bufsize-len, req->data + ETH_ALEN);
-		break;
-	default:
-		fprintf(stderr, "Internal error: unknown field type for %d\n", i);
-		break;
-	}
-	return len;
-
-} /* format_field */
-
-static int
-parse_fieldname (const char *s)
-{
-	int i;
-	for (i = 0; i < RKVENDOR_FIELD_COUNT && strcasecmp(s, rkvendor_fields[i].name) != 0; i++);
-	return i >= RKVENDOR_FIELD_COUNT ? -1 : i;
-} /* parse_fieldname */
-
 static void
 print_usage (int oneshot)
 {
@@ -288,21 +102,143 @@ print_usage (int oneshot)
 
 } /* print_usage */
 
+static void
+print_json_string (const char *s, size_t len)
+{
+	const unsigned char *cp = (const unsigned char *) s;
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < len; i++) {
+		if (cp[i] == '"' || cp[i] == '\\')
+			printf("\\%c", cp[i]);
+		else if (cp[i] < 0x20)
+			printf("\\u%04x", cp[i]);
+		else
+			putchar(cp[i]);
+	}
+	putchar('"');
+
+} /* print_json_string */
+
+/*
+ * print_json_value
+ *
+ * Strings and single MAC addresses are JSON strings;
+ * a MAC address pair is an array of two strings.
+ */
+static void
+print_json_value (int field, const char *value)
+{
+	const char *sp;
+
+	if (rkvendor_field_type(field) != RKVENDOR_FIELD_MACADDR_PAIR) {
+		print_json_string(value, strlen(value));
+		return;
+	}
+	sp = strchr(value, ' ');
+	if (sp == NULL) {
+		printf("[]");
+		return;
+	}
+	putchar('[');
+	print_json_string(value, sp - value);
+	printf(", ");
+	print_json_string(sp + 1, strlen(sp + 1));
+	putchar(']');
+
+} /* print_json_value */
+
+/*
+ * check_fieldnames
+ *
+ * Validates field-name arguments before anything
+ * is printed, so structured output is not cut short.
+ */
+static int
+check_fieldnames (int argc, char * const argv[])
+{
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (rkvendor_field_lookup(argv[i]) < 0) {
+			fprintf(stderr, "unrecognized field name: %s\n", argv[i]);
+			return -1;
+		}
+	}
+	return 0;
+
+} /* check_fieldnames */
+
+/*
+ * print_fields
+ *
+ * Prints the named fields, or all of them if argc is 0,
+ * in the selected output format.  In text format, values
+ * are printed without their names if bare is set.  The
+ * values all come from the context, which was filled in
+ * when the device was opened.
+ *
+ * Returns: number of fields that could not be read
+ */
+static int
+print_fields (rkvendor_ctx_t *ctx, int argc, char * const argv[], bool bare)
+{
+	char strbuf[RKVENDOR_VALUE_MAX];
+	const char *name;
+	int i, field, count, printed = 0, errors = 0;
+
+	count = (argc == 0 ? rkvendor_field_count() : argc);
+	if (output_format == output_json)
+		putchar('{');
+	for (i = 0; i < count; i++) {
+		field = (argc == 0 ? i : rkvendor_field_lookup(argv[i]));
+		name = rkvendor_field_name(field);
+		if (rkvendor_get(ctx, field, strbuf, sizeof(strbuf)) < 0) {
+			perror(name);
+			errors += 1;
+			continue;
+		}
+		switch (output_format) {
+		case output_json:
+			printf("%s\n  ", (printed == 0 ? "" : ","));
+			print_json_string(name, strlen(name));
+			printf(": ");
+			print_json_value(field, strbuf);
+			break;
+		case output_keyvalue:
+			printf("%s=%s\n", name, strbuf);
+			break;
+		default:
+			if (bare)
+				printf("%s\n", strbuf);
+			else
+				printf("%s: %s\n", name, strbuf);
+			break;
+		}
+		printed += 1;
+	}
+	if (output_format == output_json)
+		printf("%s}\n", (printed == 0 ? "" : "\n"));
+	return errors;
+
+} /* print_fields */
+
 /*
  * do_help
  *
  * Extended help that lists the valid tag names
  */
 static int
-do_help (context_t ctx, int argc, char * const argv[])
+do_help (rkvendor_ctx_t *ctx, int argc, char * const argv[])
 {
 
 	int i;
 
 	print_usage(0);
 	printf("\nRecognized fields:\n");
-	for (i = 0; i < RKVENDOR_FIELD_COUNT; i++)
-		printf("  %s\n", rkvendor_fields[i].name);
+	for (i = 0; i < rkvendor_field_count(); i++)
+		printf("  %s\n", rkvendor_field_name(i));
 	return 0;
 
 } /* do_help */
@@ -310,59 +246,41 @@ do_help (context_t ctx, int argc, char * const argv[])
 /*
  * do_show
  *
- * Print vendor data
+ * Print vendor data, either all fields
+ * (no arguments or --all) or just those named
  */
 static int
-do_show (context_t ctx, int argc, char * const argv[])
+do_show (rkvendor_ctx_t *ctx, int argc, char * const argv[])
 {
-	int i;
-	char strbuf[128];
-
-	for (i = 0; i < RKVENDOR_FIELD_COUNT; i++) {
-		if (get_vendor_data(ctx, i) < 0) {
-			perror(rkvendor_fields[i].name);
-			continue;
-		}
-		if (format_field(ctx, i, strbuf, sizeof(strbuf)) < 0)
-			fprintf(stderr, "Error: could not format field '%s'\n", rkvendor_fields[i].name);
-		else
-			printf("%s: %s\n", rkvendor_fields[i].name, strbuf);
-	}
-
-	return 0;
+	if (argc == 1 && strcmp(argv[0], "--all") == 0)
+		argc = 0;
+	if (check_fieldnames(argc, argv) < 0)
+		return 1;
+	return print_fields(ctx, argc, argv, false) == 0 ? 0 : 1;
 
 } /* do_show */
 
 /*
  * do_get
  *
- * Get a single value
+ * Get one or more values
  */
 static int
-do_get (context_t ctx, int argc, char * const argv[])
+do_get (rkvendor_ctx_t *ctx, int argc, char * const argv[])
 {
-	char strbuf[128];
-	int i;
+	bool bare = true;
 
 	if (argc < 1) {
 		fprintf(stderr, "missing required argument: field-name\n");
 		return 1;
 	}
-	i = parse_fieldname(argv[0]);
-	if (i < 0) {
-		fprintf(stderr, "unrecognized field name: %s\n", argv[0]);
-		return 1;
-	}
-	if (get_vendor_data(ctx, i) < 0) {
-		perror(rkvendor_fields[i].name);
-		return 1;
+	if (argc == 1 && strcmp(argv[0], "--all") == 0) {
+		argc = 0;
+		bare = false;
 	}
-	if (format_field(ctx, i, strbuf, sizeof(strbuf)) < 0) {
-		fprintf(stderr, "Error: could not format field '%s'\n", rkvendor_fields[i].name);
+	if (check_fieldnames(argc, argv) < 0)
 		return 1;
-	}
-	printf("%s\n", strbuf);
-	return 0;
+	return print_fields(ctx, argc, argv, bare) == 0 ? 0 : 1;
 
 } /* do_get */
 
@@ -373,13 +291,11 @@ do_get (context_t ctx, int argc, char * const argv[])
  * Set a single value
  */
 static int
-do_set (context_t ctx, int argc, char * const argv[])
+do_set (rkvendor_ctx_t *ctx, int argc, char * const argv[])
 {
-	int i, idx;
-	uint8_t addr[ETH_ALEN];
-	uint8_t addr_pair[ETH_ALEN*2];
+	char pairbuf[64];
 	const char *value;
-	size_t len;
+	int i;
 
 	if (argc < 1) {
 		fprintf(stderr, "missing field name argument\n");
@@ -389,57 +305,28 @@ do_set (context_t ctx, int argc, char * const argv[])
 		value = "";
 	else
 		value = argv[1];
-	i = parse_fieldname(argv[0]);
+	i = rkvendor_field_lookup(argv[0]);
 	if (i < 0) {
 		fprintf(stderr, "unrecognized field name: %s\n", argv[0]);
 		return 1;
 	}
-	if (ctx->readonly) {
-		fprintf(stderr, "Error: vendor data is read-only\n");
-		return 1;
-	}
-	idx = (int) rkvendor_fields[i].id;
-	if (get_vendor_data(ctx, i) < 0) {
-		perror(rkvendor_fields[i].name);
-		return 1;
-	}
-
-	switch (rkvendor_fields[i].fieldtype) {
-	case char_string:
-		len = strlen(value);
-		if (len >= rkvendor_fields[i].maxsize) {
-			fprintf(stderr, "Error: value longer than field length (%zu)\n", rkvendor_fields[i].maxsize-1);
-			return 1;
-		}
-		fill_vendor_req(&ctx->data[idx], true, rkvendor_fields[i].id, len, argv[1]);
-		ctx->modified[idx] = true;
-		break;
-	case mac_address:
-		if (parse_macaddr(addr, value) < 0) {
-			fprintf(stderr, "Error: could not parse MAC address '%s'\n", argv[1]);
-			return 1;
-		}
-		fill_vendor_req(&ctx->data[idx], true, rkvendor_fields[i].id, sizeof(addr), addr);
-		ctx->modified[idx] = true;
-		break;
-	case mac_address_pair:
-		if (parse_macaddr(addr_pair, value) < 0) {
-			fprintf(stderr, "Error: could not parse MAC address '%s'\n", argv[1]);
+	if (rkvendor_field_type(i) == RKVENDOR_FIELD_MACADDR_PAIR && argc > 2) {
+		if (snprintf(pairbuf, sizeof(pairbuf), "%s %s", argv[1], argv[2]) >= sizeof(pairbuf)) {
+			fprintf(stderr, "Error: could not parse MAC addresses '%s' '%s'\n", argv[1], argv[2]);
 			return 1;
 		}
-		if (argc > 2) {
-			if (parse_macaddr(addr_pair + ETH_ALEN, argv[2]) < 0) {
-				fprintf(stderr, "Error: could not parse MAC address '%s'\n", argv[2]);
-				return 1;
-			}
-		} else
-			memset(addr_pair + ETH_ALEN, 0, ETH_ALEN);
-		fill_vendor_req(&ctx->data[idx], true, rkvendor_fields[i].id, sizeof(addr_pair), addr_pair);
-		ctx->modified[idx] = true;
-		break;
-	default:
-		fprintf(stderr, "Internal error: unrecognized field type for '%s'\n", rkvendor_fields[i].name);
-		return 2;
+		value = pairbuf;
+	}
+	if (rkvendor_set(ctx, i, value) < 0) {
+		if (errno == EROFS)
+			fprintf(stderr, "Error: vendor data is read-only\n");
+		else if (errno == E2BIG)
+			fprintf(stderr, "Error: value longer than field length\n");
+		else if (rkvendor_field_type(i) != RKVENDOR_FIELD_STRING)
+			fprintf(stderr, "Error: could not parse MAC address '%s'\n", value);
+		else
+			perror(rkvendor_field_name(i));
+		return 1;
 	}
 
 	return 0;
@@ -449,26 +336,15 @@ do_set (context_t ctx, int argc, char * const argv[])
 /*
  * do_write
  *
- * Write EEPROM contents;
+ * Write updated vendor data
  */
 static int
-do_write (context_t ctx, int argc, char * const argv[])
+do_write (rkvendor_ctx_t *ctx, int argc, char * const argv[])
 {
-	int i;
-
-	if (ctx->readonly) {
-		fprintf(stderr, "Error: vendor data is read-only\n");
+	if (rkvendor_flush(ctx) < 0) {
+		perror("writing vendor data");
 		return 1;
 	}
-	for (i = 0; i < RKVENDOR_FIELD_COUNT; i++) {
-		int idx = rkvendor_fields[i].id;
-		if (ctx->modified[idx]) {
-			if (set_vendor_data(ctx, i) < 0) {
-				perror(rkvendor_fields[i].name);
-				return 1;
-			}
-		}
-	}
 	return 0;
 
 } /* do_write */
@@ -482,7 +358,7 @@ static char *prompt (EditLine *e)
  *
  */
 static int
-command_loop (context_t ctx)
+command_loop (rkvendor_ctx_t *ctx)
 {
 	option_routine_t dispatch;
 	EditLine *el;
@@ -567,8 +443,9 @@ int
 main (int argc, char * const argv[])
 {
 	int c, which, ret;
-	context_t ctx = NULL;
+	rkvendor_ctx_t *ctx = NULL;
 	option_routine_t dispatch = NULL;
+	unsigned int openflags = 0;
 	char *argv0_copy = strdup(argv[0]);
 
 	progname = basename(argv0_copy);
@@ -585,6 +462,19 @@ main (int argc, char * const argv[])
 			print_usage(1);
 			ret = 0;
 			goto depart;
+		case 'o':
+			if (strcmp(optarg, "text") == 0)
+				output_format = output_text;
+			else if (strcmp(optarg, "keyvalue") == 0)
+				output_format = output_keyvalue;
+			else if (strcmp(optarg, "json") == 0)
+				output_format = output_json;
+			else {
+				fprintf(stderr, "Error: unrecognized output format: %s\n", optarg);
+				ret = 1;
+				goto depart;
+			}
+			break;
 		default:
 			fprintf(stderr, "Error: unrecognized option\n");
 			print_usage(1);
@@ -596,40 +486,41 @@ main (int argc, char * const argv[])
 	argc -= optind;
 	argv += optind;
 
-	ctx = calloc(1, sizeof(struct context_s));
-	if (ctx == NULL) {
-		perror("allocating context structure");
-		return errno;
-	}
-	ctx->fd = open("/dev/vendor_storage", O_RDWR, 0);
-
-	if (argc < 1) {
-		ret = command_loop(ctx);
-		goto depart;
-	}
-
-	for (which = 0; which < sizeof(commands)/sizeof(commands[0])-non_oneshot_commands; which++) {
-		if (strcmp(argv[0], commands[which].cmd) == 0) {
-			dispatch = commands[which].rtn;
-			break;
+	if (argc > 0) {
+		for (which = 0; which < sizeof(commands)/sizeof(commands[0])-non_oneshot_commands; which++) {
+			if (strcmp(argv[0], commands[which].cmd) == 0) {
+				dispatch = commands[which].rtn;
+				break;
+			}
 		}
+		if (dispatch == NULL) {
+			fprintf(stderr, "Unrecognized command\n");
+			ret = 1;
+			goto depart;
+		}
+		if (dispatch == do_help) {
+			ret = do_help(NULL, argc-1, argv+1);
+			goto depart;
+		}
+		if (dispatch == do_show || dispatch == do_get)
+			openflags |= RKVENDOR_O_RDONLY;
 	}
 
-	if (dispatch == NULL) {
-		fprintf(stderr, "Unrecognized command\n");
+	if (rkvendor_open(&ctx, openflags) < 0) {
+		perror("opening vendor storage");
 		ret = 1;
 		goto depart;
 	}
 
-	argc -= 1;
-	argv += 1;
-
-	ret = dispatch(ctx, argc, argv);
+	if (argc < 1)
+		ret = command_loop(ctx);
+	else
+		ret = dispatch(ctx, argc-1, argv+1);
 depart:
 	if (ctx != NULL) {
-		do_write(ctx, 0, NULL);
-		close(ctx->fd);
-		free(ctx);
+		if (do_write(ctx, 0, NULL) != 0)
+			ret = 1;
+		rkvendor_close(ctx);
 	}
 	free(argv0_copy);
 	return ret;
@@ -0,0 +1,427 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * rkvendor.c
+ *
+ * Library for reading and modifying fields in the Rockchip-specific
+ * "vendor" storage, using the Rockchip driver interface.
+ *
+ * rkvendor_open() reads every known field in one pass, so the
+ * values are available for the life of the context without
+ * going back to the driver; modified fields are written back
+ * by rkvendor_flush().
+ *
+ * Copyright (c) 2024, Matthew Madison
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/ioctl.h>
+#include <misc/rkflash_vendor_storage.h>
+#include <net/ethernet.h>
+#include "rkvendor.h"
+
+#define VENDOR_STORAGE_DEV "/dev/vendor_storage"
+
+typedef enum {
+	SN_ID = 1,
+	WIFI_MAC_ID,
+	LAN_MAC_ID,
+	BT_MAC_ID,
+	HDCP_14_HDMI_ID,
+	HDCP_14_DP_ID,
+	HDCP_2X_ID,
+	DRM_KEY_ID,
+	PLAYREADY_CERT_ID,
+	ATTENTION_KEY_ID,
+	PLAYREADY_ROOT_KEY_0_ID,
+	PLAYREADY_ROOT_KEY_1_ID,
+	HDCP_14_HDMIRX_ID,
+	SENSOR_CALIBRATION_ID,
+	IMEI_ID,
+	LAN_RGMII_DL_ID,
+	EINK_VCOM_ID,
+	FIRMWARE_VER_ID,
+	// must be last
+	RKVENDOR_ID___COUNT
+} rkvendor_id_type;
+
+#define VENDOR_SN_MAX 513
+#define VENDOR_MAX_ETHER 2
+
+static const struct {
+	const char *name;
+	rkvendor_id_type id;
+	rkvendor_field_type_t fieldtype;
+	size_t maxsize;
+} rkvendor_fields[] = {
+	{ "serial-number", SN_ID, RKVENDOR_FIELD_STRING, VENDOR_SN_MAX },
+	{ "wifi-mac",  WIFI_MAC_ID, RKVENDOR_FIELD_MACADDR, ETH_ALEN },
+	{ "bt-mac",  BT_MAC_ID, RKVENDOR_FIELD_MACADDR, ETH_ALEN },
+	{ "ether-macs", LAN_MAC_ID, RKVENDOR_FIELD_MACADDR_PAIR, VENDOR_MAX_ETHER * ETH_ALEN },
+};
+#define RKVENDOR_FIELD_COUNT ((int)(sizeof(rkvendor_fields)/sizeof(rkvendor_fields[0])))
+
+/*
+ * Fields are indexed by their position in rkvendor_fields[].
+ * readerr holds the errno of a failed prefetch, reported
+ * when the field is retrieved.
+ */
+struct rkvendor_context {
+	struct RK_VENDOR_REQ data[RKVENDOR_FIELD_COUNT];
+	int readerr[RKVENDOR_FIELD_COUNT];
+	bool modified[RKVENDOR_FIELD_COUNT];
+	bool readonly;
+	int fd;
+};
+
+static struct RK_VENDOR_REQ *
+fill_vendor_req (struct RK_VENDOR_REQ *req, bool writing, rkvendor_id_type id, size_t len, const void *data)
+{
+	req->tag = VENDOR_REQ_TAG;
+	req->id = (__u16) id;
+	if (writing) {
+		if (len > sizeof(req->data))
+			len = sizeof(req->data);
+		req->len = (__u16) len;
+		if (len != 0 && data != NULL)
+			memcpy(req->data, data, len);
+	} else
+		req->len = sizeof(req->data);
+	return req;
+
+} /* fill_vendor_req */
+
+static bool
+valid_field (int field)
+{
+	if (field < 0 || field >= RKVENDOR_FIELD_COUNT) {
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+
+} /* valid_field */
+
+int
+rkvendor_field_count (void)
+{
+	return RKVENDOR_FIELD_COUNT;
+
+} /* rkvendor_field_count */
+
+const char *
+rkvendor_field_name (int field)
+{
+	if (!valid_field(field))
+		return NULL;
+	return rkvendor_fields[field].name;
+
+} /* rkvendor_field_name */
+
+rkvendor_field_type_t
+rkvendor_field_type (int field)
+{
+	if (!valid_field(field))
+		return RKVENDOR_FIELD_STRING;
+	return rkvendor_fields[field].fieldtype;
+
+} /* rkvendor_field_type */
+
+/*
+ * rkvendor_field_lookup
+ *
+ * Returns: field index for name (case-insensitive),
+ *          -1 if not recognized (errno set)
+ */
+int
+rkvendor_field_lookup (const char *name)
+{
+	int i;
+
+	for (i = 0; i < RKVENDOR_FIELD_COUNT; i++)
+		if (strcasecmp(name, rkvendor_fields[i].name) == 0)
+			return i;
+	errno = ENOENT;
+	return -1;
+
+} /* rkvendor_field_lookup */
+
+/*
+ * read_field
+ *
+ * Fields that the driver refuses with EPERM
+ * have not been set, and are treated as empty.
+ */
+static void
+read_field (struct rkvendor_context *ctx, int i)
+{
+	struct RK_VENDOR_REQ *req = &ctx->data[i];
+
+	if (ioctl(ctx->fd, VENDOR_READ_IO,
+		  fill_vendor_req(req, false, rkvendor_fields[i].id, 0, NULL)) == 0)
+		return;
+	req->len = 0;
+	if (errno != EPERM)
+		ctx->readerr[i] = errno;
+
+} /* read_field */
+
+/*
+ * rkvendor_open
+ *
+ * Opens the vendor storage device and reads all of
+ * the known fields.  A read error on an individual
+ * field is reported when that field is retrieved.
+ * Without RKVENDOR_O_RDONLY, falls back to read-only
+ * access if the device cannot be opened for writing.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+rkvendor_open (rkvendor_ctx_t **ctxp, unsigned int flags)
+{
+	struct rkvendor_context *ctx;
+	int i;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return -1;
+	ctx->readonly = (flags & RKVENDOR_O_RDONLY) != 0;
+	ctx->fd = open(VENDOR_STORAGE_DEV, (ctx->readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+	if (ctx->fd < 0 && !ctx->readonly && (errno == EACCES || errno == EROFS)) {
+		ctx->readonly = true;
+		ctx->fd = open(VENDOR_STORAGE_DEV, O_RDONLY | O_CLOEXEC);
+	}
+	if (ctx->fd < 0) {
+		free(ctx);
+		return -1;
+	}
+	for (i = 0; i < RKVENDOR_FIELD_COUNT; i++)
+		read_field(ctx, i);
+	*ctxp = ctx;
+	return 0;
+
+} /* rkvendor_open */
+
+static uint8_t
+hexdigit (int c)
+{
+	if (c >= 'a' && c <= 'f')
+		return 10 + c - 'a';
+	return c - '0';
+}
+
+static ssize_t
+format_macaddr (char *buf, size_t bufsize, const uint8_t *a)
+{
+	ssize_t n;
+	n = snprintf(buf, bufsize, "%02x:%02x:%02x:%02x:%02x:%02x",
+		     a[0], a[1], a[2], a[3], a[4], a[5]);
+	if (n >= (ssize_t) bufsize)
+		n = (ssize_t) bufsize - 1;
+	return n;
+
+} /* format_macaddr */
+
+static int
+parse_macaddr (uint8_t *a, const char *buf)
+{
+	const char *cp = buf;
+	int count = 0;
+
+	/* empty string == all-zero address */
+	if (*cp == '\0') {
+		memset(a, 0, ETH_ALEN);
+		return 0;
+	}
+	while (*cp != '\0' && count < ETH_ALEN) {
+		if (!isxdigit(*cp) || !isxdigit(*(cp+1)))
+			break;
+		a[count++] = (hexdigit(tolower(*cp)) << 4) | hexdigit(tolower(*(cp+1)));
+		cp += 2;
+		if (*cp == ':' || *cp == '-')
+			cp += 1;
+	}
+	return (count == 6 && *cp == '\0') ? 0 : -1;
+
+} /* parse_macaddr */
+
+/*
+ * rkvendor_get
+ *
+ * Formats the value of a field into buf, truncating
+ * it if it does not fit.  An unset field is empty.
+ *
+ * Returns: length of the formatted value,
+ *          -1 on error (errno set)
+ */
+ssize_t
+rkvendor_get (rkvendor_ctx_t *ctx, int field, char *buf, size_t bufsize)
+{
+	struct RK_VENDOR_REQ *req;
+	ssize_t len;
+
+	if (ctx == NULL || buf == NULL || bufsize == 0 || !valid_field(field)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ctx->readerr[field] != 0) {
+		errno = ctx->readerr[field];
+		return -1;
+	}
+	req = &ctx->data[field];
+	*buf = '\0';
+	if (req->len == 0)
+		return 0;
+
+	switch (rkvendor_fields[field].fieldtype) {
+	case RKVENDOR_FIELD_STRING:
+		len = (ssize_t) req->len;
+		if (len >= (ssize_t) bufsize)
+			len = (ssize_t) bufsize-1;
+		memcpy(buf, req->data, len);
+		buf[len] = '\0';
+		break;
+	case RKVENDOR_FIELD_MACADDR:
+		len = format_macaddr(buf, bufsize, req->data);
+		break;
+	case RKVENDOR_FIELD_MACADDR_PAIR:
+		len = format_macaddr(buf, bufsize, req->data);
+		if (len + 1 < (ssize_t) bufsize) {
+			buf[len++] = ' ';
+			len += format_macaddr(buf+len, bufsize-len, req->data + ETH_ALEN);
+		}
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	return len;
+
+} /* rkvendor_get */
+
+/*
+ * rkvendor_set
+ *
+ * Sets the value of a field in the context; use
+ * rkvendor_flush() to write it to storage.  A pair of
+ * MAC addresses is separated by whitespace; a missing
+ * or empty MAC address is set to all zeros.
+ *
+ * Returns: 0 on success, -1 on error (errno set):
+ *   EROFS  - context is read-only
+ *   E2BIG  - string value too long for field
+ *   EINVAL - MAC address could not be parsed
+ */
+int
+rkvendor_set (rkvendor_ctx_t *ctx, int field, const char *value)
+{
+	uint8_t addr[ETH_ALEN*VENDOR_MAX_ETHER];
+	char pairbuf[64], *second;
+	size_t len;
+
+	if (ctx == NULL || value == NULL || !valid_field(field)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ctx->readonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	switch (rkvendor_fields[field].fieldtype) {
+	case RKVENDOR_FIELD_STRING:
+		len = strlen(value);
+		if (len >= rkvendor_fields[field].maxsize) {
+			errno = E2BIG;
+			return -1;
+		}
+		fill_vendor_req(&ctx->data[field], true, rkvendor_fields[field].id, len, value);
+		break;
+	case RKVENDOR_FIELD_MACADDR:
+		if (parse_macaddr(addr, value) < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		fill_vendor_req(&ctx->data[field], true, rkvendor_fields[field].id, ETH_ALEN, addr);
+		break;
+	case RKVENDOR_FIELD_MACADDR_PAIR:
+		if (strlen(value) >= sizeof(pairbuf)) {
+			errno = EINVAL;
+			return -1;
+		}
+		strcpy(pairbuf, value);
+		for (second = pairbuf; *second != '\0' && !isspace(*second); second++);
+		if (*second != '\0') {
+			*second++ = '\0';
+			while (isspace(*second))
+				second++;
+		}
+		if (parse_macaddr(addr, pairbuf) < 0 ||
+		    parse_macaddr(addr + ETH_ALEN, second) < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		fill_vendor_req(&ctx->data[field], true, rkvendor_fields[field].id, sizeof(addr), addr);
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	ctx->readerr[field] = 0;
+	ctx->modified[field] = true;
+	return 0;
+
+} /* rkvendor_set */
+
+/*
+ * rkvendor_flush
+ *
+ * Writes any modified fields to storage.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+rkvendor_flush (rkvendor_ctx_t *ctx)
+{
+	int i;
+
+	if (ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < RKVENDOR_FIELD_COUNT; i++) {
+		if (!ctx->modified[i])
+			continue;
+		if (ioctl(ctx->fd, VENDOR_WRITE_IO, &ctx->data[i]) != 0)
+			return -1;
+		ctx->modified[i] = false;
+	}
+	return 0;
+
+} /* rkvendor_flush */
+
+/*
+ * rkvendor_close
+ *
+ * Closes the device and frees the context.  Modified
+ * fields that have not been flushed are discarded.
+ */
+void
+rkvendor_close (rkvendor_ctx_t *ctx)
+{
+	if (ctx == NULL)
+		return;
+	close(ctx->fd);
+	free(ctx);
+
+} /* rkvendor_close */
@@ -0,0 +1,48 @@
+#ifndef rkvendor_h_included
+#define rkvendor_h_included
+/* Copyright (c) 2024, Matthew Madison */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rkvendor_context;
+typedef struct rkvendor_context rkvendor_ctx_t;
+
+/*
+ * Flags for rkvendor_open
+ */
+#define RKVENDOR_O_RDONLY	(1U<<0)
+
+/*
+ * Large enough for the formatted value of any
+ * field, including the terminating NUL.
+ */
+#define RKVENDOR_VALUE_MAX	513
+
+typedef enum {
+	RKVENDOR_FIELD_STRING,
+	RKVENDOR_FIELD_MACADDR,
+	/* two MAC addresses, formatted separated by a space */
+	RKVENDOR_FIELD_MACADDR_PAIR,
+} rkvendor_field_type_t;
+
+int rkvendor_field_count(void);
+const char *rkvendor_field_name(int field);
+rkvendor_field_type_t rkvendor_field_type(int field);
+int rkvendor_field_lookup(const char *name);
+
+int rkvendor_open(rkvendor_ctx_t **ctxp, unsigned int flags);
+ssize_t rkvendor_get(rkvendor_ctx_t *ctx, int field, char *buf, size_t bufsize);
+int rkvendor_set(rkvendor_ctx_t *ctx, int field, const char *value);
+int rkvendor_flush(rkvendor_ctx_t *ctx);
+void rkvendor_close(rkvendor_ctx_t *ctx);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* rkvendor_h_included */
@@ -9,11 +9,15 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
 #include "util.h"
+#include "bootinfod.h"
 
 /*
  * set_bootdev_writeable_status
@@ -68,3 +72,117 @@ set_bootdev_writeable_status (const char *bootdev, bool make_writeable)
 	return true;
 
 } /* set_bootdev_writeable_status */
+
+/*
+ * send_all
+ *
+ * Sends a buffer completely on a stream socket,
+ * without raising SIGPIPE if the peer has gone away.
+ */
+static int
+send_all (int sock, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(sock, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const uint8_t *) buf + n;
+		len -= n;
+	}
+	return 0;
+
+} /* send_all */
+
+/*
+ * recv_all
+ *
+ * Receives a buffer completely from a stream
+ * socket, treating end-of-file as an error.
+ */
+static int
+recv_all (int sock, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(sock, buf, len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		buf = (uint8_t *) buf + n;
+		len -= n;
+	}
+	return 0;
+
+} /* recv_all */
+
+/*
+ * send_message
+ *
+ * Sends a bootinfod protocol message (see bootinfod.h).
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+send_message (int sock, uint32_t code, const void *buf, size_t len)
+{
+	struct bootinfod_msg msg;
+
+	if (len > BOOTINFOD_MAX_MESSAGE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	msg.code = code;
+	msg.length = len;
+	if (send_all(sock, &msg, sizeof(msg)) < 0)
+		return -1;
+	return (len == 0 ? 0 : send_all(sock, buf, len));
+
+} /* send_message */
+
+/*
+ * receive_message
+ *
+ * Receives a bootinfod protocol message.  The payload is
+ * returned in a malloc'ed buffer, with a null byte appended
+ * (not counted in *lenp), which the caller must free.
+ *
+ * Returns: 0 on success, -1 on error (errno set)
+ */
+int
+receive_message (int sock, uint32_t *code, void **bufp, size_t *lenp)
+{
+	struct bootinfod_msg msg;
+	uint8_t *buf;
+
+	if (recv_all(sock, &msg, sizeof(msg)) < 0)
+		return -1;
+	if (msg.length > BOOTINFOD_MAX_MESSAGE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	buf = malloc(msg.length + 1);
+	if (buf == NULL)
+		return -1;
+	if (recv_all(sock, buf, msg.length) < 0) {
+		free(buf);
+		return -1;
+	}
+	buf[msg.length] = '\0';
+	*code = msg.code;
+	*bufp = buf;
+	*lenp = msg.length;
+	return 0;
+
+} /* receive_message */
@@ -3,7 +3,11 @@
 /* Copyright (c) 2021, Matthew Madison */
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 bool set_bootdev_writeable_status(const char *bootdev, bool make_writeble);
 bool partition_should_be_present(const char *partname);
+int send_message(int sock, uint32_t code, const void *buf, size_t len);
+int receive_message(int sock, uint32_t *code, void **bufp, size_t *lenp);
 
 #endif /* util_h_included */